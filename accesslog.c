@@ -0,0 +1,211 @@
+/*
+ * accesslog.c - asynchronous access log
+ */
+#include <sys/uio.h>
+#include "csapp.h"
+#include "metrics.h"
+#include "accesslog.h"
+
+#define ALOG_LINE 512
+
+/*
+ * single-producer single-consumer ring
+ *
+ * head: next slot the producer fills (written by the producer only)
+ * tail: next slot the consumer drains (written by the consumer only)
+ * owner: 1 while a thread holds the ring as its producer
+ */
+typedef struct alog_ring {
+    unsigned long head __attribute__((aligned(METRICS_CACHELINE)));
+    unsigned long tail __attribute__((aligned(METRICS_CACHELINE)));
+    int owner __attribute__((aligned(METRICS_CACHELINE)));
+    alog_rec recs[ALOG_RING_SIZE];
+} alog_ring;
+
+/*
+ * rings: all rings, owned by at most one producer each
+ * nextring: where the next claim starts scanning
+ * ringkey: releases a thread's ring when the thread exits
+ * myring: ring owned by the calling thread, if any
+ * logfd: access log file, -1 while disabled
+ * writer: writer thread
+ * closing: set by alog_close, the writer exits once the rings are empty
+ */
+static alog_ring *rings;
+static unsigned int nextring = 0;
+static pthread_key_t ringkey;
+static __thread alog_ring *myring = NULL;
+static int logfd = -1;
+static pthread_t writer;
+static volatile int closing = 0;
+
+/*
+ * helper functions
+ *
+ * ring_claim: claim a free ring as the calling thread's producer ring
+ * ring_release: give a ring back at thread exit
+ * alog_thread: writer thread, drain rings and write formatted records
+ * alog_format: format one record as a log line, return its length
+ */
+static alog_ring *ring_claim(void);
+static void ring_release(void *ring);
+static void *alog_thread(void *vargp);
+static int alog_format(const alog_rec *rec, char *line);
+
+/*
+ * alog_open - append the access log to path and start the writer thread
+ */
+int alog_open(const char *path) {
+    if ((logfd = open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        return -1;
+    }
+    if ((rings = aligned_alloc(METRICS_CACHELINE, sizeof(alog_ring) * ALOG_RINGS)) == NULL) {
+        close(logfd);
+        logfd = -1;
+        return -1;
+    }
+    memset(rings, 0, sizeof(alog_ring) * ALOG_RINGS);
+    pthread_key_create(&ringkey, ring_release);
+    pthread_create(&writer, NULL, alog_thread, NULL);
+    return 0;
+}
+
+/*
+ * alog_close - write out every queued record, stop the writer and close the log
+ */
+void alog_close(void) {
+    if (logfd < 0) {
+        return;
+    }
+    __atomic_store_n(&closing, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    close(logfd);
+    logfd = -1;
+}
+
+/*
+ * alog_enabled - nonzero once alog_open succeeded
+ */
+int alog_enabled(void) {
+    return logfd >= 0;
+}
+
+/*
+ * alog_submit - queue rec for the writer, dropping it if the ring is full
+ */
+void alog_submit(const alog_rec *rec) {
+    alog_ring *r;
+    unsigned long head, tail;
+
+    if (logfd < 0) {
+        return;
+    }
+    if ((r = myring) == NULL && (r = ring_claim()) == NULL) {
+        metrics_add(M_ACCESSLOG_DROPS, 1);
+        return;
+    }
+
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == ALOG_RING_SIZE) {    // full -> never wait for the writer
+        metrics_add(M_ACCESSLOG_DROPS, 1);
+        return;
+    }
+    r->recs[head & (ALOG_RING_SIZE - 1)] = *rec;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_claim - claim a free ring as the calling thread's producer ring
+ * return NULL if every ring is owned
+ */
+static alog_ring *ring_claim(void) {
+    unsigned int start = __atomic_fetch_add(&nextring, 1, __ATOMIC_RELAXED);
+    int i, expected;
+    alog_ring *r;
+
+    for (i = 0; i < ALOG_RINGS; i++) {
+        r = &rings[(start + i) % ALOG_RINGS];
+        expected = 0;
+        if (__atomic_compare_exchange_n(&r->owner, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            myring = r;
+            pthread_setspecific(ringkey, r);
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * ring_release - give a ring back at thread exit
+ */
+static void ring_release(void *ring) {
+    __atomic_store_n(&((alog_ring *)ring)->owner, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * alog_thread - writer thread, drain rings and write formatted records
+ */
+static void *alog_thread(void *vargp) {
+    static char lines[ALOG_BATCH][ALOG_LINE];
+    struct iovec iov[ALOG_BATCH];
+    struct timespec idle = {0, 10 * 1000 * 1000};
+    unsigned long head, tail;
+    int i, n, drained, last;
+    alog_ring *r;
+
+    while (1) {
+        // once closing is seen, this pass finds every record still queued
+        last = __atomic_load_n(&closing, __ATOMIC_ACQUIRE);
+        drained = 0;
+        n = 0;
+        for (i = 0; i < ALOG_RINGS; i++) {
+            r = &rings[i];
+            tail = r->tail;
+            head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            for (; tail != head; tail++) {
+                iov[n].iov_base = lines[n];
+                iov[n].iov_len = alog_format(&r->recs[tail & (ALOG_RING_SIZE - 1)], lines[n]);
+                if (++n == ALOG_BATCH) {
+                    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+                    writev(logfd, iov, n);
+                    drained += n;
+                    n = 0;
+                }
+            }
+            __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        }
+        if (n > 0) {
+            writev(logfd, iov, n);
+            drained += n;
+        }
+        if (drained == 0) {
+            if (last) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * alog_format - format one record as a log line, return its length
+ * <client> [<time>] "<method> <url>" <status> <bytes> <HIT|MISS|-> <ttfb> <total>
+ */
+static int alog_format(const alog_rec *rec, char *line) {
+    static const char *cache[] = {"-", "HIT", "MISS"};
+    char addr[INET_ADDRSTRLEN], date[32];
+    time_t secs = rec->time_us / 1000000;
+    struct tm tm;
+    int len;
+
+    inet_ntop(AF_INET, &rec->addr, addr, sizeof(addr));
+    gmtime_r(&secs, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+    len = snprintf(line, ALOG_LINE, "%s:%u [%s.%06ldZ] \"%.*s %.*s\" %d %ld %s %.6f %.6f\n",
+                   addr, ntohs(rec->port), date, rec->time_us % 1000000,
+                   ALOG_METHOD_LEN, rec->method, ALOG_URL_LEN, rec->url, rec->status, rec->bytes,
+                   cache[rec->cache], rec->ttfb_us / 1e6, rec->total_us / 1e6);
+    return len < ALOG_LINE ? len : ALOG_LINE - 1;
+}
@@ -0,0 +1,68 @@
+/*
+ * accesslog.h - asynchronous access log
+ *
+ * Proxy threads copy a fixed-size binary record into a single-producer
+ * single-consumer ring that the thread owns until it exits. A background
+ * thread drains all rings, formats the records and writes them in batches
+ * with writev. A full ring drops the record (and counts the drop) instead
+ * of blocking the request.
+ */
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include <netinet/in.h>
+
+#define ALOG_RINGS 64           // rings shared out among threads
+#define ALOG_RING_SIZE 128      // records per ring (power of 2)
+#define ALOG_BATCH 64           // records per writev
+#define ALOG_METHOD_LEN 16
+#define ALOG_URL_LEN 192
+
+/* cache result of a request */
+enum alog_cache {
+    ALOG_NONE,      // rejected before the cache was consulted
+    ALOG_HIT,
+    ALOG_MISS
+};
+
+/*
+ * access log record
+ *
+ * time_us: wall-clock time the connection was accepted (microseconds since epoch)
+ * addr, port: client address and port (network byte order)
+ * status: HTTP status sent to the client, 0 if unknown
+ * cache: cache result (enum alog_cache)
+ * method, url: request method and URL, truncated to fit
+ * bytes: response bytes written to the client
+ * ttfb_us: time to first upstream byte (misses only)
+ * total_us: time from accept to close
+ */
+typedef struct alog_rec {
+    long time_us;
+    struct in_addr addr;
+    unsigned short port;
+    short status;
+    int cache;
+    char method[ALOG_METHOD_LEN];
+    char url[ALOG_URL_LEN];
+    long bytes;
+    long ttfb_us;
+    long total_us;
+} alog_rec;
+
+/*
+ * helper functions
+ *
+ * alog_open: append the access log to path and start the writer thread
+ *            return 0 on success, -1 if path cannot be opened
+ * alog_enabled: nonzero once alog_open succeeded
+ * alog_submit: queue rec for the writer, dropping it if the ring is full
+ * alog_close: write out every queued record, stop the writer and close the log
+ *             (no thread may submit afterwards)
+ */
+int alog_open(const char *path);
+int alog_enabled(void);
+void alog_submit(const alog_rec *rec);
+void alog_close(void);
+
+#endif /* __ACCESSLOG_H__ */
@@ -0,0 +1,138 @@
+/*
+ * admin.c - admin HTTP endpoint (metrics and other introspection pages)
+ *
+ * Requests are handled one at a time by a single thread: the pages are
+ * small, scraped rarely, and must never compete with proxy threads. A
+ * client gets ADMIN_READ_TIMEOUT seconds to send its request, so an idle
+ * one cannot hold up the scrapes behind it.
+ */
+#include "csapp.h"
+#include "admin.h"
+
+#define ADMIN_READ_TIMEOUT 5        // seconds to read a request
+#define ADMIN_ACCEPT_BACKOFF 100000 // microseconds to wait after accept fails (e.g. EMFILE)
+
+/*
+ * admin route table
+ *
+ * path: request path that selects the route
+ * content_type: value of the Content-Type response header
+ * render: writes the response body
+ */
+static struct {
+    const char *path;
+    const char *content_type;
+    admin_render_t *render;
+} routes[ADMIN_MAX_ROUTES];
+static int nroutes = 0;
+
+static int adminfd = -1;
+
+static const char *not_found = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 0\r\n\r\n";
+
+/*
+ * helper functions
+ *
+ * admin_thread: accept loop of the admin endpoint
+ * admin_serve: answer one admin request
+ */
+static void *admin_thread(void *vargp);
+static void admin_serve(int connfd);
+
+/*
+ * admin_register - serve render's output at path with the given content type
+ */
+void admin_register(const char *path, const char *content_type, admin_render_t *render) {
+    if (nroutes == ADMIN_MAX_ROUTES) {
+        app_error("too many admin routes");
+    }
+    routes[nroutes].path = path;
+    routes[nroutes].content_type = content_type;
+    routes[nroutes].render = render;
+    nroutes++;
+}
+
+/*
+ * admin_start - listen on port (or on fd, if not -1) and serve registered pages
+ *               from a background thread
+ */
+int admin_start(char *port, int fd) {
+    pthread_t tid;
+
+    if ((adminfd = fd) < 0 && (adminfd = open_listenfd(port)) < 0) {
+        return -1;
+    }
+    pthread_create(&tid, NULL, admin_thread, NULL);
+    return 0;
+}
+
+/*
+ * admin_fd - listening descriptor of the admin endpoint, -1 if not started
+ */
+int admin_fd(void) {
+    return adminfd;
+}
+
+/*
+ * admin_thread - accept loop of the admin endpoint
+ */
+static void *admin_thread(void *vargp) {
+    struct timeval tv = {ADMIN_READ_TIMEOUT, 0};
+    int connfd;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        if ((connfd = accept(adminfd, NULL, NULL)) < 0) {
+            // errors that persist (out of descriptors) must not spin the thread
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(ADMIN_ACCEPT_BACKOFF);
+            }
+            continue;
+        }
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        admin_serve(connfd);
+        close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * admin_serve - answer one admin request
+ */
+static void admin_serve(int connfd) {
+    char buf[MAXLINE], path[MAXLINE], hdr[MAXLINE], *body = NULL;
+    size_t bodylen = 0;
+    rio_t rio;
+    FILE *fp;
+    int i;
+
+    rio_readinitb(&rio, connfd);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0 || sscanf(buf, "%*s %s", path) != 1) {
+        return;
+    }
+    // drain request headers
+    while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+    }
+
+    for (i = 0; i < nroutes; i++) {
+        if (!strcmp(path, routes[i].path)) {
+            break;
+        }
+    }
+    if (i == nroutes) {
+        rio_writen(connfd, (void *)not_found, strlen(not_found));
+        return;
+    }
+
+    if ((fp = open_memstream(&body, &bodylen)) == NULL) {
+        return;
+    }
+    routes[i].render(fp);
+    fclose(fp);
+
+    snprintf(hdr, MAXLINE, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+             routes[i].content_type, bodylen);
+    rio_writen(connfd, hdr, strlen(hdr));
+    rio_writen(connfd, body, bodylen);
+    free(body);
+}
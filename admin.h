@@ -0,0 +1,30 @@
+/*
+ * admin.h - admin HTTP endpoint (metrics and other introspection pages)
+ */
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include <stdio.h>
+
+#define ADMIN_MAX_ROUTES 16
+
+/*
+ * admin_render_t: writes the body of a page into fp
+ */
+typedef void admin_render_t(FILE *fp);
+
+/*
+ * helper functions
+ *
+ * admin_register: serve render's output at path with the given content type
+ *                 must be called before admin_start
+ * admin_start: listen on port (or on fd, if not -1, e.g. inherited in an upgrade)
+ *              and serve registered pages from a background thread
+ *              return 0 on success, -1 if the port cannot be opened
+ * admin_fd: listening descriptor of the admin endpoint, -1 if not started
+ */
+void admin_register(const char *path, const char *content_type, admin_render_t *render);
+int admin_start(char *port, int fd);
+int admin_fd(void);
+
+#endif /* __ADMIN_H__ */
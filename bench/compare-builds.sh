@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+# compare-builds.sh - compare proxy builds under the same load
+#
+#     Runs bench/run-load.sh against each proxy binary ROUNDS times,
+#     interleaving the binaries so drift in the machine affects them all
+#     alike, and prints a table of binary size, best throughput, and the
+#     p50/p99 latency of that run.
+#
+#     usage: bench/compare-builds.sh binary...
+#     e.g.   make bench-builds
+#
+#     Environment: ROUNDS (default 3), DURATION (seconds per run, default 5)
+#
+
+HOME_DIR=$(cd "$(dirname "$0")/.." && pwd)
+ROUNDS=${ROUNDS:-3}
+DURATION=${DURATION:-5}
+
+if [ $# -eq 0 ]; then
+    echo "usage: $0 binary..." >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "${WORK}"' EXIT
+
+for round in $(seq ${ROUNDS}); do
+    for bin in "$@"; do
+        echo "round ${round}: ${bin}" >&2
+        PROXY=$(cd "$(dirname "${bin}")" && pwd)/$(basename "${bin}") \
+            "${HOME_DIR}/bench/run-load.sh" -n 200 -c 16 -d ${DURATION} -s 0.9 \
+            -o "${WORK}/$(basename "${bin}").${round}.json" || exit 1
+    done
+done
+
+python3 - "${WORK}" "$@" <<'EOF'
+import glob, json, os, sys
+
+work, bins = sys.argv[1], sys.argv[2:]
+print("| build | size (KB) | throughput (rps) | p50 (us) | p99 (us) | vs %s |" % os.path.basename(bins[0]))
+print("|---|---:|---:|---:|---:|---:|")
+first = None
+for b in bins:
+    name = os.path.basename(b)
+    runs = [json.load(open(f)) for f in glob.glob(os.path.join(work, name + ".*.json"))]
+    best = max(runs, key=lambda r: r["throughput_rps"])
+    first = first or best["throughput_rps"]
+    print("| %s | %d | %.0f | %d | %d | %+.1f%% |" % (name, os.path.getsize(b) // 1024, best["throughput_rps"],
+          best["latency_us"]["p50"], best["latency_us"]["p99"], 100.0 * (best["throughput_rps"] / first - 1)))
+EOF
@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# gate.sh - performance regression gate for "make bench"
+#
+#     Runs a fixed load (bench/run-load.sh against local tiny) and the
+#     microbenchmarks, then compares the results with a stored baseline.
+#     Exits 1 if any metric is worse than the baseline by more than its
+#     tolerance, or if there is no baseline yet. With -u the results
+#     become the new baseline instead. The combined results are written
+#     to bench.json.
+#
+#     usage: bench/gate.sh [-u]
+#
+#     Environment: PROXY (default ./proxy-opt), BASELINE (default
+#     bench/baseline.json), DURATION (load seconds, default 5), and the
+#     tolerances as fractions of the baseline: TOL_RPS (0.15),
+#     TOL_LATENCY (0.35), TOL_MICRO (0.35), TOL_HIT_RATIO (0.05, absolute)
+#
+
+HOME_DIR=$(cd "$(dirname "$0")/.." && pwd)
+export PROXY=${PROXY:-${HOME_DIR}/proxy-opt}
+BASELINE=${BASELINE:-${HOME_DIR}/bench/baseline.json}
+RESULT=${HOME_DIR}/bench.json
+DURATION=${DURATION:-5}
+UPDATE=0
+
+if [ "$1" == "-u" ]; then
+    UPDATE=1
+fi
+if [ ${UPDATE} -eq 0 ] && [ ! -f "${BASELINE}" ]; then
+    echo "no baseline at ${BASELINE}: run make bench-baseline first" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "${WORK}"' EXIT
+
+echo "Running load: 200 files, 16 connections, ${DURATION}s, zipf 0.9"
+"${HOME_DIR}/bench/run-load.sh" -n 200 -c 16 -d ${DURATION} -s 0.9 -o "${WORK}/load.json" || exit 1
+echo "Running microbenchmarks"
+"${HOME_DIR}/bench/microbench" -r 10 -o "${WORK}/micro.json" || exit 1
+
+python3 - "${WORK}/load.json" "${WORK}/micro.json" "${BASELINE}" "${RESULT}" ${UPDATE} <<'EOF'
+import json, os, sys
+
+load_file, micro_file, baseline_file, result_file, update = sys.argv[1:]
+cur = {"load": json.load(open(load_file)), "micro": json.load(open(micro_file))}
+json.dump(cur, open(result_file, "w"), indent=2)
+
+if update == "1":
+    json.dump(cur, open(baseline_file, "w"), indent=2)
+    print("baseline written to %s" % baseline_file)
+    sys.exit(0)
+base = json.load(open(baseline_file))
+
+tol = lambda name, default: float(os.environ.get(name, default))
+failed = 0
+
+def check(name, b, c, worse, limit):
+    # worse(b, c) is how much worse c is than b; compared against limit
+    global failed
+    bad = worse(b, c) > limit
+    failed += bad
+    print("%-36s %12.2f %12.2f  %s" % (name, b, c, "REGRESSION" if bad else "ok"))
+
+print("%-36s %12s %12s" % ("metric", "baseline", "current"))
+bl, cl = base["load"], cur["load"]
+lower = lambda b, c: (b - c) / b if b > 0 else 0        # relative drop
+higher = lambda b, c: (c - b) / b if b > 0 else 0       # relative rise
+check("load.throughput_rps", bl["throughput_rps"], cl["throughput_rps"], lower, tol("TOL_RPS", 0.15))
+for q in ("p50", "p99"):
+    check("load.latency_us." + q, bl["latency_us"][q], cl["latency_us"][q], higher, tol("TOL_LATENCY", 0.35))
+check("load.errors", bl["errors"], cl["errors"], lambda b, c: c - b, 0)
+if "hit_ratio" in bl and "hit_ratio" in cl:     # only when loadgen could scrape the proxy
+    check("load.hit_ratio", bl["hit_ratio"], cl["hit_ratio"], lambda b, c: b - c, tol("TOL_HIT_RATIO", 0.05))
+
+micro = {(m["name"], m["arg"]): m for m in cur["micro"]["benchmarks"]}
+for m in base["micro"]["benchmarks"]:
+    c = micro.get((m["name"], m["arg"]))
+    if c is not None:
+        check("micro.%s/%d" % (m["name"], m["arg"]), m["median"], c["median"], higher, tol("TOL_MICRO", 0.35))
+
+print("%d regression(s)" % failed)
+sys.exit(1 if failed else 0)
+EOF
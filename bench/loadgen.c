@@ -0,0 +1,409 @@
+/*
+ * loadgen.c - multi-threaded HTTP load generator for the proxy
+ *
+ * Closed loop (default): every thread issues its next request as soon as
+ * the previous one finishes. Open loop (-r): requests are scheduled at a
+ * fixed aggregate rate and latency is measured from the scheduled send
+ * time, so a slow server cannot hide its queueing delay (no coordinated
+ * omission).
+ *
+ * URLs are picked from a list with Zipf popularity (-s 0 is uniform).
+ * Results are written as one JSON object.
+ *
+ * usage: loadgen [-x proxyhost:port] [-m adminhost:port] [-c threads]
+ *                [-d seconds] [-r rate] [-k] [-s zipf] [-o out.json]
+ *                -u http://host:port -f pathlist
+ */
+#include "csapp.h"
+#include "metrics.h"
+
+#define MAX_URLS 65536
+
+/*
+ * load generator options
+ *
+ * proxyhost, proxyport: proxy to send requests through, NULL to go direct
+ * adminhost, adminport: proxy admin endpoint scraped for hit ratio, or NULL
+ * host, port: origin server of every URL
+ * paths: URL paths, most popular first
+ * cdf: cumulative Zipf probability of paths[0..i]
+ */
+static struct {
+    char *proxyhost, *proxyport;
+    char *adminhost, *adminport;
+    char *host, *port;
+    int threads;
+    int seconds;
+    double rate;
+    int keepalive;
+    double zipf;
+    char *out;
+    char *paths[MAX_URLS];
+    double cdf[MAX_URLS];
+    int npaths;
+} opt = {NULL, NULL, NULL, NULL, NULL, NULL, 16, 10, 0, 0, 0.9, NULL};
+
+/*
+ * per-thread results
+ *
+ * hist: latency histogram (metrics.h buckets, microseconds)
+ * requests, errors, bytes: completed requests, failed requests, body+header bytes
+ * maxlat: largest latency in microseconds
+ * sumlat: sum of latencies in microseconds
+ */
+typedef struct worker {
+    pthread_t tid;
+    int id;
+    unsigned long hist[HIST_BUCKETS];
+    unsigned long requests, errors, bytes, maxlat, sumlat;
+    unsigned long seed;
+} worker_t;
+
+static long deadline;
+
+/*
+ * helper functions
+ *
+ * worker: thread routine, issue requests until the deadline
+ * do_request: send one request on *fdp (connecting if needed), return bytes or -1
+ * pick_path: draw a path index with Zipf popularity
+ * split_hostport: split "host:port" in place
+ * load_paths: read URL paths from a file, one per line
+ * scrape_counter: read one counter from the proxy admin endpoint, -1 on error
+ * percentile: q-quantile of a histogram, microseconds
+ */
+static void *worker(void *vargp);
+static long do_request(worker_t *w, int *fdp, char *path);
+static int pick_path(worker_t *w);
+static void split_hostport(char *s, char **host, char **port);
+static void load_paths(char *file);
+static long scrape_counter(const char *name);
+static unsigned long percentile(unsigned long *hist, unsigned long count, double q, unsigned long max);
+
+int main(int argc, char **argv) {
+    int c, i, b;
+    char *url = NULL;
+    long hits0 = -1, miss0 = -1, hits1, miss1, begin, elapsed;
+    unsigned long hist[HIST_BUCKETS] = {0}, requests = 0, errors = 0, bytes = 0, maxlat = 0, sumlat = 0;
+    double norm = 0;
+    worker_t *w;
+    FILE *fp = stdout;
+
+    while ((c = getopt(argc, argv, "x:m:c:d:r:ks:o:u:f:")) != -1) {
+        switch (c) {
+        case 'x': split_hostport(optarg, &opt.proxyhost, &opt.proxyport); break;
+        case 'm': split_hostport(optarg, &opt.adminhost, &opt.adminport); break;
+        case 'c': opt.threads = atoi(optarg); break;
+        case 'd': opt.seconds = atoi(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 'k': opt.keepalive = 1; break;
+        case 's': opt.zipf = atof(optarg); break;
+        case 'o': opt.out = optarg; break;
+        case 'u': url = optarg; break;
+        case 'f': load_paths(optarg); break;
+        default: url = NULL; optind = argc; opt.npaths = 0;
+        }
+    }
+    if (url == NULL || strncmp(url, "http://", 7) || opt.npaths == 0 || opt.threads <= 0) {
+        fprintf(stderr, "usage: %s [-x proxyhost:port] [-m adminhost:port] [-c threads] [-d seconds]\n"
+                "       [-r rate] [-k] [-s zipf] [-o out.json] -u http://host:port -f pathlist\n", argv[0]);
+        exit(1);
+    }
+    split_hostport(url + 7, &opt.host, &opt.port);
+    if (strchr(opt.port, '/')) {
+        *strchr(opt.port, '/') = '\0';
+    }
+
+    // Zipf: P(i) proportional to 1 / (i + 1)^s
+    for (i = 0; i < opt.npaths; i++) {
+        norm += 1.0 / pow(i + 1, opt.zipf);
+        opt.cdf[i] = norm;
+    }
+    for (i = 0; i < opt.npaths; i++) {
+        opt.cdf[i] /= norm;
+    }
+
+    Signal(SIGPIPE, SIG_IGN);
+    if (opt.adminhost != NULL) {
+        hits0 = scrape_counter("proxy_cache_hits_total");
+        miss0 = scrape_counter("proxy_cache_misses_total");
+    }
+
+    w = Calloc(opt.threads, sizeof(worker_t));
+    begin = metrics_now();
+    deadline = begin + opt.seconds * 1000000000L;
+    for (i = 0; i < opt.threads; i++) {
+        w[i].id = i;
+        w[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+        Pthread_create(&w[i].tid, NULL, worker, &w[i]);
+    }
+    for (i = 0; i < opt.threads; i++) {
+        Pthread_join(w[i].tid, NULL);
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            hist[b] += w[i].hist[b];
+        }
+        requests += w[i].requests;
+        errors += w[i].errors;
+        bytes += w[i].bytes;
+        sumlat += w[i].sumlat;
+        maxlat = w[i].maxlat > maxlat ? w[i].maxlat : maxlat;
+    }
+    elapsed = metrics_now() - begin;
+
+    if (opt.out != NULL && (fp = fopen(opt.out, "w")) == NULL) {
+        unix_error("cannot open output");
+    }
+    fprintf(fp, "{\n  \"mode\": \"%s\",\n  \"via_proxy\": %s,\n  \"keepalive\": %s,\n",
+            opt.rate > 0 ? "open" : "closed", opt.proxyhost ? "true" : "false", opt.keepalive ? "true" : "false");
+    fprintf(fp, "  \"concurrency\": %d,\n  \"target_rate\": %.1f,\n  \"zipf\": %.3f,\n  \"urls\": %d,\n",
+            opt.threads, opt.rate, opt.zipf, opt.npaths);
+    fprintf(fp, "  \"duration_s\": %.3f,\n  \"requests\": %lu,\n  \"errors\": %lu,\n  \"bytes\": %lu,\n",
+            elapsed / 1e9, requests, errors, bytes);
+    fprintf(fp, "  \"throughput_rps\": %.1f,\n", requests / (elapsed / 1e9));
+    fprintf(fp, "  \"latency_us\": {\"mean\": %.1f, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}",
+            requests ? (double)sumlat / requests : 0.0, percentile(hist, requests, 0.5, maxlat),
+            percentile(hist, requests, 0.99, maxlat), percentile(hist, requests, 0.999, maxlat), maxlat);
+    if (opt.adminhost != NULL && hits0 >= 0 && miss0 >= 0 &&
+        (hits1 = scrape_counter("proxy_cache_hits_total")) >= 0 &&
+        (miss1 = scrape_counter("proxy_cache_misses_total")) >= 0 && hits1 + miss1 > hits0 + miss0) {
+        fprintf(fp, ",\n  \"hit_ratio\": %.4f", (double)(hits1 - hits0) / (hits1 + miss1 - hits0 - miss0));
+    }
+    fprintf(fp, "\n}\n");
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    return 0;
+}
+
+/*
+ * worker - thread routine, issue requests until the deadline
+ */
+static void *worker(void *vargp) {
+    worker_t *w = vargp;
+    int fd = -1;
+    long sched, now, n, interval = 0;
+    unsigned long lat;
+    struct timespec ts;
+
+    // open loop: this thread's share of the rate, staggered across threads
+    sched = metrics_now();
+    if (opt.rate > 0) {
+        interval = (long)(1e9 * opt.threads / opt.rate);
+        sched += interval * w->id / opt.threads;
+    }
+    while ((now = metrics_now()) < deadline) {
+        if (interval > 0) {
+            if (sched >= deadline) {
+                break;
+            }
+            if (sched > now) {
+                ts.tv_sec = (sched - now) / 1000000000L;
+                ts.tv_nsec = (sched - now) % 1000000000L;
+                nanosleep(&ts, NULL);
+            }
+        } else {
+            sched = now;
+        }
+
+        n = do_request(w, &fd, opt.paths[pick_path(w)]);
+        lat = (metrics_now() - sched) / 1000;
+        sched += interval;
+        if (n < 0) {
+            w->errors++;
+            continue;
+        }
+        w->requests++;
+        w->bytes += n;
+        w->hist[metrics_bucket(lat)]++;
+        w->sumlat += lat;
+        if (lat > w->maxlat) {
+            w->maxlat = lat;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * do_request - send one request on *fdp (connecting if needed), return bytes or -1
+ * the connection is kept in *fdp only if keep-alive is on and the response allows it
+ */
+static long do_request(worker_t *w, int *fdp, char *path) {
+    char buf[MAXLINE];
+    long clen = -1, total = 0, n;
+    int reuse = opt.keepalive, status;
+    rio_t rio;
+
+    if (*fdp < 0) {
+        *fdp = opt.proxyhost ? open_clientfd(opt.proxyhost, opt.proxyport) : open_clientfd(opt.host, opt.port);
+        if (*fdp < 0) {
+            return -1;
+        }
+    }
+    if (opt.proxyhost) {
+        snprintf(buf, MAXLINE, "GET http://%s:%s%s HTTP/1.%d\r\nHost: %s:%s\r\nConnection: %s\r\n\r\n",
+                 opt.host, opt.port, path, opt.keepalive, opt.host, opt.port, opt.keepalive ? "keep-alive" : "close");
+    } else {
+        snprintf(buf, MAXLINE, "GET %s HTTP/1.%d\r\nHost: %s:%s\r\nConnection: %s\r\n\r\n",
+                 path, opt.keepalive, opt.host, opt.port, opt.keepalive ? "keep-alive" : "close");
+    }
+    if (rio_writen(*fdp, buf, strlen(buf)) < 0) {
+        goto fail;
+    }
+
+    // status line and headers
+    rio_readinitb(&rio, *fdp);
+    if ((n = rio_readlineb(&rio, buf, MAXLINE)) <= 0 || sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1) {
+        goto fail;
+    }
+    total += n;
+    while ((n = rio_readlineb(&rio, buf, MAXLINE)) > 0) {
+        total += n;
+        if (!strcmp(buf, "\r\n")) {
+            break;
+        }
+        if (!strncasecmp(buf, "Content-length:", 15)) {
+            clen = atol(buf + 15);
+        } else if (!strncasecmp(buf, "Connection:", 11) && !strncasecmp(buf + 11 + strspn(buf + 11, " \t"), "close", 5)) {
+            reuse = 0;
+        }
+    }
+    if (n <= 0) {
+        goto fail;
+    }
+
+    // body: Content-Length bytes, or up to EOF
+    if (clen < 0) {
+        reuse = 0;
+        while ((n = rio_readnb(&rio, buf, MAXLINE)) > 0) {
+            total += n;
+        }
+    } else {
+        while (clen > 0 && (n = rio_readnb(&rio, buf, clen < MAXLINE ? clen : MAXLINE)) > 0) {
+            total += n;
+            clen -= n;
+        }
+        if (clen > 0) {
+            goto fail;
+        }
+    }
+    // bytes already buffered by rio cannot be handed to the next request
+    if (rio.rio_cnt > 0) {
+        reuse = 0;
+    }
+    if (!reuse) {
+        close(*fdp);
+        *fdp = -1;
+    }
+    return status < 400 ? total : -1;
+
+fail:
+    close(*fdp);
+    *fdp = -1;
+    return -1;
+}
+
+/*
+ * pick_path - draw a path index with Zipf popularity
+ */
+static int pick_path(worker_t *w) {
+    double u;
+    int lo = 0, hi = opt.npaths - 1, mid;
+
+    // xorshift64*
+    w->seed ^= w->seed >> 12;
+    w->seed ^= w->seed << 25;
+    w->seed ^= w->seed >> 27;
+    u = ((w->seed * 0x2545f4914f6cdd1dUL) >> 11) / 9007199254740992.0;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (opt.cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * split_hostport - split "host:port" in place
+ */
+static void split_hostport(char *s, char **host, char **port) {
+    char *colon = strchr(s, ':');
+
+    if (colon == NULL) {
+        app_error("expected host:port");
+    }
+    *colon = '\0';
+    *host = s;
+    *port = colon + 1;
+}
+
+/*
+ * load_paths - read URL paths from a file, one per line
+ */
+static void load_paths(char *file) {
+    char line[MAXLINE];
+    FILE *fp = Fopen(file, "r");
+
+    while (opt.npaths < MAX_URLS && fgets(line, MAXLINE, fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '/') {
+            opt.paths[opt.npaths++] = strdup(line);
+        }
+    }
+    Fclose(fp);
+}
+
+/*
+ * scrape_counter - read one counter from the proxy admin endpoint, -1 on error
+ */
+static long scrape_counter(const char *name) {
+    char buf[MAXLINE];
+    size_t len = strlen(name);
+    long v = -1;
+    int fd;
+    rio_t rio;
+
+    if ((fd = open_clientfd(opt.adminhost, opt.adminport)) < 0) {
+        return -1;
+    }
+    snprintf(buf, MAXLINE, "GET /metrics HTTP/1.0\r\n\r\n");
+    rio_writen(fd, buf, strlen(buf));
+    rio_readinitb(&rio, fd);
+    while (rio_readlineb(&rio, buf, MAXLINE) > 0) {
+        if (!strncmp(buf, name, len) && buf[len] == ' ') {
+            v = atol(buf + len + 1);
+        }
+    }
+    close(fd);
+    return v;
+}
+
+/*
+ * percentile - q-quantile of a histogram, microseconds
+ * bucket upper bounds are capped at the largest value actually seen
+ */
+static unsigned long percentile(unsigned long *hist, unsigned long count, double q, unsigned long max) {
+    unsigned long rank, seen = 0;
+    int b;
+
+    if (count == 0) {
+        return 0;
+    }
+    rank = (unsigned long)(q * count);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) {
+            return metrics_bucket_upper(b) < max ? metrics_bucket_upper(b) : max;
+        }
+    }
+    return max;
+}
@@ -0,0 +1,349 @@
+/*
+ * microbench.c - microbenchmarks for the parser, cache and Rio primitives
+ *
+ * Every benchmark runs warmup batches that also size a batch to take about
+ * `batchms` milliseconds (unless -n fixes the batch size), then `reps`
+ * timed batches, and reports mean, standard deviation, min and median of
+ * the per-batch ns/op. Results are written as JSON.
+ *
+ * usage: microbench [-r reps] [-t batchms] [-n iters] [-f filter] [-o out.json]
+ */
+#include "csapp.h"
+#include "metrics.h"
+#include "cache.h"
+#include "http.h"
+
+#define MAX_REPS 1000
+#define RIO_LINE_LEN 64
+
+/*
+ * benchmark descriptor
+ *
+ * name: reported name
+ * arg: size parameter (cache items, ...), 0 if unused
+ * setup: prepare state before the warmup (may be NULL)
+ * run: perform n operations, return the number actually timed in ns (or -1 to time the call)
+ * teardown: release state (may be NULL)
+ */
+typedef struct bench {
+    const char *name;
+    int arg;
+    void (*setup)(int arg);
+    long (*run)(int arg, long n);
+    void (*teardown)(int arg);
+} bench_t;
+
+static int reps = 20;
+static long batchms = 10;
+static long iters = 0;     // fixed batch size, 0 to calibrate
+static volatile long sink;     // keeps results alive
+
+/*
+ * helper functions
+ *
+ * run_bench: run one benchmark and print its JSON object
+ * cmp_double: qsort comparator
+ * fill_cache: fill the shared cache with n small items named /obj/<i>
+ */
+static void run_bench(FILE *fp, bench_t *b, int first);
+static int cmp_double(const void *a, const void *b);
+static void fill_cache(int n);
+
+/*
+ * parser benchmarks
+ */
+static long bench_check_request_line(int arg, long n) {
+    static const char line[] = "GET http://www.cmu.edu:8080/hub/index.html HTTP/1.1\r\n";
+    char buf[sizeof(line)], *method, *url, *version;
+    long i;
+
+    for (i = 0; i < n; i++) {
+        memcpy(buf, line, sizeof(line));
+        sink += check_request_line(buf, &method, &url, &version);
+    }
+    return -1;
+}
+
+static long bench_parse_url(int arg, long n) {
+    static const char url[] = "http://www.cmu.edu:8080/hub/index.html";
+    char buf[sizeof(url)], *host, *port, *uri;
+    long i;
+
+    for (i = 0; i < n; i++) {
+        memcpy(buf, url, sizeof(url));
+        parse_url(buf, &host, &port, &uri);
+        sink += host[0] + port[0] + uri[0];
+        free(host);
+        free(port);
+        free(uri);
+    }
+    return -1;
+}
+
+/*
+ * cache benchmarks: one cache shared by the benchmarks, refilled per size
+ */
+static cache_t cache;
+static char **keys;
+static unsigned long rng = 88172645463325252UL;    // xorshift state, carried across batches
+
+static void fill_cache(int n) {
+    char uri[MAXLINE], data[256];
+    int i;
+
+    memset(data, 'x', sizeof(data));
+    cache_init(&cache, MAX_CACHE_SIZE);
+    for (i = 0; i < n; i++) {
+        snprintf(uri, MAXLINE, "/obj/%d", i);
+        insert_cache(&cache, strdup("www.cmu.edu"), strdup("80"), strdup(uri), data, sizeof(data));
+    }
+}
+
+static void setup_cache(int arg) {
+    char uri[MAXLINE];
+    int i;
+
+    fill_cache(arg);
+    keys = malloc(sizeof(char *) * arg);
+    for (i = 0; i < arg; i++) {
+        snprintf(uri, MAXLINE, "/obj/%d", i);
+        keys[i] = strdup(uri);
+    }
+}
+
+static void teardown_cache(int arg) {
+    int i;
+
+    cache_free(&cache);
+    for (i = 0; i < arg; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+/* uniformly random hits; each hit moves the item to the front, so the keys
+ * must not repeat from one batch to the next */
+static long bench_get_cached_item(int arg, long n) {
+    unsigned long x = rng;
+    cacheitem *item;
+    long i;
+
+    for (i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        item = get_cached_item(&cache, "www.cmu.edu", "80", keys[x % arg]);
+        sink += item->length;
+        put_cached_item(&cache, item);
+    }
+    rng = x;
+    return -1;
+}
+
+/* misses walk the whole list */
+static long bench_get_cached_item_miss(int arg, long n) {
+    long i;
+
+    for (i = 0; i < n; i++) {
+        sink += get_cached_item(&cache, "www.cmu.edu", "80", "/missing") == NULL;
+    }
+    return -1;
+}
+
+/* delete the last of `arg` items; the refill is not timed */
+static long bench_delete_last_cache(int arg, long n) {
+    char data[256], uri[MAXLINE];
+    long i, done = 0, t0, elapsed = 0;
+    int batch = arg / 10 > 0 ? arg / 10 : 1, j;
+
+    memset(data, 'x', sizeof(data));
+    for (i = 0; i < n; i += done) {
+        t0 = metrics_now();
+        pthread_mutex_lock(&cache.cachelock);
+        for (j = 0; j < batch && i + j < n && cache.cachehead->next != NULL; j++) {
+            delete_last_cache(&cache);
+        }
+        pthread_mutex_unlock(&cache.cachelock);
+        elapsed += metrics_now() - t0;
+        if ((done = j) == 0) {
+            break;
+        }
+        for (; j > 0; j--) {
+            snprintf(uri, MAXLINE, "/refill/%ld", i + j);
+            insert_cache(&cache, strdup("www.cmu.edu"), strdup("80"), strdup(uri), data, sizeof(data));
+        }
+    }
+    return elapsed;
+}
+
+/*
+ * Rio benchmarks on a socketpair; refills of the socket are not timed
+ */
+static int sv[2];
+
+static void setup_socketpair(int arg) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        unix_error("socketpair");
+    }
+}
+
+static void teardown_socketpair(int arg) {
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static long bench_rio_readlineb(int arg, long n) {
+    char lines[64 * RIO_LINE_LEN], buf[MAXLINE];
+    long i, t0, elapsed = 0;
+    rio_t rio;
+    int j;
+
+    for (j = 0; j < 64; j++) {
+        memset(lines + j * RIO_LINE_LEN, 'h', RIO_LINE_LEN - 2);
+        memcpy(lines + (j + 1) * RIO_LINE_LEN - 2, "\r\n", 2);
+    }
+    rio_readinitb(&rio, sv[1]);
+    for (i = 0; i < n; i += 64) {
+        rio_writen(sv[0], lines, sizeof(lines));
+        t0 = metrics_now();
+        for (j = 0; j < 64; j++) {
+            sink += rio_readlineb(&rio, buf, MAXLINE);
+        }
+        elapsed += metrics_now() - t0;
+    }
+    return elapsed;
+}
+
+static long bench_rio_readnb(int arg, long n) {
+    static char block[8 * MAXLINE], buf[MAXLINE];
+    long i, t0, elapsed = 0;
+    rio_t rio;
+    int j;
+
+    rio_readinitb(&rio, sv[1]);
+    for (i = 0; i < n; i += 8) {
+        rio_writen(sv[0], block, sizeof(block));
+        t0 = metrics_now();
+        for (j = 0; j < 8; j++) {
+            sink += rio_readnb(&rio, buf, MAXLINE);
+        }
+        elapsed += metrics_now() - t0;
+    }
+    return elapsed;
+}
+
+static bench_t benches[] = {
+    {"check_request_line", 0, NULL, bench_check_request_line, NULL},
+    {"parse_url", 0, NULL, bench_parse_url, NULL},
+    {"get_cached_item", 10, setup_cache, bench_get_cached_item, teardown_cache},
+    {"get_cached_item", 100, setup_cache, bench_get_cached_item, teardown_cache},
+    {"get_cached_item", 1000, setup_cache, bench_get_cached_item, teardown_cache},
+    {"get_cached_item", 4000, setup_cache, bench_get_cached_item, teardown_cache},
+    {"get_cached_item_miss", 100, setup_cache, bench_get_cached_item_miss, teardown_cache},
+    {"get_cached_item_miss", 4000, setup_cache, bench_get_cached_item_miss, teardown_cache},
+    {"delete_last_cache", 100, setup_cache, bench_delete_last_cache, teardown_cache},
+    {"delete_last_cache", 4000, setup_cache, bench_delete_last_cache, teardown_cache},
+    {"rio_readlineb", RIO_LINE_LEN, setup_socketpair, bench_rio_readlineb, teardown_socketpair},
+    {"rio_readnb", MAXLINE, setup_socketpair, bench_rio_readnb, teardown_socketpair},
+};
+
+int main(int argc, char **argv) {
+    char *filter = NULL, *out = NULL;
+    int c, i, first = 1;
+    FILE *fp = stdout;
+
+    while ((c = getopt(argc, argv, "r:t:n:f:o:")) != -1) {
+        switch (c) {
+        case 'r': reps = atoi(optarg); break;
+        case 't': batchms = atol(optarg); break;
+        case 'n': iters = atol(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'o': out = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-r reps] [-t batchms] [-n iters] [-f filter] [-o out.json]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (reps < 1 || reps > MAX_REPS || iters < 0 || batchms < 1) {
+        app_error("reps must be 1..1000, batchms positive");
+    }
+    if (out != NULL && (fp = fopen(out, "w")) == NULL) {
+        unix_error("cannot open output");
+    }
+
+    fprintf(fp, "{\n  \"reps\": %d,\n  \"batch_ms\": %ld,\n  \"benchmarks\": [", reps, batchms);
+    for (i = 0; i < sizeof(benches) / sizeof(bench_t); i++) {
+        if (filter != NULL && strstr(benches[i].name, filter) == NULL) {
+            continue;
+        }
+        run_bench(fp, &benches[i], first);
+        first = 0;
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    return 0;
+}
+
+/*
+ * run_bench - run one benchmark and print its JSON object
+ */
+static void run_bench(FILE *fp, bench_t *b, int first) {
+    double nsop[MAX_REPS], mean = 0, var = 0;
+    long t0, elapsed, n = 1;
+    int r;
+
+    if (b->setup != NULL) {
+        b->setup(b->arg);
+    }
+    // warmup: double the batch until it takes batchms (or run -n once)
+    while (1) {
+        t0 = metrics_now();
+        elapsed = b->run(b->arg, iters > 0 ? iters : n);
+        if (elapsed < 0) {
+            elapsed = metrics_now() - t0;
+        }
+        if (iters > 0) {
+            n = iters;
+            break;
+        }
+        if (elapsed >= batchms * 1000000L) {
+            break;
+        }
+        n *= 2;
+    }
+    for (r = 0; r < reps; r++) {
+        t0 = metrics_now();
+        elapsed = b->run(b->arg, n);
+        if (elapsed < 0) {
+            elapsed = metrics_now() - t0;
+        }
+        nsop[r] = (double)elapsed / n;
+        mean += nsop[r];
+    }
+    if (b->teardown != NULL) {
+        b->teardown(b->arg);
+    }
+
+    mean /= reps;
+    for (r = 0; r < reps; r++) {
+        var += (nsop[r] - mean) * (nsop[r] - mean);
+    }
+    var = reps > 1 ? var / (reps - 1) : 0;
+    qsort(nsop, reps, sizeof(double), cmp_double);
+
+    fprintf(fp, "%s\n    {\"name\": \"%s\", \"arg\": %d, \"iters\": %ld, \"ns_per_op\": %.2f, "
+            "\"stddev\": %.2f, \"min\": %.2f, \"median\": %.2f}", first ? "" : ",", b->name, b->arg, n,
+            mean, sqrt(var), nsop[0], nsop[reps / 2]);
+    fflush(fp);
+}
+
+/*
+ * cmp_double - qsort comparator
+ */
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,676 @@
+/*
+ * origin.c - fault-injecting origin server for proxy benchmarks
+ *
+ * An epoll event loop per thread (threads share the port with
+ * SO_REUSEPORT) serves a synthetic corpus and can inject latency, slow
+ * bodies, resets, huge headers, and chunked encoding:
+ *
+ *   GET /obj/<i>      object i of the corpus (0 <= i < -n), a fixed size
+ *                     drawn once from -s min:max
+ *   GET /size/<n>     an n-byte body
+ *
+ * Options
+ *   -m serve|hang     hang: accept connections and never answer (replaces
+ *                     nop-server.py without burning a core)
+ *   -n objects        corpus size (default 1000)
+ *   -s min:max        corpus object sizes in bytes (default 1024:65536)
+ *   -l dist           response latency: fixed:<ms>, uniform:<lo>:<hi>,
+ *                     exp:<mean>, lognormal:<median>:<sigma> (default none)
+ *   -r bytes/sec      trickle the body at this rate (default unlimited)
+ *   -R prob           reset the connection (RST) mid-response with this probability
+ *   -H bytes          pad the response headers with this many header bytes
+ *   -c                send the body with Transfer-Encoding: chunked
+ *   -t threads        event loop threads (default 1)
+ *
+ * usage: origin [options] <port>
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LISTENQ 1024
+#define MAXLINE 8192
+
+#define MAX_EVENTS 256
+#define REQ_MAX 16384
+#define OUT_MAX 16384
+#define CHUNK 4096
+#define PATTERN_LEN 65536
+#define TRICKLE_TICK_MS 10
+
+enum { LAT_NONE, LAT_FIXED, LAT_UNIFORM, LAT_EXP, LAT_LOGNORMAL };
+
+/*
+ * origin options (see the header comment)
+ */
+static struct {
+    int hang;
+    int nobjects;
+    long minsize, maxsize;
+    int latency;
+    double lat_a, lat_b;
+    long rate;
+    double resetprob;
+    long hdrpad;
+    int chunked;
+    int threads;
+    char *port;
+} opt = {0, 1000, 1024, 65536, LAT_NONE, 0, 0, 0, 0, 0, 0, 1, NULL};
+
+/* connection states; a closed one waits for the end of the event batch to be freed */
+enum { C_READING, C_WAITING, C_WRITING, C_CLOSED };
+
+/*
+ * connection
+ *
+ * fd: client socket
+ * tfd: timerfd for latency and trickle pacing, -1 until needed
+ * state: C_READING, C_WAITING (latency timer), C_WRITING, C_CLOSED
+ * req, reqlen: request bytes received so far
+ * keepalive: serve another request after this one
+ * status, bodylen, bodysent: current response
+ * out, outlen, outpos: bytes ready to write
+ * events: epoll events currently watched on fd
+ * hdrdone: status line and fixed headers written
+ * resetat: reset the connection once this many body bytes are sent, -1 never
+ * budget: bytes still allowed in this trickle tick
+ * next: link in the loop's list of closed connections
+ */
+typedef struct conn {
+    int fd;
+    int tfd;
+    int state;
+    char req[REQ_MAX];
+    int reqlen;
+    int keepalive;
+    int status;
+    long bodylen, bodysent;
+    char out[OUT_MAX + 64];
+    int outlen, outpos;
+    unsigned int events;
+    int hdrdone;
+    long resetat;
+    long budget;
+    struct conn *next;
+} conn_t;
+
+/*
+ * per-thread event loop
+ *
+ * epfd: epoll instance
+ * listenfd: this thread's listening socket
+ * seed: xorshift state for latency, reset and corpus sampling
+ * closed: connections closed in this event batch, whose later events are stale
+ */
+typedef struct loop {
+    int epfd;
+    int listenfd;
+    unsigned long seed;
+    struct conn *closed;
+} loop_t;
+
+static char pattern[PATTERN_LEN];
+static long *objsize;
+
+/*
+ * helper functions
+ *
+ * event_loop: thread routine, serve connections until killed
+ * open_reuseport: listening socket on opt.port with SO_REUSEPORT
+ * handle_read: read request bytes, start a response once headers are complete
+ * start_response: parse the request and arm the latency timer or start writing
+ * handle_write: write as much of the response as pacing and the socket allow
+ * fill_out: append the next piece of the response to c->out, return its length
+ * handle_timer: latency elapsed or a new trickle tick began
+ * arm_timer: (re)arm c's timerfd to fire once after ms, or every ms if periodic
+ * watch: set the epoll events watched on c->fd
+ * close_conn: close a connection, with RST if reset is set
+ * header_is: nonzero if request header name starts with value (case-insensitive)
+ * draw_latency: draw a latency in ms from the configured distribution
+ * rnd: uniform double in [0, 1)
+ * die: print msg and exit
+ */
+static void *event_loop(void *vargp);
+static int open_reuseport(char *port);
+static void handle_read(loop_t *l, conn_t *c);
+static void start_response(loop_t *l, conn_t *c);
+static void handle_write(loop_t *l, conn_t *c);
+static int fill_out(conn_t *c);
+static void handle_timer(loop_t *l, conn_t *c);
+static void arm_timer(loop_t *l, conn_t *c, double ms, int periodic);
+static void watch(loop_t *l, conn_t *c, unsigned int events);
+static void close_conn(loop_t *l, conn_t *c, int reset);
+static int header_is(char *req, char *name, char *value);
+static double draw_latency(loop_t *l);
+static double rnd(loop_t *l);
+static void die(char *msg);
+
+int main(int argc, char **argv) {
+    int ch, i;
+    pthread_t tid;
+    unsigned long x = 0x2545f4914f6cdd1dUL;
+    char *p;
+
+    while ((ch = getopt(argc, argv, "m:n:s:l:r:R:H:ct:")) != -1) {
+        switch (ch) {
+        case 'm':
+            opt.hang = !strcmp(optarg, "hang");
+            break;
+        case 'n':
+            opt.nobjects = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%ld:%ld", &opt.minsize, &opt.maxsize) != 2 || opt.minsize > opt.maxsize) {
+                die("-s expects min:max");
+            }
+            break;
+        case 'l':
+            p = strchr(optarg, ':');
+            if (p == NULL) {
+                die("-l expects dist:params");
+            }
+            if (!strncmp(optarg, "fixed:", 6)) {
+                opt.latency = LAT_FIXED;
+            } else if (!strncmp(optarg, "uniform:", 8)) {
+                opt.latency = LAT_UNIFORM;
+            } else if (!strncmp(optarg, "exp:", 4)) {
+                opt.latency = LAT_EXP;
+            } else if (!strncmp(optarg, "lognormal:", 10)) {
+                opt.latency = LAT_LOGNORMAL;
+            } else {
+                die("unknown latency distribution");
+            }
+            sscanf(p + 1, "%lf:%lf", &opt.lat_a, &opt.lat_b);
+            break;
+        case 'r':
+            opt.rate = atol(optarg);
+            break;
+        case 'R':
+            opt.resetprob = atof(optarg);
+            break;
+        case 'H':
+            opt.hdrpad = atol(optarg);
+            break;
+        case 'c':
+            opt.chunked = 1;
+            break;
+        case 't':
+            opt.threads = atoi(optarg);
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1 || opt.threads < 1 || opt.nobjects < 0) {
+        fprintf(stderr, "usage: %s [-m serve|hang] [-n objects] [-s min:max] [-l dist] [-r bytes/sec]\n"
+                "       [-R prob] [-H bytes] [-c] [-t threads] <port>\n", argv[0]);
+        exit(1);
+    }
+    opt.port = argv[optind];
+    signal(SIGPIPE, SIG_IGN);
+
+    // printable body pattern and fixed corpus sizes
+    for (i = 0; i < PATTERN_LEN; i++) {
+        pattern[i] = 'a' + i % 26;
+    }
+    if ((objsize = malloc(sizeof(long) * (opt.nobjects + 1))) == NULL) {
+        die("out of memory");
+    }
+    for (i = 0; i < opt.nobjects; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        objsize[i] = opt.minsize + (long)(x % (unsigned long)(opt.maxsize - opt.minsize + 1));
+    }
+
+    for (i = 1; i < opt.threads; i++) {
+        if (pthread_create(&tid, NULL, event_loop, (void *)(long)i) != 0) {
+            die("pthread_create");
+        }
+    }
+    event_loop((void *)0L);
+    return 0;
+}
+
+/*
+ * event_loop - thread routine, serve connections until killed
+ */
+static void *event_loop(void *vargp) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    loop_t l;
+    conn_t *c;
+    int n, i, fd, one = 1;
+
+    l.seed = 0x9e3779b97f4a7c15UL * ((long)vargp + 1);
+    l.closed = NULL;
+    l.listenfd = open_reuseport(opt.port);
+    if ((l.epfd = epoll_create1(0)) < 0) {
+        die("epoll_create1");
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;     // NULL marks the listening socket
+    epoll_ctl(l.epfd, EPOLL_CTL_ADD, l.listenfd, &ev);
+
+    while (1) {
+        if ((n = epoll_wait(l.epfd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("epoll_wait");
+        }
+        for (i = 0; i < n; i++) {
+            if ((c = events[i].data.ptr) == NULL) {
+                while ((fd = accept4(l.listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    if (opt.hang) {
+                        continue;   // leak the socket open, never answer
+                    }
+                    if ((c = calloc(1, sizeof(conn_t))) == NULL) {
+                        close(fd);
+                        continue;
+                    }
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+                    c->fd = fd;
+                    c->tfd = -1;
+                    c->state = C_READING;
+                    c->events = EPOLLIN;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(l.epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+            // timer events are tagged by the low bit of the pointer
+            if ((unsigned long)c & 1) {
+                c = (conn_t *)((unsigned long)c & ~1UL);
+                if (c->state != C_CLOSED) {
+                    handle_timer(&l, c);
+                }
+            } else if (c->state == C_READING) {
+                handle_read(&l, c);
+            } else if (c->state == C_WRITING) {
+                handle_write(&l, c);
+            }
+        }
+        while ((c = l.closed) != NULL) {
+            l.closed = c->next;
+            free(c);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * open_reuseport - listening socket on opt.port with SO_REUSEPORT
+ */
+static int open_reuseport(char *port) {
+    struct addrinfo hints, *list, *p;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &list) != 0) {
+        die("getaddrinfo");
+    }
+    for (p = list; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(int));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, LISTENQ) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    if (fd < 0) {
+        die("cannot listen");
+    }
+    return fd;
+}
+
+/*
+ * handle_read - read request bytes, start a response once headers are complete
+ */
+static void handle_read(loop_t *l, conn_t *c) {
+    int n;
+
+    while ((n = read(c->fd, c->req + c->reqlen, REQ_MAX - 1 - c->reqlen)) > 0) {
+        c->reqlen += n;
+        c->req[c->reqlen] = '\0';
+        if (strstr(c->req, "\r\n\r\n") != NULL) {
+            start_response(l, c);
+            return;
+        }
+        if (c->reqlen == REQ_MAX - 1) {     // request headers too large
+            close_conn(l, c, 0);
+            return;
+        }
+    }
+    if (n == 0 || errno != EAGAIN) {
+        close_conn(l, c, 0);
+    }
+}
+
+/*
+ * start_response - parse the request and arm the latency timer or start writing
+ */
+static void start_response(loop_t *l, conn_t *c) {
+    char method[16], path[MAXLINE], version[16] = "";
+    long i;
+    double ms;
+
+    c->status = 404;
+    c->bodylen = 0;
+    if (sscanf(c->req, "%15s %8191s %15s", method, path, version) == 3) {
+        if (sscanf(path, "/obj/%ld", &i) == 1 && i >= 0 && i < opt.nobjects) {
+            c->status = 200;
+            c->bodylen = objsize[i];
+        } else if (sscanf(path, "/size/%ld", &i) == 1 && i >= 0) {
+            c->status = 200;
+            c->bodylen = i;
+        }
+    }
+    // HTTP/1.1 keeps the connection unless the client says close
+    if (!strcmp(version, "HTTP/1.1")) {
+        c->keepalive = !header_is(c->req, "Connection", "close");
+    } else {
+        c->keepalive = header_is(c->req, "Connection", "keep-alive");
+    }
+    c->reqlen = 0;
+    c->bodysent = 0;
+    c->hdrdone = 0;
+    c->outlen = c->outpos = 0;
+    c->resetat = (opt.resetprob > 0 && rnd(l) < opt.resetprob) ? (long)(rnd(l) * c->bodylen) : -1;
+    c->budget = opt.rate > 0 ? opt.rate * TRICKLE_TICK_MS / 1000 + 1 : -1;
+    watch(l, c, 0);     // ignore the client until the response is written
+
+    if ((ms = draw_latency(l)) > 0) {
+        c->state = C_WAITING;
+        arm_timer(l, c, ms, 0);
+        return;
+    }
+    c->state = C_WRITING;
+    if (opt.rate > 0) {
+        arm_timer(l, c, TRICKLE_TICK_MS, 1);
+    }
+    handle_write(l, c);
+}
+
+/*
+ * handle_write - write as much of the response as pacing and the socket allow
+ */
+static void handle_write(loop_t *l, conn_t *c) {
+    int n, len;
+
+    while (1) {
+        if (c->outpos == c->outlen) {
+            if (c->resetat >= 0 && c->bodysent >= c->resetat && c->hdrdone) {
+                close_conn(l, c, 1);
+                return;
+            }
+            // coalesce pieces so headers and small bodies go out in one write
+            c->outpos = c->outlen = 0;
+            while (c->outlen < OUT_MAX - CHUNK - 1100 && fill_out(c) > 0) {
+            }
+            if (c->outlen == 0) {   // response complete
+                if (!c->keepalive) {
+                    close_conn(l, c, 0);
+                    return;
+                }
+                if (c->tfd >= 0) {
+                    arm_timer(l, c, 0, 0);
+                }
+                c->state = C_READING;
+                watch(l, c, EPOLLIN);
+                return;
+            }
+        }
+        len = c->outlen - c->outpos;
+        if (c->budget >= 0 && len > c->budget) {
+            len = c->budget;
+        }
+        if (len == 0) {     // out of budget until the next trickle tick
+            watch(l, c, 0);
+            return;
+        }
+        if ((n = write(c->fd, c->out + c->outpos, len)) < 0) {
+            if (errno == EAGAIN) {
+                watch(l, c, EPOLLOUT);
+                return;
+            }
+            close_conn(l, c, 0);
+            return;
+        }
+        c->outpos += n;
+        if (c->budget >= 0) {
+            c->budget -= n;
+        }
+    }
+}
+
+/*
+ * fill_out - append the next piece of the response to c->out, return its length
+ * returns 0 once the response is complete
+ */
+static int fill_out(conn_t *c) {
+    long n, pad, off;
+    char *start = c->out + c->outlen, *p = start;
+
+    if (!c->hdrdone) {
+        p += sprintf(p, "HTTP/1.1 %d %s\r\nServer: origin\r\nContent-Type: text/plain\r\n",
+                     c->status, c->status == 200 ? "OK" : "Not Found");
+        if (opt.chunked) {
+            p += sprintf(p, "Transfer-Encoding: chunked\r\n");
+        } else {
+            p += sprintf(p, "Content-Length: %ld\r\n", c->bodylen);
+        }
+        p += sprintf(p, "Connection: %s\r\n", c->keepalive ? "keep-alive" : "close");
+        c->hdrdone = 1;
+        // header padding is emitted in X-Padding lines of up to 1000 bytes
+        c->bodysent = -opt.hdrpad - 2;
+        c->outlen += p - start;
+        return p - start;
+    }
+    if (c->bodysent < -2) {
+        pad = -c->bodysent - 2;
+        n = pad > 1000 ? 1000 : pad;
+        memcpy(p, "X-Padding: ", 11);
+        memset(p + 11, 'p', n);
+        memcpy(p + 11 + n, "\r\n", 2);
+        c->outlen += n + 13;
+        c->bodysent += n;
+        return n + 13;
+    }
+    if (c->bodysent == -2) {
+        memcpy(p, "\r\n", 2);
+        n = 2;
+        c->bodysent = 0;
+        if (c->bodylen == 0 && opt.chunked) {
+            memcpy(p + 2, "0\r\n\r\n", 5);
+            n += 5;
+            c->bodysent = 1;    // past the end
+        }
+        c->outlen += n;
+        return n;
+    }
+    if (c->bodysent >= c->bodylen) {
+        return 0;
+    }
+
+    n = c->bodylen - c->bodysent;
+    if (n > CHUNK) {
+        n = CHUNK;
+    }
+    off = c->bodysent % PATTERN_LEN;
+    if (off + n > PATTERN_LEN) {
+        n = PATTERN_LEN - off;
+    }
+    if (opt.chunked) {
+        p += sprintf(p, "%lx\r\n", n);
+    }
+    memcpy(p, pattern + off, n);
+    p += n;
+    c->bodysent += n;
+    if (opt.chunked) {
+        p += sprintf(p, "\r\n%s", c->bodysent == c->bodylen ? "0\r\n\r\n" : "");
+    }
+    c->outlen += p - start;
+    return p - start;
+}
+
+/*
+ * handle_timer - latency elapsed or a new trickle tick began
+ */
+static void handle_timer(loop_t *l, conn_t *c) {
+    unsigned long expirations;
+
+    if (read(c->tfd, &expirations, sizeof(expirations)) < 0) {
+        return;
+    }
+    if (c->state == C_WAITING) {
+        c->state = C_WRITING;
+        if (opt.rate > 0) {
+            arm_timer(l, c, TRICKLE_TICK_MS, 1);
+        }
+    } else if (c->state == C_WRITING && opt.rate > 0) {
+        c->budget = opt.rate * TRICKLE_TICK_MS / 1000 + 1;
+    } else {
+        return;
+    }
+    handle_write(l, c);
+}
+
+/*
+ * arm_timer - (re)arm c's timerfd to fire once after ms, or every ms if periodic
+ * ms == 0 disarms it
+ */
+static void arm_timer(loop_t *l, conn_t *c, double ms, int periodic) {
+    struct itimerspec its;
+    struct epoll_event ev;
+    long ns = (long)(ms * 1e6);
+
+    if (c->tfd < 0) {
+        if ((c->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+            die("timerfd_create");
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = (void *)((unsigned long)c | 1);
+        epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->tfd, &ev);
+    }
+    memset(&its, 0, sizeof(its));
+    if (ns > 0) {
+        its.it_value.tv_sec = ns / 1000000000L;
+        its.it_value.tv_nsec = ns % 1000000000L;
+        if (periodic) {
+            its.it_interval = its.it_value;
+        }
+    }
+    timerfd_settime(c->tfd, 0, &its, NULL);
+}
+
+/*
+ * watch - set the epoll events watched on c->fd
+ */
+static void watch(loop_t *l, conn_t *c, unsigned int events) {
+    struct epoll_event ev;
+
+    if (c->events == events) {
+        return;
+    }
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+/*
+ * close_conn - close a connection, with RST if reset is set
+ * it is freed once the event batch ends, so its stale events can be skipped
+ */
+static void close_conn(loop_t *l, conn_t *c, int reset) {
+    struct linger lg = {1, 0};
+
+    if (reset) {
+        setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(c->fd);       // also removes it from the epoll set
+    if (c->tfd >= 0) {
+        close(c->tfd);
+    }
+    c->state = C_CLOSED;
+    c->next = l->closed;
+    l->closed = c;
+}
+
+/*
+ * draw_latency - draw a latency in ms from the configured distribution
+ */
+static double draw_latency(loop_t *l) {
+    double u;
+
+    switch (opt.latency) {
+    case LAT_FIXED:
+        return opt.lat_a;
+    case LAT_UNIFORM:
+        return opt.lat_a + rnd(l) * (opt.lat_b - opt.lat_a);
+    case LAT_EXP:
+        return -opt.lat_a * log(1.0 - rnd(l));
+    case LAT_LOGNORMAL:
+        // Box-Muller: lat_a is the median, lat_b sigma of the underlying normal
+        u = sqrt(-2.0 * log(1.0 - rnd(l))) * cos(2 * M_PI * rnd(l));
+        return opt.lat_a * exp(opt.lat_b * u);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * rnd - uniform double in [0, 1)
+ */
+static double rnd(loop_t *l) {
+    l->seed ^= l->seed >> 12;
+    l->seed ^= l->seed << 25;
+    l->seed ^= l->seed >> 27;
+    return ((l->seed * 0x2545f4914f6cdd1dUL) >> 11) / 9007199254740992.0;
+}
+
+/*
+ * header_is - nonzero if request header name starts with value (case-insensitive)
+ */
+static int header_is(char *req, char *name, char *value) {
+    size_t len = strlen(name);
+    char *line;
+
+    for (line = strstr(req, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, name, len) && line[2 + len] == ':') {
+            line += 3 + len;
+            line += strspn(line, " \t");
+            return !strncasecmp(line, value, strlen(value));
+        }
+    }
+    return 0;
+}
+
+/*
+ * die - print msg and exit
+ */
+static void die(char *msg) {
+    fprintf(stderr, "%s: %s\n", msg, errno ? strerror(errno) : "invalid argument");
+    exit(1);
+}
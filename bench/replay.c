@@ -0,0 +1,283 @@
+/*
+ * replay.c - replay a request trace through the proxy cache offline
+ *
+ * Every request of the trace is looked up with get_cached_item and, on a
+ * miss, inserted with insert_cache exactly as the proxy does (objects of
+ * MAX_OBJECT_SIZE bytes or more are never cached), once per eviction
+ * policy and cache size. No sockets are involved. For each run it reports
+ * object and byte hit ratio, insertions, evictions, and the memory the
+ * cache spends on items, keys and allocator slack beyond the object data.
+ *
+ * The trace is either the proxy's access log (-l; requests that never
+ * reached the cache are skipped) or lines of "timestamp key size", where
+ * key is a URL or a bare path and fields are separated by blanks or commas.
+ *
+ * usage: replay [-l] [-p lru,fifo,clock] [-s size[,size...]] [-o out.json] trace
+ *        sizes take a K or M suffix (default MAX_CACHE_SIZE)
+ */
+#include <limits.h>
+#include <malloc.h>
+#include "csapp.h"
+#include "metrics.h"
+#include "cache.h"
+#include "http.h"
+
+#define MAX_SIZES 32
+
+/*
+ * one request of the trace
+ *
+ * ts: timestamp in seconds
+ * host, port, uri: cache key
+ * size: response size in bytes
+ */
+typedef struct req {
+    double ts;
+    char *host, *port, *uri;
+    int size;
+} req_t;
+
+/*
+ * results of one replay
+ *
+ * hits, hitbytes, bytes: cache hits, bytes served from cache, bytes requested
+ * uncacheable: requests for objects too large to cache
+ * inserts, evictions: from the cache's own metrics counters
+ * objects, databytes: cache contents at the end of the trace
+ * overhead: bytes allocated for those objects beyond their data
+ */
+typedef struct result {
+    long hits, hitbytes, bytes, uncacheable;
+    long inserts, evictions;
+    long objects, databytes, overhead;
+} result_t;
+
+static req_t *reqs;
+static long nreqs, maxreqs;
+static char data[MAX_OBJECT_SIZE];    // contents of every inserted object
+
+/*
+ * helper functions
+ *
+ * load_trace: read the trace into reqs
+ * parse_line: parse one trace line into r, return 0 if it is a request
+ * parse_size: parse a size with an optional K or M suffix, -1 if invalid
+ * replay: replay the trace through a fresh cache
+ * overhead: bytes the cache allocated beyond the object data
+ */
+static void load_trace(char *file, int accesslog);
+static int parse_line(char *line, int accesslog, req_t *r);
+static long parse_size(char *s);
+static void replay(enum cache_policy policy, int capacity, result_t *res);
+static long overhead(cache_t *cache);
+
+int main(int argc, char **argv) {
+    char *out = NULL, *save, *s;
+    int c, i, p, nsizes = 0, npolicies = 0, accesslog = 0, first = 1;
+    int sizes[MAX_SIZES];
+    enum cache_policy policies[CACHE_NPOLICIES];
+    long v;
+    result_t res;
+    FILE *fp = stdout;
+
+    while ((c = getopt(argc, argv, "p:s:lo:")) != -1) {
+        switch (c) {
+        case 'p':
+            for (s = strtok_r(optarg, ",", &save); s != NULL; s = strtok_r(NULL, ",", &save)) {
+                for (p = 0; p < CACHE_NPOLICIES && strcmp(s, cache_policy_name(p)); p++) {
+                }
+                if (p == CACHE_NPOLICIES || npolicies == CACHE_NPOLICIES) {
+                    app_error("policies are lru, fifo and clock");
+                }
+                policies[npolicies++] = p;
+            }
+            break;
+        case 's':
+            for (s = strtok_r(optarg, ",", &save); s != NULL; s = strtok_r(NULL, ",", &save)) {
+                if ((v = parse_size(s)) <= 0 || v > INT_MAX || nsizes == MAX_SIZES) {
+                    app_error("invalid cache size");
+                }
+                sizes[nsizes++] = v;
+            }
+            break;
+        case 'l': accesslog = 1; break;
+        case 'o': out = optarg; break;
+        default: optind = argc;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-l] [-p lru,fifo,clock] [-s size[,size...]] [-o out.json] trace\n", argv[0]);
+        exit(1);
+    }
+    if (npolicies == 0) {
+        for (p = 0; p < CACHE_NPOLICIES; p++) {
+            policies[npolicies++] = p;
+        }
+    }
+    if (nsizes == 0) {
+        sizes[nsizes++] = MAX_CACHE_SIZE;
+    }
+    load_trace(argv[optind], accesslog);
+    if (out != NULL && (fp = fopen(out, "w")) == NULL) {
+        unix_error("cannot open output");
+    }
+
+    fprintf(fp, "{\n  \"trace\": \"%s\",\n  \"requests\": %ld,\n  \"span_s\": %.3f,\n  \"runs\": [",
+            argv[optind], nreqs, nreqs > 0 ? reqs[nreqs - 1].ts - reqs[0].ts : 0.0);
+    for (p = 0; p < npolicies; p++) {
+        for (i = 0; i < nsizes; i++) {
+            replay(policies[p], sizes[i], &res);
+            fprintf(fp, "%s\n    {\"policy\": \"%s\", \"capacity\": %d, \"hits\": %ld, "
+                    "\"object_hit_ratio\": %.4f, \"byte_hit_ratio\": %.4f, \"uncacheable\": %ld, "
+                    "\"inserts\": %ld, \"evictions\": %ld, \"objects\": %ld, \"data_bytes\": %ld, "
+                    "\"overhead_bytes\": %ld, \"overhead_per_object\": %.1f}",
+                    first ? "" : ",", cache_policy_name(policies[p]), sizes[i], res.hits,
+                    nreqs > 0 ? (double)res.hits / nreqs : 0.0,
+                    res.bytes > 0 ? (double)res.hitbytes / res.bytes : 0.0, res.uncacheable,
+                    res.inserts, res.evictions, res.objects, res.databytes, res.overhead,
+                    res.objects > 0 ? (double)res.overhead / res.objects : 0.0);
+            fflush(fp);
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    return 0;
+}
+
+/*
+ * load_trace - read the trace into reqs
+ */
+static void load_trace(char *file, int accesslog) {
+    char line[MAXLINE];
+    long lineno = 0;
+    FILE *fp;
+    req_t r;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        unix_error("cannot open trace");
+    }
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        lineno++;
+        if (parse_line(line, accesslog, &r) < 0) {
+            continue;
+        }
+        if (nreqs == maxreqs) {
+            maxreqs = maxreqs ? maxreqs * 2 : 4096;
+            reqs = realloc(reqs, sizeof(req_t) * maxreqs);
+        }
+        reqs[nreqs++] = r;
+    }
+    fclose(fp);
+    if (nreqs == 0) {
+        fprintf(stderr, "no requests in %s (%ld lines)\n", file, lineno);
+        exit(1);
+    }
+}
+
+/*
+ * parse_line - parse one trace line into r, return 0 if it is a request
+ *
+ * access log: addr:port [YYYY-MM-DDTHH:MM:SS.uuuuuuZ] "METHOD URL" status bytes HIT|MISS|- ...
+ * otherwise:  timestamp key size
+ */
+static int parse_line(char *line, int accesslog, req_t *r) {
+    char key[MAXLINE], cachefield[8];
+    struct tm tm;
+    long usec;
+    int status;
+
+    memset(&tm, 0, sizeof(tm));
+    if (accesslog) {
+        if (sscanf(line, "%*s [%d-%d-%dT%d:%d:%d.%ldZ] \"%*s %s %d %d %7s", &tm.tm_year, &tm.tm_mon,
+                   &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &usec, key, &status, &r->size,
+                   cachefield) != 11 || !strcmp(cachefield, "-")) {
+            return -1;
+        }
+        key[strcspn(key, "\"")] = '\0';
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        r->ts = timegm(&tm) + usec / 1e6;
+    } else if (line[0] == '#' || sscanf(line, "%lf%*[ \t,]%[^ \t,]%*[ \t,]%d", &r->ts, key, &r->size) != 3) {
+        return -1;
+    }
+    if (r->size < 0) {
+        return -1;
+    }
+    if (key[0] == '/') {        // bare path: every request goes to the same origin
+        r->host = strdup("origin");
+        r->port = strdup("80");
+        r->uri = strdup(key);
+    } else {
+        parse_url(key, &r->host, &r->port, &r->uri);
+    }
+    return 0;
+}
+
+/*
+ * parse_size - parse a size with an optional K or M suffix, -1 if invalid
+ */
+static long parse_size(char *s) {
+    char *end;
+    long v = strtol(s, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K': v *= 1024; end++; break;
+    case 'm': case 'M': v *= 1024 * 1024; end++; break;
+    }
+    return *end == '\0' ? v : -1;
+}
+
+/*
+ * replay - replay the trace through a fresh cache
+ */
+static void replay(enum cache_policy policy, int capacity, result_t *res) {
+    cache_t cache;
+    cacheitem *item;
+    req_t *r;
+    long i;
+
+    memset(res, 0, sizeof(result_t));
+    res->inserts = -metrics_counter_value(M_CACHE_INSERTS);
+    res->evictions = -metrics_counter_value(M_CACHE_EVICTIONS);
+    cache_init(&cache, capacity);
+    cache.policy = policy;
+
+    for (i = 0; i < nreqs; i++) {
+        r = &reqs[i];
+        res->bytes += r->size;
+        if ((item = get_cached_item(&cache, r->host, r->port, r->uri)) != NULL) {
+            res->hits++;
+            res->hitbytes += r->size;
+            put_cached_item(&cache, item);
+        } else if (r->size >= MAX_OBJECT_SIZE) {
+            res->uncacheable++;
+        } else {
+            insert_cache(&cache, strdup(r->host), strdup(r->port), strdup(r->uri), data, r->size);
+        }
+    }
+
+    res->inserts += metrics_counter_value(M_CACHE_INSERTS);
+    res->evictions += metrics_counter_value(M_CACHE_EVICTIONS);
+    res->objects = cache.cachehead->length;
+    res->databytes = cache.cachesize;
+    res->overhead = overhead(&cache);
+    cache_free(&cache);
+}
+
+/*
+ * overhead - bytes the cache allocated beyond the object data
+ * items, keys and allocator slack, including the list head
+ */
+static long overhead(cache_t *cache) {
+    long n = malloc_usable_size(cache->cachehead);
+    cacheitem *item;
+
+    for (item = cache->cachehead->next; item != NULL; item = item->next) {
+        n += malloc_usable_size(item) + malloc_usable_size(item->host) + malloc_usable_size(item->port) +
+             malloc_usable_size(item->uri) + malloc_usable_size(item->data) - item->length;
+    }
+    return n;
+}
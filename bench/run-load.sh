@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# run-load.sh - start tiny and the proxy locally and measure them with loadgen
+#
+#     Generates a synthetic corpus of NFILES files (mostly small, some
+#     larger than MAX_OBJECT_SIZE so they are never cached), serves it with
+#     tiny, starts the proxy with an admin port, and runs loadgen through
+#     the proxy. The loadgen JSON (throughput, p50/p99/p999 latency, hit
+#     ratio) is written to stdout or to the -o file.
+#
+#     usage: bench/run-load.sh [-n nfiles] [loadgen options...]
+#     e.g.   bench/run-load.sh -n 500 -c 32 -d 10 -s 1.0 -k -o result.json
+#
+#     Environment: PROXY (default ./proxy), TINY (default ./tiny/tiny)
+#
+
+HOME_DIR=$(cd "$(dirname "$0")/.." && pwd)
+PROXY=${PROXY:-${HOME_DIR}/proxy}
+TINY=${TINY:-${HOME_DIR}/tiny/tiny}
+LOADGEN=${LOADGEN:-${HOME_DIR}/bench/loadgen}
+NFILES=200
+
+if [ "$1" == "-n" ]; then
+    NFILES=$2
+    shift 2
+fi
+
+for bin in "${PROXY}" "${TINY}" "${LOADGEN}"; do
+    if [ ! -x "${bin}" ]; then
+        echo "Error: ${bin} not found; run make, make -C tiny and make -C bench" >&2
+        exit 1
+    fi
+done
+
+#
+# free_port - print an unused TCP port
+#
+function free_port {
+    python3 -c 'import socket; s = socket.socket(); s.bind(("", 0)); print(s.getsockname()[1])'
+}
+
+#
+# wait_for_port - spin until something listens on port $1 (5 seconds max)
+#
+function wait_for_port {
+    for i in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing listening on port $1" >&2
+    return 1
+}
+
+WORK=$(mktemp -d)
+trap 'kill ${TINY_PID} ${PROXY_PID} 2>/dev/null; wait 2>/dev/null; rm -rf "${WORK}"' EXIT
+
+# synthetic corpus: 90% 1-16KB, 9% 16-96KB, 1% 128-512KB (uncacheable)
+mkdir -p "${WORK}/obj"
+: > "${WORK}/paths"
+RANDOM=42
+for i in $(seq 0 $((NFILES - 1))); do
+    r=$((RANDOM % 100))
+    if [ $r -lt 90 ]; then
+        size=$(( (RANDOM % 16 + 1) * 1024 ))
+    elif [ $r -lt 99 ]; then
+        size=$(( (RANDOM % 80 + 16) * 1024 ))
+    else
+        size=$(( (RANDOM % 384 + 128) * 1024 ))
+    fi
+    head -c ${size} /dev/zero | tr '\0' 'x' > "${WORK}/obj/${i}.html"
+    echo "/obj/${i}.html" >> "${WORK}/paths"
+done
+
+TINY_PORT=$(free_port)
+PROXY_PORT=$(free_port)
+ADMIN_PORT=$(free_port)
+
+(cd "${WORK}" && exec "${TINY}" ${TINY_PORT} > /dev/null 2>&1) &
+TINY_PID=$!
+"${PROXY}" -a ${ADMIN_PORT} ${PROXY_PORT} > /dev/null 2>&1 &
+PROXY_PID=$!
+wait_for_port ${TINY_PORT} || exit 1
+wait_for_port ${PROXY_PORT} || exit 1
+
+"${LOADGEN}" -x 127.0.0.1:${PROXY_PORT} -m 127.0.0.1:${ADMIN_PORT} \
+    -u http://127.0.0.1:${TINY_PORT} -f "${WORK}/paths" "$@"
@@ -0,0 +1,327 @@
+/*
+ * cache.c - web object cache with LRU, FIFO or CLOCK eviction
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+#include "probes.h"
+#include "cache.h"
+
+/* snapshot file: magic, then per item the lengths of host, port, uri and data
+ * followed by their bytes, last item of the list first */
+#define SNAPSHOT_MAGIC "PROXYCACHE1\n"
+#define SNAPSHOT_MAX_KEY 8192
+
+/*
+ * helper functions
+ *
+ * read_string: read a len-byte string (at most max) from a snapshot, NULL on error
+ */
+static char *read_string(FILE *fp, int len, int max);
+
+/*
+ * cache_init - init an empty LRU cache holding at most capacity bytes of data
+ */
+void cache_init(cache_t *cache, int capacity) {
+    cache->cachehead = malloc(sizeof(cacheitem));
+    cache->cachehead->length = 0;
+    cache->cachehead->refcnt = 0;
+    cache->cachehead->referenced = 0;
+    cache->cachehead->host = NULL;
+    cache->cachehead->port = NULL;
+    cache->cachehead->uri = NULL;
+    cache->cachehead->data = NULL;
+    cache->cachehead->next = NULL;
+    cache->cachesize = 0;
+    cache->capacity = capacity;
+    cache->policy = CACHE_LRU;
+    pthread_mutex_init(&cache->cachelock, NULL);
+}
+
+/*
+ * cache_free - free every item and the list head (no readers may remain)
+ */
+void cache_free(cache_t *cache) {
+    cacheitem *curr = cache->cachehead->next;
+    cacheitem *next;
+
+    while (curr != NULL) {
+        next = curr->next;
+        free_cache_item(curr);
+        curr = next;
+    }
+    free(cache->cachehead);
+    pthread_mutex_destroy(&cache->cachelock);
+}
+
+/*
+ * get_cached_item - return cached data if same request exists in cache list
+ *                   for LRU eviction policy, move recently used item at the first of cache list
+ *                   for CLOCK, mark it referenced
+ */
+cacheitem *get_cached_item(cache_t *cache, char *host, char *port, char *uri) {
+    cacheitem *prev, *curr;
+
+    pthread_mutex_lock(&cache->cachelock);
+    prev = cache->cachehead;
+    curr = cache->cachehead->next;
+    while (curr != NULL) {
+        if (!strcmp(host, curr->host) && !strcmp(port, curr->port) && !strcmp(uri, curr->uri)) {
+            if (cache->policy == CACHE_LRU) {
+                prev->next = curr->next;
+                curr->next = cache->cachehead->next;
+                cache->cachehead->next = curr;
+            }
+            curr->referenced = 1;
+            curr->refcnt++;
+            pthread_mutex_unlock(&cache->cachelock);
+            return curr;
+        }
+        prev = curr;
+        curr = curr->next;
+    }
+    pthread_mutex_unlock(&cache->cachelock);
+    return NULL;
+}
+
+/*
+ * put_cached_item - release an item returned by get_cached_item
+ */
+void put_cached_item(cache_t *cache, cacheitem *item) {
+    int refcnt;
+
+    pthread_mutex_lock(&cache->cachelock);
+    refcnt = --(item->refcnt);
+    pthread_mutex_unlock(&cache->cachelock);
+    if (refcnt == 0) {      // evicted while we were sending it
+        free_cache_item(item);
+    }
+}
+
+/*
+ * insert_cache - insert a copy of data at the first of cache list, evicting as needed
+ */
+void insert_cache(cache_t *cache, char *host, char *port, char *uri, char *data, int len) {
+    cacheitem *ci = malloc(sizeof(cacheitem));
+
+    ci->data = malloc(len);
+    memcpy(ci->data, data, len);
+    ci->length = len;
+    ci->refcnt = 1;
+    ci->referenced = 0;
+    ci->host = host;
+    ci->port = port;
+    ci->uri = uri;
+
+    pthread_mutex_lock(&cache->cachelock);
+    // if cache is full, delete last item
+    while (cache->cachesize + len > cache->capacity && cache->cachehead->next != NULL) {
+        delete_last_cache(cache);
+    }
+    ci->next = cache->cachehead->next;
+    cache->cachehead->next = ci;
+    (cache->cachehead->length)++;
+    cache->cachesize += len;
+    metrics_add(M_CACHE_INSERTS, 1);
+    PROBE_CACHE_INSERT(host, port, uri, len, cache->cachesize);
+    metrics_gauge_set(G_CACHE_BYTES, cache->cachesize);
+    metrics_gauge_set(G_CACHE_OBJECTS, cache->cachehead->length);
+    pthread_mutex_unlock(&cache->cachelock);
+}
+
+/*
+ * delete_last_cache - delete last item in cache list (cachelock held)
+ *                     for CLOCK, referenced items are moved to the front instead
+ */
+void delete_last_cache(cache_t *cache) {
+    cacheitem *prev, *last;
+
+    while (1) {
+        prev = cache->cachehead;
+        last = cache->cachehead->next;
+        while (last->next != NULL) {
+            prev = last;
+            last = last->next;
+        }
+        if (cache->policy != CACHE_CLOCK || !last->referenced) {
+            break;
+        }
+        // second chance: clear the bit and rotate the item to the front
+        last->referenced = 0;
+        if (prev != cache->cachehead) {
+            prev->next = NULL;
+            last->next = cache->cachehead->next;
+            cache->cachehead->next = last;
+        }
+    }
+
+    prev->next = NULL;
+    cache->cachesize -= last->length;
+    PROBE_CACHE_EVICT(last->host, last->port, last->uri, last->length, cache->cachesize);
+
+    // readers still sending the data free it in put_cached_item
+    if (--(last->refcnt) == 0) {
+        free_cache_item(last);
+    }
+    (cache->cachehead->length)--;
+    metrics_add(M_CACHE_EVICTIONS, 1);
+    metrics_gauge_set(G_CACHE_BYTES, cache->cachesize);
+    metrics_gauge_set(G_CACHE_OBJECTS, cache->cachehead->length);
+}
+
+/*
+ * free_cache_item - free an item nobody references any more
+ */
+void free_cache_item(cacheitem *item) {
+    free(item->host);
+    free(item->port);
+    free(item->uri);
+    free(item->data);
+    free(item);
+}
+
+/*
+ * cache_resize - change the capacity, evicting as needed
+ */
+void cache_resize(cache_t *cache, int capacity) {
+    pthread_mutex_lock(&cache->cachelock);
+    cache->capacity = capacity;
+    while (cache->cachesize > capacity && cache->cachehead->next != NULL) {
+        delete_last_cache(cache);
+    }
+    pthread_mutex_unlock(&cache->cachelock);
+}
+
+/*
+ * cache_policy_name - name of an eviction policy ("lru", "fifo", "clock")
+ */
+const char *cache_policy_name(enum cache_policy policy) {
+    static const char *names[CACHE_NPOLICIES] = {"lru", "fifo", "clock"};
+
+    return policy < CACHE_NPOLICIES ? names[policy] : "unknown";
+}
+
+/*
+ * cache_save - write every item to a snapshot file at path, keeping list order
+ * the snapshot is written to a temporary file and renamed into place
+ */
+int cache_save(cache_t *cache, const char *path) {
+    char tmp[4096];
+    FILE *fp;
+    int n;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        return -1;
+    }
+    n = cache_write(cache, fp);
+    if (fclose(fp) != 0 || n < 0 || rename(tmp, path) < 0) {
+        remove(tmp);
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * cache_load - insert the items of a snapshot written by cache_save
+ */
+int cache_load(cache_t *cache, const char *path) {
+    FILE *fp;
+    int n;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    n = cache_read(cache, fp);
+    fclose(fp);
+    return n;
+}
+
+/*
+ * cache_write - write every item as a snapshot to fp, keeping list order
+ * the items are referenced under cachelock and written without it, so a slow
+ * reader (a new proxy taking over) never holds up lookups and inserts
+ */
+int cache_write(cache_t *cache, FILE *fp) {
+    cacheitem **items, *curr;
+    int i, n = 0, lens[4], ok;
+
+    pthread_mutex_lock(&cache->cachelock);
+    if ((items = malloc(sizeof(cacheitem *) * (cache->cachehead->length + 1))) == NULL) {
+        pthread_mutex_unlock(&cache->cachelock);
+        return -1;
+    }
+    for (curr = cache->cachehead->next; curr != NULL; curr = curr->next) {
+        curr->refcnt++;
+        items[n++] = curr;
+    }
+    pthread_mutex_unlock(&cache->cachelock);
+
+    // last item first, so cache_read's inserts at the front rebuild the order
+    ok = fputs(SNAPSHOT_MAGIC, fp) >= 0;
+    for (i = n - 1; ok && i >= 0; i--) {
+        lens[0] = strlen(items[i]->host);
+        lens[1] = strlen(items[i]->port);
+        lens[2] = strlen(items[i]->uri);
+        lens[3] = items[i]->length;
+        ok = fwrite(lens, sizeof(lens), 1, fp) == 1 &&
+             fwrite(items[i]->host, 1, lens[0], fp) == lens[0] &&
+             fwrite(items[i]->port, 1, lens[1], fp) == lens[1] &&
+             fwrite(items[i]->uri, 1, lens[2], fp) == lens[2] &&
+             fwrite(items[i]->data, 1, lens[3], fp) == lens[3];
+    }
+    for (i = 0; i < n; i++) {
+        put_cached_item(cache, items[i]);
+    }
+    free(items);
+    return ok && fflush(fp) == 0 ? n : -1;
+}
+
+/*
+ * cache_read - insert the items of a snapshot read from fp until end of file
+ */
+int cache_read(cache_t *cache, FILE *fp) {
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1], *host, *port, *uri, *data;
+    int n = 0, lens[4];
+
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic))) {
+        return -1;
+    }
+    while (fread(lens, sizeof(lens), 1, fp) == 1) {
+        host = read_string(fp, lens[0], SNAPSHOT_MAX_KEY);
+        port = read_string(fp, lens[1], SNAPSHOT_MAX_KEY);
+        uri = read_string(fp, lens[2], SNAPSHOT_MAX_KEY);
+        data = read_string(fp, lens[3], cache->capacity);
+        if (host == NULL || port == NULL || uri == NULL || data == NULL) {
+            free(host);
+            free(port);
+            free(uri);
+            free(data);
+            break;
+        }
+        insert_cache(cache, host, port, uri, data, lens[3]);
+        free(data);
+        n++;
+    }
+    // truncated or corrupt: keep what was read
+    return feof(fp) ? n : -1;
+}
+
+/*
+ * read_string - read a len-byte string (at most max) from a snapshot, NULL on error
+ */
+static char *read_string(FILE *fp, int len, int max) {
+    char *s;
+
+    if (len < 0 || len > max) {
+        return NULL;
+    }
+    s = malloc(len + 1);
+    if (fread(s, 1, len, fp) != len) {
+        free(s);
+        return NULL;
+    }
+    s[len] = '\0';
+    return s;
+}
@@ -0,0 +1,101 @@
+/*
+ * cache.h - web object cache with LRU, FIFO or CLOCK eviction
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <pthread.h>
+#include <stdio.h>
+
+/* recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* eviction policies */
+enum cache_policy {
+    CACHE_LRU,      // hits move the item to the front, evict the last item
+    CACHE_FIFO,     // evict the oldest insertion, hits do not reorder
+    CACHE_CLOCK,    // FIFO, but a referenced last item gets a second chance
+    CACHE_NPOLICIES
+};
+
+/*
+ * cache item structure (linked list)
+ *
+ * length: (head) length of list / (other) length of data
+ * refcnt: (other) 1 while linked in the list, plus 1 per thread sending data
+ * referenced: (other) hit since last considered for eviction (CLOCK)
+ * host: (head) NULL / (other) ptr to host of data
+ * port: (head) NULL / (other) ptr to port of data
+ * uri: (head) NULL / (other) ptr to uri of data
+ * data: (head) NULL / (other) ptr to data
+ */
+typedef struct cacheitem {
+    int length;
+    int refcnt;
+    int referenced;
+    char *host;
+    char *port;
+    char *uri;
+    char *data;
+    struct cacheitem *next;
+} cacheitem;
+
+/*
+ * cache structure
+ *
+ * cachehead: head of cache list
+ * cachesize: total size of all cache data
+ * capacity: max total size of cache data
+ * policy: eviction policy, CACHE_LRU unless changed before first use
+ * cachelock: protects the list, cachesize and refcnt of every item
+ */
+typedef struct cache {
+    cacheitem *cachehead;
+    int cachesize;
+    int capacity;
+    enum cache_policy policy;
+    pthread_mutex_t cachelock;
+} cache_t;
+
+/*
+ * helper functions
+ *
+ * cache_init: init an empty LRU cache holding at most capacity bytes of data
+ * cache_free: free every item and the list head (no readers may remain)
+ * get_cached_item: return cached data if same request exists in cache list
+ *                  for LRU eviction policy, move recently used item at the first of cache list
+ *                  for CLOCK, mark it referenced
+ *                  the caller must release the item with put_cached_item
+ * put_cached_item: release an item returned by get_cached_item
+ * insert_cache: insert a copy of data at the first of cache list, evicting as needed
+ *               takes ownership of host, port, and uri
+ * delete_last_cache: delete last item in cache list (cachelock held)
+ *                    for CLOCK, referenced items are moved to the front instead
+ * free_cache_item: free an item nobody references any more
+ * cache_resize: change the capacity, evicting as needed
+ * cache_policy_name: name of an eviction policy ("lru", "fifo", "clock")
+ * cache_save: write every item to a snapshot file at path, keeping list order
+ *             return the number of items written, -1 on error
+ * cache_load: insert the items of a snapshot written by cache_save
+ *             return the number of items read, -1 if path is missing or malformed
+ * cache_write: write every item as a snapshot to fp (e.g. a socket), keeping list order
+ *              return the number of items written, -1 on error
+ * cache_read: insert the items of a snapshot read from fp until end of file
+ *             return the number of items read, -1 if the snapshot is malformed
+ */
+void cache_init(cache_t *cache, int capacity);
+void cache_free(cache_t *cache);
+cacheitem *get_cached_item(cache_t *cache, char *host, char *port, char *uri);
+void put_cached_item(cache_t *cache, cacheitem *item);
+void insert_cache(cache_t *cache, char *host, char *port, char *uri, char *data, int len);
+void delete_last_cache(cache_t *cache);
+void free_cache_item(cacheitem *item);
+void cache_resize(cache_t *cache, int capacity);
+const char *cache_policy_name(enum cache_policy policy);
+int cache_save(cache_t *cache, const char *path);
+int cache_load(cache_t *cache, const char *path);
+int cache_write(cache_t *cache, FILE *fp);
+int cache_read(cache_t *cache, FILE *fp);
+
+#endif /* __CACHE_H__ */
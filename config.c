@@ -0,0 +1,352 @@
+/*
+ * config.c - proxy configuration file, reloaded on SIGHUP
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "cache.h"
+#include "config.h"
+
+#define CONFIG_LINE 1024
+
+/* headers stripped from and added to upstream requests unless the file says otherwise */
+static const char *default_strip[] = {"User-Agent", "Connection", "Proxy-Connection"};
+static const char *default_headers[] = {
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3",
+    "Connection: close",
+    "Proxy-Connection: close",
+};
+
+/* published snapshot, written by main only */
+static config_t *current = NULL;
+
+/*
+ * helper functions
+ *
+ * parse_int: parse a non-negative integer value, -1 if it is not one
+ * add_header: append a header line to conf->headers
+ * group: upstream group named by the first word of *value, created if new
+ *        *value is advanced past the name; NULL if the name is unusable
+ * health_check: set the probe path and optional interval of g from value
+ * config_free: free a snapshot nobody references
+ */
+static int parse_int(const char *s);
+static void add_header(config_t *conf, const char *line);
+static upstream_group *group(config_t *conf, char **value);
+static int health_check(upstream_group *g, char *value);
+static void config_free(config_t *conf);
+
+/*
+ * config_load - build a snapshot from the file at path (defaults if path is NULL)
+ */
+config_t *config_load(const char *path, char *err, int errlen) {
+    char line[CONFIG_LINE], reverse[UPSTREAM_NAME_LEN] = "", *key, *value, *p;
+    int i, lineno = 0, nheaders = 0, v;
+    upstream_group *g;
+    config_t *conf = calloc(1, sizeof(config_t));
+    FILE *fp = NULL;
+
+    conf->refcnt = 1;
+    conf->cache_size = MAX_CACHE_SIZE;
+    conf->max_object_size = MAX_OBJECT_SIZE;
+    conf->drain_timeout = 10;
+    conf->breaker_timeout = 5;
+    conf->miss_queue = 256;
+    conf->nstrip = -1;      // defaults, unless the file has strip lines
+
+    if (path != NULL && (fp = fopen(path, "r")) == NULL) {
+        snprintf(err, errlen, "cannot open %s", path);
+        config_free(conf);
+        return NULL;
+    }
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        for (p = line + strlen(line); p > line && isspace((unsigned char)p[-1]); p--) {
+        }
+        *p = '\0';
+        for (key = line; isspace((unsigned char)*key); key++) {
+        }
+        if (*key == '\0') {
+            continue;
+        }
+        for (value = key; *value && !isspace((unsigned char)*value); value++) {
+        }
+        if (*value) {
+            *value++ = '\0';
+        }
+        while (isspace((unsigned char)*value)) {
+            value++;
+        }
+        v = parse_int(value);
+
+        if (!strcmp(key, "listen") && *value && strlen(value) < CONFIG_PORT_LEN) {
+            strcpy(conf->listen, value);
+        } else if (!strcmp(key, "cache_size") && v > 0) {
+            conf->cache_size = v;
+        } else if (!strcmp(key, "max_object_size") && v > 0) {
+            conf->max_object_size = v;
+        } else if (!strcmp(key, "max_connections") && v >= 0) {
+            conf->max_connections = v;
+        } else if (!strcmp(key, "client_timeout") && v >= 0) {
+            conf->client_timeout = v;
+        } else if (!strcmp(key, "upstream_timeout") && v >= 0) {
+            conf->upstream_timeout = v;
+        } else if (!strcmp(key, "drain_timeout") && v >= 0) {
+            conf->drain_timeout = v;
+        } else if (!strcmp(key, "client_rate") && v >= 0) {
+            conf->client_rate = v;
+        } else if (!strcmp(key, "client_burst") && v > 0) {
+            conf->client_burst = v;
+        } else if (!strcmp(key, "origin_rate") && v >= 0) {
+            conf->origin_rate = v;
+        } else if (!strcmp(key, "origin_burst") && v > 0) {
+            conf->origin_burst = v;
+        } else if (!strcmp(key, "origin_max_inflight") && v >= 0) {
+            conf->origin_max_inflight = v;
+        } else if (!strcmp(key, "origin_adaptive") && (v == 0 || v == 1)) {
+            conf->origin_adaptive = v;
+        } else if (!strcmp(key, "breaker_failures") && v >= 0) {
+            conf->breaker_failures = v;
+        } else if (!strcmp(key, "breaker_timeout") && v > 0) {
+            conf->breaker_timeout = v;
+        } else if (!strcmp(key, "workers") && v >= 0) {
+            conf->workers = v;
+        } else if (!strcmp(key, "miss_workers") && v > 0) {
+            conf->miss_workers = v;
+        } else if (!strcmp(key, "miss_queue") && v > 0) {
+            conf->miss_queue = v;
+        } else if (!strcmp(key, "strip") && *value && strlen(value) < CONFIG_NAME_LEN &&
+                   conf->nstrip < CONFIG_MAX_HEADERS - 1) {
+            conf->nstrip = conf->nstrip < 0 ? 0 : conf->nstrip;
+            strcpy(conf->strip[conf->nstrip++], value);
+        } else if (!strcmp(key, "header") && strchr(value, ':') != NULL && nheaders < CONFIG_MAX_HEADERS) {
+            add_header(conf, value);
+            nheaders++;
+        } else if (!strcmp(key, "upstream") && (g = group(conf, &value)) != NULL &&
+                   upstream_add_server(g, value) == 0) {
+            // server added to g
+        } else if (!strcmp(key, "balance") && (g = group(conf, &value)) != NULL &&
+                   (v = upstream_policy_parse(value)) >= 0) {
+            g->policy = v;
+        } else if (!strcmp(key, "keepalive") && (g = group(conf, &value)) != NULL &&
+                   (v = parse_int(value)) >= 0 && v <= UPSTREAM_MAX_IDLE) {
+            g->keepalive = v;
+        } else if (!strcmp(key, "max_fails") && (g = group(conf, &value)) != NULL &&
+                   (v = parse_int(value)) >= 0) {
+            g->max_fails = v;
+        } else if (!strcmp(key, "fail_timeout") && (g = group(conf, &value)) != NULL &&
+                   (v = parse_int(value)) > 0) {
+            g->fail_timeout = v;
+        } else if (!strcmp(key, "hedge") && (g = group(conf, &value)) != NULL &&
+                   (v = parse_int(value)) >= 0 && v <= 100) {
+            g->hedge = v;
+        } else if (!strcmp(key, "health_check") && (g = group(conf, &value)) != NULL &&
+                   *value == '/' && health_check(g, value) == 0) {
+            // probes set up for g
+        } else if (!strcmp(key, "reverse") && *value && strlen(value) < UPSTREAM_NAME_LEN) {
+            strcpy(reverse, value);
+        } else {
+            snprintf(err, errlen, "%s:%d: bad line for \"%s\"", path, lineno, key);
+            fclose(fp);
+            config_free(conf);
+            return NULL;
+        }
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    for (i = 0; i < conf->ngroups; i++) {
+        if (conf->groups[i].nservers == 0) {
+            snprintf(err, errlen, "%s: upstream group %s has no servers", path, conf->groups[i].name);
+            config_free(conf);
+            return NULL;
+        }
+    }
+    if (reverse[0] && (conf->reverse = upstream_find(conf->groups, conf->ngroups, reverse)) == NULL) {
+        snprintf(err, errlen, "%s: reverse to unknown upstream group %s", path, reverse);
+        config_free(conf);
+        return NULL;
+    }
+    for (i = 0; i < conf->ngroups; i++) {
+        upstream_prepare(&conf->groups[i]);
+    }
+
+    if (conf->client_burst == 0) {
+        conf->client_burst = conf->client_rate;
+    }
+    if (conf->origin_burst == 0) {
+        conf->origin_burst = conf->origin_rate;
+    }
+    if (conf->miss_workers == 0) {
+        conf->miss_workers = conf->workers;
+    }
+    if (conf->nstrip < 0) {
+        for (conf->nstrip = 0; conf->nstrip < sizeof(default_strip) / sizeof(char *); conf->nstrip++) {
+            strcpy(conf->strip[conf->nstrip], default_strip[conf->nstrip]);
+        }
+    }
+    if (nheaders == 0) {
+        for (i = 0; i < sizeof(default_headers) / sizeof(char *); i++) {
+            add_header(conf, default_headers[i]);
+        }
+    }
+    add_header(conf, "");   // end of the request headers
+    return conf;
+}
+
+/*
+ * config_current - the published snapshot
+ * only main may take a reference to it; other threads may just compare
+ */
+config_t *config_current(void) {
+    return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * config_publish - make conf current and drop the reference to the old one
+ * connections still holding the old snapshot keep using it until they finish
+ */
+void config_publish(config_t *conf) {
+    config_t *old = current;
+
+    __atomic_store_n(&current, conf, __ATOMIC_RELEASE);
+    if (old != NULL) {
+        config_put(old);
+    }
+}
+
+/*
+ * config_hold - take a reference to conf for a connection
+ */
+config_t *config_hold(config_t *conf) {
+    __atomic_fetch_add(&conf->refcnt, 1, __ATOMIC_RELAXED);
+    return conf;
+}
+
+/*
+ * config_put - drop a reference, freeing the snapshot on the last one
+ */
+void config_put(config_t *conf) {
+    if (__atomic_sub_fetch(&conf->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        config_free(conf);
+    }
+}
+
+/*
+ * config_strips - nonzero if the request header line hdr is one conf strips
+ */
+int config_strips(const config_t *conf, const char *hdr) {
+    int i, n;
+
+    for (i = 0; i < conf->nstrip; i++) {
+        n = strlen(conf->strip[i]);
+        if (!strncasecmp(hdr, conf->strip[i], n) && hdr[n] == ':') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * parse_int - parse a non-negative integer value, -1 if it is not one
+ */
+static int parse_int(const char *s) {
+    char *end;
+    long v = strtol(s, &end, 10);
+
+    return *s && !*end && v >= 0 && v <= 0x7fffffff ? (int)v : -1;
+}
+
+/*
+ * add_header - append a header line to conf->headers
+ */
+static void add_header(config_t *conf, const char *line) {
+    int n = strlen(line) + 2;
+
+    conf->headers = realloc(conf->headers, conf->headers_len + n + 1);
+    sprintf(conf->headers + conf->headers_len, "%s\r\n", line);
+    conf->headers_len += n;
+}
+
+/*
+ * group - upstream group named by the first word of *value, created if new
+ * the groups array only grows while the file is parsed, before any group is prepared
+ */
+static upstream_group *group(config_t *conf, char **value) {
+    char *name = *value, *p;
+    upstream_group *g;
+
+    for (p = name; *p && !isspace((unsigned char)*p); p++) {
+    }
+    if (p == name || p - name >= UPSTREAM_NAME_LEN || *p == '\0') {
+        return NULL;
+    }
+    *p++ = '\0';
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    *value = p;
+
+    if ((g = upstream_find(conf->groups, conf->ngroups, name)) != NULL) {
+        return g;
+    }
+    if (conf->ngroups == UPSTREAM_MAX_GROUPS) {
+        return NULL;
+    }
+    conf->groups = realloc(conf->groups, (conf->ngroups + 1) * sizeof(upstream_group));
+    g = &conf->groups[conf->ngroups++];
+    memset(g, 0, sizeof(upstream_group));
+    strcpy(g->name, name);
+    g->max_fails = UPSTREAM_MAX_FAILS;
+    g->fail_timeout = UPSTREAM_FAIL_TIMEOUT;
+    g->check_interval = UPSTREAM_CHECK_INTERVAL;
+    return g;
+}
+
+/*
+ * health_check - set the probe path and optional interval of g from value
+ * return 0 on success, -1 if value is not "<path> [<secs>]"
+ */
+static int health_check(upstream_group *g, char *value) {
+    char *p;
+    int v = UPSTREAM_CHECK_INTERVAL;
+
+    for (p = value; *p && !isspace((unsigned char)*p); p++) {
+    }
+    if (*p) {
+        *p++ = '\0';
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if ((v = parse_int(p)) <= 0) {
+            return -1;
+        }
+    }
+    if (strlen(value) >= UPSTREAM_PATH_LEN) {
+        return -1;
+    }
+    strcpy(g->check_path, value);
+    g->check_interval = v;
+    return 0;
+}
+
+/*
+ * config_free - free a snapshot nobody references
+ * groups are prepared only in snapshots that loaded successfully
+ */
+static void config_free(config_t *conf) {
+    int i;
+
+    for (i = 0; conf->refcnt == 0 && i < conf->ngroups; i++) {
+        upstream_release_all(&conf->groups[i]);
+    }
+    free(conf->groups);
+    free(conf->headers);
+    free(conf);
+}
@@ -0,0 +1,113 @@
+/*
+ * config.h - proxy configuration file, reloaded on SIGHUP
+ *
+ * A configuration is an immutable snapshot. main publishes the current one
+ * and hands a reference to every connection it accepts; a reload builds a
+ * new snapshot and swaps the pointer, and the old one is freed when the last
+ * connection using it finishes. Request threads never take a lock: they
+ * read their own snapshot and drop it with one atomic decrement.
+ *
+ * File format: one "key value" per line, '#' starts a comment.
+ *
+ *   listen <port>              proxy port, if not given on the command line
+ *   cache_size <bytes>         cache capacity
+ *   max_object_size <bytes>    largest response that is cached
+ *   max_connections <n>        connections served at once, 503 beyond (0: no limit)
+ *   client_timeout <secs>      idle timeout reading from clients (0: none)
+ *   upstream_timeout <secs>    idle timeout reading from upstreams (0: none)
+ *   drain_timeout <secs>       how long SIGTERM waits for active connections
+ *   client_rate <n>            connections per second from one client address, 429 beyond (0: no limit)
+ *   client_burst <n>           connections a client may open at once (default: client_rate)
+ *   origin_rate <n>            cache misses per second sent to one upstream host, 429 beyond (0: no limit)
+ *   origin_burst <n>           misses sent to one upstream host at once (default: origin_rate)
+ *   origin_max_inflight <n>    requests in flight to one origin server, 503 beyond (0: no limit)
+ *   origin_adaptive <0|1>      adapt each origin's limit to its latency, up to origin_max_inflight
+ *   breaker_failures <n>       failures in a row that open an origin's circuit (0: never)
+ *   breaker_timeout <secs>     how long an open circuit refuses requests (default 5)
+ *   workers <n>                threads reading requests and serving cache hits (0: a thread per connection)
+ *                              a client has at most 10 seconds (or client_timeout) to send its request
+ *   miss_workers <n>           threads serving cache misses from upstreams (default: workers)
+ *   miss_queue <n>             misses waiting for a miss worker, 503 beyond (default 256)
+ *   strip <Header-Name>        request header not forwarded upstream
+ *   header <Name: value>       header line added to every upstream request
+ *   upstream <group> <host:port>   add a server to an upstream group (upstream.h)
+ *   balance <group> <policy>   roundrobin (default), leastconn, or hash of the cache key
+ *   keepalive <group> <n>      idle connections pooled per server of the group (0: none)
+ *   reverse <group>            reverse-proxy mode: send every request to the group
+ *   max_fails <group> <n>      consecutive failures that eject a server (default 3, 0: never)
+ *   fail_timeout <group> <secs>    first ejection time, doubled on each one in a row (default 10)
+ *   health_check <group> <path> [<secs>]   probe every server with GET path (default every 5s)
+ *   hedge <group> <percent>    share of GETs that may also go to a second server (0: none)
+ *
+ * Any strip or header line replaces the default list of that kind (strip
+ * User-Agent, Connection and Proxy-Connection, and send fixed ones).
+ * listen, workers, miss_workers and miss_queue changes need a restart, and
+ * so do cache_size changes when the cache is shared.
+ * Forward requests whose host is the name of a group go to that group.
+ */
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include "upstream.h"
+
+#define CONFIG_MAX_HEADERS 32
+#define CONFIG_NAME_LEN 64
+#define CONFIG_PORT_LEN 16
+
+/*
+ * configuration snapshot (immutable once published)
+ *
+ * refcnt: 1 while current, plus 1 per connection using it
+ * strip, nstrip: names of request headers not forwarded
+ * headers, headers_len: header lines added to upstream requests, blank line included
+ * groups, ngroups: upstream groups
+ * reverse: group every request goes to, NULL unless in reverse-proxy mode
+ */
+typedef struct config {
+    int refcnt;
+    char listen[CONFIG_PORT_LEN];
+    int cache_size;
+    int max_object_size;
+    int max_connections;
+    int client_timeout;
+    int upstream_timeout;
+    int drain_timeout;
+    int client_rate;
+    int client_burst;
+    int origin_rate;
+    int origin_burst;
+    int origin_max_inflight;
+    int origin_adaptive;
+    int breaker_failures;
+    int breaker_timeout;
+    int workers;
+    int miss_workers;
+    int miss_queue;
+    char strip[CONFIG_MAX_HEADERS][CONFIG_NAME_LEN];
+    int nstrip;
+    char *headers;
+    int headers_len;
+    upstream_group *groups;
+    int ngroups;
+    upstream_group *reverse;
+} config_t;
+
+/*
+ * helper functions
+ *
+ * config_load: build a snapshot from the file at path (defaults if path is NULL)
+ *              return NULL and a message in err if the file is unusable
+ * config_current: the published snapshot (only main may take a reference to it)
+ * config_publish: make conf current and drop the reference to the old one
+ * config_hold: take a reference to conf for a connection
+ * config_put: drop a reference, freeing the snapshot on the last one
+ * config_strips: nonzero if the request header line hdr is one conf strips
+ */
+config_t *config_load(const char *path, char *err, int errlen);
+config_t *config_current(void);
+void config_publish(config_t *conf);
+config_t *config_hold(config_t *conf);
+void config_put(config_t *conf);
+int config_strips(const config_t *conf, const char *hdr);
+
+#endif /* __CONFIG_H__ */
@@ -0,0 +1,832 @@
+/*
+ * h2.c - HTTP/2 over cleartext TCP (h2c) for clients with prior knowledge
+ *
+ * Streams become HTTP/1.0 requests, so the responses read back are never
+ * chunked: their bodies run to the end of the socket pair, and go out as
+ * DATA as they arrive. The response head is held until it is complete and
+ * then sent as one header block. Nothing is Huffman-coded or indexed on the
+ * way out (hpack.h), so the client's SETTINGS_HEADER_TABLE_SIZE needs nothing.
+ */
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "h2.h"
+#include "hpack.h"
+#include "http.h"
+#include "metrics.h"
+
+/* frame types */
+enum h2_frame {
+    FRAME_DATA,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION
+};
+
+/* error codes */
+enum h2_error {
+    ERR_NO_ERROR,
+    ERR_PROTOCOL_ERROR,
+    ERR_INTERNAL_ERROR,
+    ERR_FLOW_CONTROL_ERROR,
+    ERR_SETTINGS_TIMEOUT,
+    ERR_STREAM_CLOSED,
+    ERR_FRAME_SIZE_ERROR,
+    ERR_REFUSED_STREAM,
+    ERR_CANCEL,
+    ERR_COMPRESSION_ERROR,
+    ERR_CONNECT_ERROR,
+    ERR_ENHANCE_YOUR_CALM
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_MAX_CONCURRENT_STREAMS 3
+#define SETTINGS_INITIAL_WINDOW_SIZE 4
+#define SETTINGS_MAX_FRAME_SIZE 5
+
+#define FRAME_HEADER 9          // length, type, flags, stream
+#define MAX_WINDOW 0x7fffffffL
+#define HEAD_SIZE (2 * H2_FRAME_SIZE)   // longest response head, and room for its header block
+#define OUT_SIZE (4 * (FRAME_HEADER + H2_FRAME_SIZE))   // frames queued for one write
+
+/*
+ * stream
+ *
+ * id: stream identifier, 0 for a free slot
+ * fd: our end of the socket pair
+ * window: send window, which SETTINGS may push below 0
+ * head, eof: whether the response head has gone out, and the response has all been read
+ * buf, len: response read back and not sent yet (HEAD_SIZE bytes)
+ */
+typedef struct stream {
+    int id;
+    int fd;
+    long window;
+    int head;
+    int eof;
+    char *buf;
+    int len;
+} stream_t;
+
+/*
+ * request decoded from a header block
+ *
+ * method, authority, path: pseudo-header fields (authority from Host if absent)
+ * headers, len, size: the other fields as HTTP/1 header lines
+ * bad: a field was malformed or too long
+ */
+typedef struct request {
+    char method[64];
+    char authority[MAXLINE];
+    char path[MAXLINE];
+    char *headers;
+    int len;
+    int size;
+    int bad;
+} request_t;
+
+/*
+ * connection
+ *
+ * window, initial_window: connection send window, and the client's initial stream window
+ * last_id: highest stream the client has opened
+ * goaway: no new streams, since GOAWAY was sent or received
+ * hpack: decoder of the client's header blocks
+ * frame: payload of the frame being handled
+ * block, blocklen, blockid: header block being collected over CONTINUATION frames
+ * out, outlen: frames queued for the client, written before each poll
+ */
+typedef struct h2 {
+    int fd;
+    rio_t *rp;
+    stream_t streams[H2_MAX_STREAMS];
+    int nstreams;
+    long window;
+    long initial_window;
+    int last_id;
+    int goaway;
+    hpack_table hpack;
+    unsigned char frame[H2_FRAME_SIZE];
+    unsigned char block[H2_MAX_HEADERS];
+    int blocklen;
+    int blockid;
+    unsigned char out[OUT_SIZE];
+    int outlen;
+    int (*open_stream)(int fd, void *arg);
+    void *arg;
+} h2_t;
+
+/*
+ * helper functions
+ *
+ * read_frame: read one frame from the client and act on it, -1 to close the connection
+ * on_headers: start collecting the header block of a HEADERS frame
+ * on_data: discard a DATA frame and give its window back
+ * on_settings: apply and acknowledge the client's SETTINGS
+ * on_window_update: widen the connection or a stream send window
+ * add_block: append a fragment to the header block, handling it once it ends
+ * end_headers: decode a complete header block, opening its stream if it is a new one
+ * start: open stream id for request r, handing the HTTP/1.0 request to open_stream
+ * collect: hpack_emit callback gathering the fields of a request
+ * fill: read what a stream's response has ready
+ * send_head: send a stream's response head as HEADERS, once it is complete
+ * head_end: blank line ending the response head in buf[0..len), NULL if it has not come yet
+ * pump: send a stream's response body within the send windows, ending the stream after it
+ * send_frame: queue one frame for the client, -1 if it cannot be written
+ * flush: write the queued frames to the client, -1 if they cannot be written
+ * refuse: reset stream id that has no slot
+ * reset: reset stream s and close it
+ * close_stream: free the slot of stream s
+ * fail: end the connection with a GOAWAY for error, return -1
+ * find: stream id, NULL if it is not open
+ * get32, put32: big-endian 32-bit integer
+ */
+static int read_frame(h2_t *h);
+static int on_headers(h2_t *h, int flags, int id, unsigned char *p, int len);
+static int on_data(h2_t *h, int flags, int id, unsigned char *p, int len);
+static int on_settings(h2_t *h, int flags, int id, unsigned char *p, int len);
+static int on_window_update(h2_t *h, int id, unsigned char *p, int len);
+static int add_block(h2_t *h, int flags, unsigned char *p, int len);
+static int end_headers(h2_t *h);
+static int start(h2_t *h, int id, request_t *r);
+static void collect(void *arg, const char *name, int namelen, const char *value, int valuelen);
+static void fill(h2_t *h, stream_t *s);
+static void send_head(h2_t *h, stream_t *s);
+static char *head_end(char *buf, int len);
+static int pump(h2_t *h, stream_t *s);
+static int send_frame(h2_t *h, int type, int flags, int id, const void *payload, int len);
+static int flush(h2_t *h);
+static int refuse(h2_t *h, int id, int error);
+static void reset(h2_t *h, stream_t *s, int error);
+static void close_stream(h2_t *h, stream_t *s);
+static int fail(h2_t *h, int error);
+static stream_t *find(h2_t *h, int id);
+static unsigned long get32(const unsigned char *p);
+static void put32(unsigned char *p, unsigned long v);
+
+/*
+ * h2_serve - speak HTTP/2 on client fd once the preface request line has been read through rp
+ */
+void h2_serve(int fd, rio_t *rp, int timeout, volatile sig_atomic_t *stop,
+              int (*open_stream)(int fd, void *arg), void *arg) {
+    struct pollfd pfd[H2_MAX_STREAMS + 1];
+    stream_t *polled[H2_MAX_STREAMS + 1], *s;
+    unsigned char settings[6];
+    char preface[8];
+    int i, n, ready, idle = 0, one = 1;
+    h2_t *h;
+
+    // the rest of the preface, then our SETTINGS
+    if (rio_readnb(rp, preface, sizeof(preface)) != sizeof(preface) || memcmp(preface, "\r\nSM\r\n\r\n", 8)) {
+        return;
+    }
+    h = calloc(1, sizeof(h2_t));
+    h->fd = fd;
+    h->rp = rp;
+    h->window = h->initial_window = H2_WINDOW;
+    h->open_stream = open_stream;
+    h->arg = arg;
+    hpack_init(&h->hpack);
+    metrics_add(M_H2_CONNECTIONS, 1);
+
+    // frames go out in one write per round, which Nagle would only hold back
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, H2_MAX_STREAMS);
+    if (send_frame(h, FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) < 0) {
+        h->goaway = 1;
+    }
+
+    while (!h->goaway || h->nstreams > 0) {
+        if (*stop && !h->goaway) {
+            fail(h, ERR_NO_ERROR);
+        }
+
+        // send what the windows let through, and poll the streams that have room for more
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        for (i = 0, n = 1; i < H2_MAX_STREAMS; i++) {
+            s = &h->streams[i];
+            if (s->id && pump(h, s) < 0) {
+                goto done;
+            }
+            if (s->id && !s->eof && (!s->head || s->len == 0)) {
+                pfd[n].fd = s->fd;
+                pfd[n].events = POLLIN;
+                polled[n++] = s;
+            }
+        }
+        if (flush(h) < 0) {
+            break;
+        }
+
+        // frames rio has buffered already are read without waiting; a poll
+        // wakes at least every second to notice stop
+        ready = poll(pfd, n, rp->rio_cnt > 0 ? 0 : 1000);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0 && rp->rio_cnt == 0) {
+            if (h->nstreams == 0 && timeout > 0 && ++idle >= timeout) {
+                fail(h, ERR_NO_ERROR);
+            }
+            continue;
+        }
+        idle = 0;
+        for (i = 1; i < n; i++) {
+            if (pfd[i].revents && polled[i]->id) {
+                fill(h, polled[i]);
+            }
+        }
+        if ((pfd[0].revents || rp->rio_cnt > 0) && read_frame(h) < 0) {
+            break;
+        }
+    }
+
+done:
+    flush(h);
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (h->streams[i].id) {
+            close_stream(h, &h->streams[i]);
+        }
+    }
+    hpack_free(&h->hpack);
+    free(h);
+}
+
+/*
+ * read_frame - read one frame from the client and act on it, -1 to close the connection
+ */
+static int read_frame(h2_t *h) {
+    unsigned char head[FRAME_HEADER], *p = h->frame;
+    int len, type, flags, id;
+    stream_t *s;
+
+    if (rio_readnb(h->rp, head, FRAME_HEADER) != FRAME_HEADER) {
+        return -1;
+    }
+    len = head[0] << 16 | head[1] << 8 | head[2];
+    type = head[3];
+    flags = head[4];
+    id = get32(head + 5) & MAX_WINDOW;
+    if (len > H2_FRAME_SIZE) {
+        return fail(h, ERR_FRAME_SIZE_ERROR);
+    }
+    if (rio_readnb(h->rp, p, len) != len) {
+        return -1;
+    }
+    if (h->blockid && type != FRAME_CONTINUATION) {
+        return fail(h, ERR_PROTOCOL_ERROR);     // a header block must not be interleaved
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+        return on_data(h, flags, id, p, len);
+    case FRAME_HEADERS:
+        return on_headers(h, flags, id, p, len);
+    case FRAME_CONTINUATION:
+        if (id == 0 || id != h->blockid) {
+            return fail(h, ERR_PROTOCOL_ERROR);
+        }
+        return add_block(h, flags, p, len);
+    case FRAME_RST_STREAM:
+        if (len != 4) {
+            return fail(h, ERR_FRAME_SIZE_ERROR);
+        }
+        if (id == 0) {
+            return fail(h, ERR_PROTOCOL_ERROR);
+        }
+        if ((s = find(h, id)) != NULL) {
+            close_stream(h, s);
+        }
+        return 0;
+    case FRAME_SETTINGS:
+        return on_settings(h, flags, id, p, len);
+    case FRAME_PING:
+        if (len != 8) {
+            return fail(h, ERR_FRAME_SIZE_ERROR);
+        }
+        return flags & FLAG_ACK ? 0 : send_frame(h, FRAME_PING, FLAG_ACK, 0, p, len);
+    case FRAME_GOAWAY:
+        h->goaway = 1;      // open streams still finish
+        return 0;
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(h, id, p, len);
+    case FRAME_PUSH_PROMISE:
+        return fail(h, ERR_PROTOCOL_ERROR);
+    default:
+        return 0;           // PRIORITY and unknown frames
+    }
+}
+
+/*
+ * on_headers - start collecting the header block of a HEADERS frame
+ */
+static int on_headers(h2_t *h, int flags, int id, unsigned char *p, int len) {
+    int pad = 0;
+
+    if (id == 0 || id % 2 == 0) {
+        return fail(h, ERR_PROTOCOL_ERROR);
+    }
+    if (flags & FLAG_PADDED) {
+        if (len < 1) {
+            return fail(h, ERR_PROTOCOL_ERROR);
+        }
+        pad = *p++;
+        len--;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5) {
+            return fail(h, ERR_PROTOCOL_ERROR);
+        }
+        p += 5;
+        len -= 5;
+    }
+    if (pad > len) {
+        return fail(h, ERR_PROTOCOL_ERROR);
+    }
+    h->blockid = id;
+    h->blocklen = 0;
+    return add_block(h, flags, p, len - pad);
+}
+
+/*
+ * on_data - discard a DATA frame and give its window back
+ * request bodies are not forwarded, so the window is credited at once
+ */
+static int on_data(h2_t *h, int flags, int id, unsigned char *p, int len) {
+    unsigned char inc[4];
+
+    if (id == 0 || ((flags & FLAG_PADDED) && (len < 1 || p[0] >= len))) {
+        return fail(h, ERR_PROTOCOL_ERROR);
+    }
+    if (len == 0) {
+        return 0;
+    }
+    put32(inc, len);
+    if (send_frame(h, FRAME_WINDOW_UPDATE, 0, 0, inc, sizeof(inc)) < 0) {
+        return -1;
+    }
+    if (!(flags & FLAG_END_STREAM) && find(h, id) != NULL) {
+        return send_frame(h, FRAME_WINDOW_UPDATE, 0, id, inc, sizeof(inc));
+    }
+    return 0;
+}
+
+/*
+ * on_settings - apply and acknowledge the client's SETTINGS
+ * we never send frames over the default size, keep no encoder table, and never push,
+ * so only the initial window size matters
+ */
+static int on_settings(h2_t *h, int flags, int id, unsigned char *p, int len) {
+    unsigned long v;
+    int i, j, key;
+
+    if (id != 0) {
+        return fail(h, ERR_PROTOCOL_ERROR);
+    }
+    if (flags & FLAG_ACK) {
+        return 0;
+    }
+    if (len % 6) {
+        return fail(h, ERR_FRAME_SIZE_ERROR);
+    }
+    for (i = 0; i < len; i += 6) {
+        key = p[i] << 8 | p[i + 1];
+        v = get32(p + i + 2);
+        if (key == SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (v > MAX_WINDOW) {
+                return fail(h, ERR_FLOW_CONTROL_ERROR);
+            }
+            for (j = 0; j < H2_MAX_STREAMS; j++) {
+                h->streams[j].window += (long)v - h->initial_window;
+            }
+            h->initial_window = v;
+        } else if (key == SETTINGS_MAX_FRAME_SIZE && (v < H2_FRAME_SIZE || v > 0xffffff)) {
+            return fail(h, ERR_PROTOCOL_ERROR);
+        }
+    }
+    return send_frame(h, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+/*
+ * on_window_update - widen the connection or a stream send window
+ */
+static int on_window_update(h2_t *h, int id, unsigned char *p, int len) {
+    long inc;
+    stream_t *s;
+
+    if (len != 4) {
+        return fail(h, ERR_FRAME_SIZE_ERROR);
+    }
+    inc = get32(p) & MAX_WINDOW;
+    if (id == 0) {
+        if (inc == 0 || h->window + inc > MAX_WINDOW) {
+            return fail(h, inc == 0 ? ERR_PROTOCOL_ERROR : ERR_FLOW_CONTROL_ERROR);
+        }
+        h->window += inc;
+    } else if ((s = find(h, id)) != NULL) {
+        if (inc == 0 || s->window + inc > MAX_WINDOW) {
+            reset(h, s, inc == 0 ? ERR_PROTOCOL_ERROR : ERR_FLOW_CONTROL_ERROR);
+        } else {
+            s->window += inc;
+        }
+    }
+    return 0;
+}
+
+/*
+ * add_block - append a fragment to the header block, handling it once it ends
+ */
+static int add_block(h2_t *h, int flags, unsigned char *p, int len) {
+    if (h->blocklen + len > H2_MAX_HEADERS) {
+        return fail(h, ERR_ENHANCE_YOUR_CALM);
+    }
+    memcpy(h->block + h->blocklen, p, len);
+    h->blocklen += len;
+    return flags & FLAG_END_HEADERS ? end_headers(h) : 0;
+}
+
+/*
+ * end_headers - decode a complete header block, opening its stream if it is a new one
+ * every block is decoded, trailers included, to keep the dynamic table in step
+ */
+static int end_headers(h2_t *h) {
+    request_t r;
+    int id = h->blockid, rc = 0;
+
+    h->blockid = 0;
+    r.method[0] = r.authority[0] = r.path[0] = '\0';
+    r.headers = NULL;
+    r.len = r.size = r.bad = 0;
+    if (hpack_decode(&h->hpack, h->block, h->blocklen, collect, &r) < 0) {
+        free(r.headers);
+        return fail(h, ERR_COMPRESSION_ERROR);
+    }
+    if (id > h->last_id) {
+        h->last_id = id;
+        rc = start(h, id, &r);
+    }
+    free(r.headers);
+    return rc;
+}
+
+/*
+ * start - open stream id for request r, handing the HTTP/1.0 request to open_stream
+ * a stream that cannot be opened is reset; return -1 only if the client is gone
+ */
+static int start(h2_t *h, int id, request_t *r) {
+    char line[MAXLINE];
+    stream_t *s = NULL;
+    int i, n, sv[2];
+
+    metrics_add(M_H2_STREAMS, 1);
+    if (r->bad || !r->method[0] || !r->path[0] || !r->authority[0]) {
+        return refuse(h, id, ERR_PROTOCOL_ERROR);
+    }
+    for (i = 0; i < H2_MAX_STREAMS && s == NULL; i++) {
+        s = h->streams[i].id ? NULL : &h->streams[i];
+    }
+    if (h->goaway || s == NULL) {
+        return refuse(h, id, ERR_REFUSED_STREAM);
+    }
+
+    // as HTTP/1.0, so the response is never chunked; the request line has to
+    // fit the line buffer of the HTTP/1 path
+    n = snprintf(line, sizeof(line), "%s http://%s%s HTTP/1.0\r\n", r->method, r->authority, r->path);
+    if (n >= sizeof(line)) {
+        return refuse(h, id, ERR_REFUSED_STREAM);
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return refuse(h, id, ERR_INTERNAL_ERROR);
+    }
+    rio_writen(sv[0], line, n);
+    n = snprintf(line, sizeof(line), "Host: %s\r\n", r->authority);
+    rio_writen(sv[0], line, n);
+    rio_writen(sv[0], r->headers, r->len);
+    rio_writen(sv[0], "\r\n", 2);
+    shutdown(sv[0], SHUT_WR);
+    if (h->open_stream(sv[1], h->arg) < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return refuse(h, id, ERR_REFUSED_STREAM);
+    }
+
+    s->id = id;
+    s->fd = sv[0];
+    s->window = h->initial_window;
+    s->head = s->eof = 0;
+    s->buf = malloc(HEAD_SIZE);
+    s->len = 0;
+    h->nstreams++;
+    return 0;
+}
+
+/*
+ * collect - hpack_emit callback gathering the fields of a request
+ * fields go into an HTTP/1 request, so CR, LF or NUL in them make it bad;
+ * connection-specific fields, which HTTP/2 has no use for, are dropped
+ */
+static void collect(void *arg, const char *name, int namelen, const char *value, int valuelen) {
+    static const char *dropped[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+    request_t *r = arg;
+    char *dest = NULL;
+    int i, size = 0;
+
+    if (strlen(name) != namelen || strlen(value) != valuelen || strpbrk(name, "\r\n") || strpbrk(value, "\r\n")) {
+        r->bad = 1;
+        return;
+    }
+    if (name[0] == ':') {
+        if (!strcmp(name, ":method")) {
+            dest = r->method;
+            size = sizeof(r->method);
+        } else if (!strcmp(name, ":authority")) {
+            dest = r->authority;
+            size = sizeof(r->authority);
+        } else if (!strcmp(name, ":path")) {
+            dest = r->path;
+            size = sizeof(r->path);
+        } else if (strcmp(name, ":scheme")) {
+            r->bad = 1;
+        }
+        if (dest != NULL && (valuelen >= size || snprintf(dest, size, "%s", value) < 0)) {
+            r->bad = 1;
+        }
+        return;
+    }
+    if (!strcmp(name, "host")) {
+        if (!r->authority[0] && valuelen < sizeof(r->authority)) {
+            strcpy(r->authority, value);
+        }
+        return;
+    }
+    for (i = 0; i < sizeof(dropped) / sizeof(char *); i++) {
+        if (!strcmp(name, dropped[i])) {
+            return;
+        }
+    }
+    // "name: value\r\n", not NUL-terminated: start writes len bytes
+    if (r->len + namelen + valuelen + 4 > r->size) {
+        r->size = 2 * (r->len + namelen + valuelen + 4);
+        r->headers = realloc(r->headers, r->size);
+    }
+    memcpy(r->headers + r->len, name, namelen);
+    r->len += namelen;
+    memcpy(r->headers + r->len, ": ", 2);
+    r->len += 2;
+    memcpy(r->headers + r->len, value, valuelen);
+    r->len += valuelen;
+    memcpy(r->headers + r->len, "\r\n", 2);
+    r->len += 2;
+}
+
+/*
+ * fill - read what a stream's response has ready
+ * until the head is complete it gathers up to HEAD_SIZE, then a frame at a time
+ */
+static void fill(h2_t *h, stream_t *s) {
+    int n = read(s->fd, s->buf + s->len, (s->head ? H2_FRAME_SIZE : HEAD_SIZE) - s->len);
+
+    if (n < 0 && errno == EINTR) {
+        return;
+    }
+    if (n <= 0) {
+        s->eof = 1;
+        if (!s->head) {
+            reset(h, s, ERR_INTERNAL_ERROR);    // no response at all
+        }
+        return;
+    }
+    s->len += n;
+    if (!s->head) {
+        send_head(h, s);
+    }
+}
+
+/*
+ * send_head - send a stream's response head as HEADERS, once it is complete
+ * the status line becomes :status, and hop-by-hop fields are dropped
+ */
+static void send_head(h2_t *h, stream_t *s) {
+    static const char *dropped[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+    unsigned char block[HEAD_SIZE];
+    char *end, *p, *eol, *colon, *value;
+    int status, n, k, i, namelen, valuelen, flags, type;
+
+    if ((end = head_end(s->buf, s->len)) == NULL) {
+        if (s->len == HEAD_SIZE) {
+            reset(h, s, ERR_INTERNAL_ERROR);
+        }
+        return;
+    }
+    if ((status = response_status(s->buf, s->len)) < 100 || status > 999) {
+        reset(h, s, ERR_INTERNAL_ERROR);
+        return;
+    }
+    n = hpack_encode_status(block, status);
+    for (p = memchr(s->buf, '\n', end - s->buf) + 1; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if ((colon = memchr(p, ':', eol - p)) == NULL) {
+            continue;
+        }
+        namelen = colon - p;
+        for (i = 0; i < sizeof(dropped) / sizeof(char *); i++) {
+            if (namelen == strlen(dropped[i]) && !strncasecmp(p, dropped[i], namelen)) {
+                break;
+            }
+        }
+        if (i < sizeof(dropped) / sizeof(char *)) {
+            continue;
+        }
+        for (value = colon + 1; value < eol && (*value == ' ' || *value == '\t'); value++) {
+        }
+        for (valuelen = eol - value; valuelen > 0 && isspace((unsigned char)value[valuelen - 1]); valuelen--) {
+        }
+        if ((k = hpack_encode(block + n, sizeof(block) - n, p, namelen, value, valuelen)) < 0) {
+            reset(h, s, ERR_INTERNAL_ERROR);
+            return;
+        }
+        n += k;
+    }
+
+    // a block over the frame size continues in CONTINUATION frames
+    for (i = 0, type = FRAME_HEADERS; i < n; i += k, type = FRAME_CONTINUATION) {
+        k = n - i < H2_FRAME_SIZE ? n - i : H2_FRAME_SIZE;
+        flags = i + k == n ? FLAG_END_HEADERS : 0;
+        if (send_frame(h, type, flags, s->id, block + i, k) < 0) {
+            return;     // the next read from the client fails too
+        }
+    }
+    s->len -= end + 2 - s->buf;
+    memmove(s->buf, end + 2, s->len);
+    s->head = 1;
+}
+
+/*
+ * head_end - blank line ending the response head in buf[0..len), NULL if it has not come yet
+ */
+static char *head_end(char *buf, int len) {
+    int i;
+
+    for (i = 0; i + 4 <= len; i++) {
+        if (!memcmp(buf + i, "\r\n\r\n", 4)) {
+            return buf + i + 2;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * pump - send a stream's response body within the send windows, ending the stream after it
+ * return -1 if the client cannot be written
+ */
+static int pump(h2_t *h, stream_t *s) {
+    int n, flags;
+
+    if (!s->head) {
+        return 0;
+    }
+    while (s->len > 0 && s->window > 0 && h->window > 0) {
+        n = s->len < H2_FRAME_SIZE ? s->len : H2_FRAME_SIZE;
+        n = n < s->window ? n : s->window;
+        n = n < h->window ? n : h->window;
+        flags = n == s->len && s->eof ? FLAG_END_STREAM : 0;
+        if (send_frame(h, FRAME_DATA, flags, s->id, s->buf, n) < 0) {
+            return -1;
+        }
+        s->window -= n;
+        h->window -= n;
+        s->len -= n;
+        memmove(s->buf, s->buf + n, s->len);
+        if (flags) {
+            close_stream(h, s);
+            return 0;
+        }
+    }
+    if (s->len == 0 && s->eof) {
+        if (send_frame(h, FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0) < 0) {
+            return -1;
+        }
+        close_stream(h, s);
+    }
+    return 0;
+}
+
+/*
+ * send_frame - queue one frame for the client, -1 if it cannot be written
+ */
+static int send_frame(h2_t *h, int type, int flags, int id, const void *payload, int len) {
+    unsigned char *frame;
+
+    if (h->outlen + FRAME_HEADER + len > OUT_SIZE && flush(h) < 0) {
+        return -1;
+    }
+    frame = h->out + h->outlen;
+    frame[0] = len >> 16;
+    frame[1] = len >> 8;
+    frame[2] = len;
+    frame[3] = type;
+    frame[4] = flags;
+    put32(frame + 5, id);
+    if (len > 0) {
+        memcpy(frame + FRAME_HEADER, payload, len);
+    }
+    h->outlen += FRAME_HEADER + len;
+    return 0;
+}
+
+/*
+ * flush - write the queued frames to the client, -1 if they cannot be written
+ */
+static int flush(h2_t *h) {
+    int n = h->outlen;
+
+    h->outlen = 0;
+    return n > 0 && rio_writen(h->fd, h->out, n) < 0 ? -1 : 0;
+}
+
+/*
+ * refuse - reset stream id that has no slot
+ */
+static int refuse(h2_t *h, int id, int error) {
+    unsigned char code[4];
+
+    put32(code, error);
+    return send_frame(h, FRAME_RST_STREAM, 0, id, code, sizeof(code));
+}
+
+/*
+ * reset - reset stream s and close it
+ * the thread serving it sees its socket pair close, and gives up
+ */
+static void reset(h2_t *h, stream_t *s, int error) {
+    refuse(h, s->id, error);
+    close_stream(h, s);
+}
+
+/*
+ * close_stream - free the slot of stream s
+ */
+static void close_stream(h2_t *h, stream_t *s) {
+    close(s->fd);
+    free(s->buf);
+    s->id = 0;
+    h->nstreams--;
+}
+
+/*
+ * fail - end the connection with a GOAWAY for error, return -1
+ * with ERR_NO_ERROR this is a graceful close: open streams still finish
+ */
+static int fail(h2_t *h, int error) {
+    unsigned char payload[8];
+
+    put32(payload, h->last_id);
+    put32(payload + 4, error);
+    send_frame(h, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    h->goaway = 1;
+    return -1;
+}
+
+/*
+ * find - stream id, NULL if it is not open
+ */
+static stream_t *find(h2_t *h, int id) {
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS && id != 0; i++) {
+        if (h->streams[i].id == id) {
+            return &h->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * get32 - big-endian 32-bit integer at p
+ */
+static unsigned long get32(const unsigned char *p) {
+    return (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * put32 - store v at p as a big-endian 32-bit integer
+ */
+static void put32(unsigned char *p, unsigned long v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
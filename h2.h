@@ -0,0 +1,38 @@
+/*
+ * h2.h - HTTP/2 over cleartext TCP (h2c) for clients with prior knowledge
+ *
+ * A client that opens with the HTTP/2 connection preface multiplexes its
+ * requests over that one connection. Once a stream's headers are complete,
+ * they are rewritten as an HTTP/1.0 request into one end of a socket pair,
+ * and the other end is handed to open_stream to be served like any client
+ * connection, through the cache and the upstream paths. The response read
+ * back becomes HEADERS and DATA frames, sent within the client's flow
+ * control windows.
+ *
+ * One thread polls the client and the streams of a connection. Request
+ * bodies are discarded, as the HTTP/1 path forwards none either, and their
+ * window is credited back at once.
+ */
+#ifndef __H2_H__
+#define __H2_H__
+
+#include "csapp.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n"     // request line of the connection preface
+#define H2_MAX_STREAMS 100      // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_FRAME_SIZE 16384     // largest frame sent or taken (the default SETTINGS_MAX_FRAME_SIZE)
+#define H2_WINDOW 65535         // initial flow control window
+#define H2_MAX_HEADERS 65536    // largest request header block
+
+/*
+ * helper functions
+ *
+ * h2_serve: speak HTTP/2 on client fd once the preface request line has been read through rp
+ *           timeout: seconds an idle connection is kept (0: no limit)
+ *           stop: once set, the connection closes after its open streams finish
+ *           open_stream: serve the request written to fd like a new connection, -1 to refuse it
+ */
+void h2_serve(int fd, rio_t *rp, int timeout, volatile sig_atomic_t *stop,
+              int (*open_stream)(int fd, void *arg), void *arg);
+
+#endif /* __H2_H__ */
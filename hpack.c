@@ -0,0 +1,449 @@
+/*
+ * hpack.c - HPACK header compression for HTTP/2 (RFC 7541)
+ *
+ * The Huffman code of Appendix B is canonical: the codes of each length are
+ * consecutive and in symbol order, so its table of code lengths is enough to
+ * decode it a bit at a time.
+ */
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hpack.h"
+
+#define STATIC_ENTRIES 61
+#define CAPACITY (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)     // most entries the dynamic table holds
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_LEN 30
+
+/* static table (Appendix A); index 1 is the first entry */
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[STATIC_ENTRIES] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* Huffman code length of every symbol, EOS last (Appendix B) */
+static const unsigned char huffman_len[HUFFMAN_EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/*
+ * canonical decoding tables, built once: the first code of each length, how
+ * many codes it has, and where their symbols start in huffman_syms
+ */
+static unsigned int huffman_first[HUFFMAN_MAX_LEN + 1];
+static unsigned int huffman_count[HUFFMAN_MAX_LEN + 1];
+static int huffman_start[HUFFMAN_MAX_LEN + 1];
+static short huffman_syms[HUFFMAN_EOS + 1];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+/*
+ * helper functions
+ *
+ * huffman_build: build the canonical decoding tables
+ * huffman_decode: decode n Huffman-coded bytes into out (size bytes), return the length or -1
+ * integer: decode an integer with a prefix-bit prefix at *p, advancing *p; -1 if malformed
+ * string: decode a string literal at *p into out (HPACK_MAX_STRING + 1 bytes), advancing *p
+ *         return its length, or -1 if malformed
+ * field: entry index of the static or dynamic table, -1 if there is none
+ * add: insert a field at the front of the dynamic table, evicting the oldest to make room
+ * evict: drop the oldest entries until the table fits in max bytes
+ * put_integer: encode v with a prefix-bit prefix, after the flag bits, into out (size bytes)
+ */
+static void huffman_build(void);
+static int huffman_decode(const unsigned char *in, int n, char *out, int size);
+static long integer(const unsigned char **p, const unsigned char *end, int prefix);
+static int string(const unsigned char **p, const unsigned char *end, char *out);
+static int field(hpack_table *t, long index, hpack_entry *f);
+static void add(hpack_table *t, const char *name, int namelen, const char *value, int valuelen);
+static void evict(hpack_table *t, int max);
+static int put_integer(unsigned char *out, int size, int prefix, unsigned char flags, long v);
+
+/*
+ * hpack_init - make t an empty dynamic table
+ */
+void hpack_init(hpack_table *t) {
+    memset(t, 0, sizeof(hpack_table));
+    t->max_size = HPACK_TABLE_SIZE;
+}
+
+/*
+ * hpack_free - free the entries of t
+ */
+void hpack_free(hpack_table *t) {
+    evict(t, 0);
+}
+
+/*
+ * hpack_decode - decode the header block in[0..n) through t, calling emit for each field
+ */
+int hpack_decode(hpack_table *t, const unsigned char *in, int n, hpack_emit emit, void *arg) {
+    const unsigned char *p = in, *end = in + n;
+    char name[HPACK_MAX_STRING + 1], value[HPACK_MAX_STRING + 1];
+    int namelen, valuelen, indexing, fields = 0;
+    hpack_entry f;
+    long index;
+
+    while (p < end) {
+        // indexed field (1xxxxxxx)
+        if (*p & 0x80) {
+            if ((index = integer(&p, end, 7)) < 0 || field(t, index, &f) < 0) {
+                return -1;
+            }
+            emit(arg, f.name, f.namelen, f.value, f.valuelen);
+            fields++;
+            continue;
+        }
+
+        // dynamic table size update (001xxxxx), only before the first field
+        if ((*p & 0xe0) == 0x20) {
+            if (fields > 0 || (index = integer(&p, end, 5)) < 0 || index > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            t->max_size = index;
+            evict(t, index);
+            continue;
+        }
+
+        // literal with incremental indexing (01xxxxxx), without indexing
+        // (0000xxxx) or never indexed (0001xxxx); the name is copied, since
+        // adding the field may evict the entry it came from
+        indexing = (*p & 0xc0) == 0x40;
+        if ((index = integer(&p, end, indexing ? 6 : 4)) < 0) {
+            return -1;
+        }
+        if (index > 0) {
+            if (field(t, index, &f) < 0) {
+                return -1;
+            }
+            memcpy(name, f.name, f.namelen + 1);
+            namelen = f.namelen;
+        } else if ((namelen = string(&p, end, name)) < 0) {
+            return -1;
+        }
+        if ((valuelen = string(&p, end, value)) < 0) {
+            return -1;
+        }
+        if (indexing) {
+            add(t, name, namelen, value, valuelen);
+        }
+        emit(arg, name, namelen, value, valuelen);
+        fields++;
+    }
+    return 0;
+}
+
+/*
+ * hpack_encode_status - encode a :status field into out (at least 5 bytes), return its length
+ * status must have three digits
+ */
+int hpack_encode_status(unsigned char *out, int status) {
+    int i;
+
+    for (i = 8; i <= 14; i++) {     // ":status 200" ... ":status 500"
+        if (atoi(static_table[i - 1].value) == status) {
+            out[0] = 0x80 | i;
+            return 1;
+        }
+    }
+    out[0] = 0x08;      // literal without indexing, name of entry 8
+    out[1] = 3;
+    out[2] = '0' + status / 100 % 10;
+    out[3] = '0' + status / 10 % 10;
+    out[4] = '0' + status % 10;
+    return 5;
+}
+
+/*
+ * hpack_encode - encode the field name (lowercased) and value into out as a literal without indexing
+ */
+int hpack_encode(unsigned char *out, int size, const char *name, int namelen, const char *value, int valuelen) {
+    int n = 1, k, i;
+
+    if (size < 1) {
+        return -1;
+    }
+    out[0] = 0x00;      // literal without indexing, new name
+    if ((k = put_integer(out + n, size - n, 7, 0, namelen)) < 0 || n + k + namelen > size) {
+        return -1;
+    }
+    n += k;
+    for (i = 0; i < namelen; i++) {
+        out[n++] = tolower((unsigned char)name[i]);
+    }
+    if ((k = put_integer(out + n, size - n, 7, 0, valuelen)) < 0 || n + k + valuelen > size) {
+        return -1;
+    }
+    n += k;
+    memcpy(out + n, value, valuelen);
+    return n + valuelen;
+}
+
+/*
+ * huffman_build - build the canonical decoding tables
+ */
+static void huffman_build(void) {
+    unsigned int code = 0;
+    int len, sym, i = 0;
+
+    for (len = 1; len <= HUFFMAN_MAX_LEN; len++) {
+        huffman_first[len] = code;
+        huffman_start[len] = i;
+        for (sym = 0; sym <= HUFFMAN_EOS; sym++) {
+            if (huffman_len[sym] == len) {
+                huffman_syms[i++] = sym;
+                huffman_count[len]++;
+            }
+        }
+        code = (code + huffman_count[len]) << 1;
+    }
+}
+
+/*
+ * huffman_decode - decode n Huffman-coded bytes into out (size bytes), return the length or -1
+ * the last byte is padded with the high bits of EOS, and EOS itself is an error
+ */
+static int huffman_decode(const unsigned char *in, int n, char *out, int size) {
+    unsigned int code = 0;
+    int len = 0, bit, sym, i, k = 0;
+
+    pthread_once(&huffman_once, huffman_build);
+    for (i = 0; i < n; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            code = code << 1 | ((in[i] >> bit) & 1);
+            if (++len > HUFFMAN_MAX_LEN) {
+                return -1;
+            }
+            // codes of this length run from huffman_first[len] (unsigned: below wraps around)
+            if (code - huffman_first[len] < huffman_count[len]) {
+                sym = huffman_syms[huffman_start[len] + code - huffman_first[len]];
+                if (sym == HUFFMAN_EOS || k == size) {
+                    return -1;
+                }
+                out[k++] = sym;
+                code = len = 0;
+            }
+        }
+    }
+    if (len > 7 || code != (1u << len) - 1) {
+        return -1;
+    }
+    return k;
+}
+
+/*
+ * integer - decode an integer with a prefix-bit prefix at *p, advancing *p; -1 if malformed
+ * values past 2^28 are refused, since nothing we take is that large
+ */
+static long integer(const unsigned char **p, const unsigned char *end, int prefix) {
+    long max = (1 << prefix) - 1, v;
+    int shift = 0;
+
+    if (*p >= end) {
+        return -1;
+    }
+    if ((v = *(*p)++ & max) < max) {
+        return v;
+    }
+    do {
+        if (*p >= end || shift > 21) {
+            return -1;
+        }
+        v += (long)(**p & 0x7f) << shift;
+        shift += 7;
+    } while (*(*p)++ & 0x80);
+    return v;
+}
+
+/*
+ * string - decode a string literal at *p into out (HPACK_MAX_STRING + 1 bytes), advancing *p
+ */
+static int string(const unsigned char **p, const unsigned char *end, char *out) {
+    int huffman, n;
+    long len;
+
+    if (*p >= end) {
+        return -1;
+    }
+    huffman = **p & 0x80;
+    if ((len = integer(p, end, 7)) < 0 || len > end - *p) {
+        return -1;
+    }
+    if (huffman) {
+        n = huffman_decode(*p, len, out, HPACK_MAX_STRING);
+    } else if ((n = len) <= HPACK_MAX_STRING) {
+        memcpy(out, *p, len);
+    } else {
+        n = -1;
+    }
+    *p += len;
+    if (n >= 0) {
+        out[n] = '\0';
+    }
+    return n;
+}
+
+/*
+ * field - entry index of the static or dynamic table, -1 if there is none
+ */
+static int field(hpack_table *t, long index, hpack_entry *f) {
+    if (index >= 1 && index <= STATIC_ENTRIES) {
+        f->name = (char *)static_table[index - 1].name;
+        f->value = (char *)static_table[index - 1].value;
+        f->namelen = strlen(f->name);
+        f->valuelen = strlen(f->value);
+        return 0;
+    }
+    index -= STATIC_ENTRIES + 1;
+    if (index < 0 || index >= t->count) {
+        return -1;
+    }
+    *f = t->entries[(t->first + index) % CAPACITY];
+    return 0;
+}
+
+/*
+ * add - insert a field at the front of the dynamic table, evicting the oldest to make room
+ * a field larger than the whole table just empties it
+ */
+static void add(hpack_table *t, const char *name, int namelen, const char *value, int valuelen) {
+    int size = namelen + valuelen + HPACK_ENTRY_OVERHEAD;
+    hpack_entry *e;
+
+    evict(t, t->max_size - size);
+    if (size > t->max_size) {
+        return;
+    }
+    t->first = (t->first + CAPACITY - 1) % CAPACITY;
+    e = &t->entries[t->first];
+    e->name = malloc(namelen + 1);
+    memcpy(e->name, name, namelen + 1);
+    e->namelen = namelen;
+    e->value = malloc(valuelen + 1);
+    memcpy(e->value, value, valuelen + 1);
+    e->valuelen = valuelen;
+    t->count++;
+    t->size += size;
+}
+
+/*
+ * evict - drop the oldest entries until the table fits in max bytes
+ */
+static void evict(hpack_table *t, int max) {
+    hpack_entry *e;
+
+    while (t->count > 0 && t->size > max) {
+        e = &t->entries[(t->first + t->count - 1) % CAPACITY];
+        t->size -= e->namelen + e->valuelen + HPACK_ENTRY_OVERHEAD;
+        free(e->name);
+        free(e->value);
+        t->count--;
+    }
+}
+
+/*
+ * put_integer - encode v with a prefix-bit prefix, after the flag bits, into out (size bytes)
+ * return the length, or -1 if it does not fit
+ */
+static int put_integer(unsigned char *out, int size, int prefix, unsigned char flags, long v) {
+    long max = (1 << prefix) - 1;
+    int n = 0;
+
+    if (size < 1) {
+        return -1;
+    }
+    if (v < max) {
+        out[0] = flags | v;
+        return 1;
+    }
+    out[n++] = flags | max;
+    for (v -= max; v >= 128; v >>= 7) {
+        if (n == size) {
+            return -1;
+        }
+        out[n++] = (v & 0x7f) | 0x80;
+    }
+    if (n == size) {
+        return -1;
+    }
+    out[n++] = v;
+    return n;
+}
@@ -0,0 +1,59 @@
+/*
+ * hpack.h - HPACK header compression for HTTP/2 (RFC 7541)
+ *
+ * The decoder takes anything a client may send: indexed fields, literals
+ * with and without indexing, dynamic table size updates, and Huffman-coded
+ * strings. The encoder writes responses as literals without indexing, with
+ * :status from the static table where it can, and never Huffman-codes: every
+ * decoder accepts that, and it keeps no dynamic table to synchronize.
+ */
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+#define HPACK_TABLE_SIZE 4096       // dynamic table size (the default, which we never raise)
+#define HPACK_MAX_STRING 8192       // longest name or value decoded
+#define HPACK_ENTRY_OVERHEAD 32     // RFC 7541 size of an entry beyond its name and value
+
+/* dynamic table entry */
+typedef struct hpack_entry {
+    char *name;
+    char *value;
+    int namelen;
+    int valuelen;
+} hpack_entry;
+
+/*
+ * decoder state of one connection
+ *
+ * entries: ring of the dynamic table, entries[first] the newest of count
+ * size, max_size: RFC 7541 size of the entries, and the limit the client set
+ */
+typedef struct hpack_table {
+    hpack_entry entries[HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD];
+    int first;
+    int count;
+    int size;
+    int max_size;
+} hpack_table;
+
+/* receives each decoded header field; name and value are NUL-terminated too */
+typedef void (*hpack_emit)(void *arg, const char *name, int namelen, const char *value, int valuelen);
+
+/*
+ * helper functions
+ *
+ * hpack_init: make t an empty dynamic table
+ * hpack_free: free the entries of t
+ * hpack_decode: decode the header block in[0..n) through t, calling emit for each field
+ *               return -1 on a compression error, after which t is unusable
+ * hpack_encode_status: encode a :status field into out (at least 5 bytes), return its length
+ * hpack_encode: encode the field name (lowercased) and value into out as a literal without indexing
+ *               return its length, or -1 if it does not fit in size bytes
+ */
+void hpack_init(hpack_table *t);
+void hpack_free(hpack_table *t);
+int hpack_decode(hpack_table *t, const unsigned char *in, int n, hpack_emit emit, void *arg);
+int hpack_encode_status(unsigned char *out, int status);
+int hpack_encode(unsigned char *out, int size, const char *name, int namelen, const char *value, int valuelen);
+
+#endif /* __HPACK_H__ */
@@ -0,0 +1,102 @@
+/*
+ * http.c - HTTP request line, URL, and response status parsing
+ */
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+
+/*
+ * response_status - status code of an HTTP response starting at buf, 0 if unknown
+ */
+int response_status(char *buf, int n) {
+    // HTTP/1.x NNN
+    if (n < 12 || strncmp(buf, "HTTP/", 5) || buf[8] != ' ' ||
+        !isdigit(buf[9]) || !isdigit(buf[10]) || !isdigit(buf[11])) {
+        return 0;
+    }
+    return (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+}
+
+/*
+ * response_framing - update the body length and keep-alive of a response from one line of its head
+ * the status line sets keep-alive from the version (persistent from HTTP/1.1
+ * on), then Content-Length and Connection headers override it; *length
+ * stays -1 if the body runs to the end of the connection
+ */
+void response_framing(const char *line, long *length, int *keepalive) {
+    const char *v;
+
+    if (!strncmp(line, "HTTP/1.", 7)) {
+        *keepalive = line[7] != '0';
+    } else if (!strncasecmp(line, "Content-Length:", 15)) {
+        *length = strtol(line + 15, NULL, 10);
+    } else if (!strncasecmp(line, "Connection:", 11)) {
+        for (v = line + 11; *v == ' ' || *v == '\t'; v++) {
+        }
+        if (!strncasecmp(v, "close", 5)) {
+            *keepalive = 0;
+        } else if (!strncasecmp(v, "keep-alive", 10)) {
+            *keepalive = 1;
+        }
+    }
+}
+
+/*
+ * check_request_line - parse request line and check validity
+ * return 0 if valid, -1 if invalid
+ */
+int check_request_line(char *reqline, char **method, char **url, char **version) {
+    char *save;
+
+    if (strchr(reqline, ' ') == NULL) {     // only 1 arg
+        return -1;
+    }
+    *method = strtok_r(reqline, " ", &save);
+    *url = strtok_r(NULL, " ", &save);
+    if ((*version = strtok_r(NULL, "\r\n", &save)) == NULL) {    // only 2 args
+        return -1;
+    }
+    if (strcmp(*version, "HTTP/1.1") && strcmp(*version, "HTTP/1.0")) { // unsupported HTTP version
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * parse_url - parse URL to get host, port, and URI
+ */
+void parse_url(char *url, char **host, char **port, char **uri) {
+    // url = http://<host>:<port><uri>
+    char *hp, *pu, *save;
+
+    if (!strncmp(url, "http://", 7)) {
+        url += 7;
+    }
+    hp = strchr(url, ':');
+    pu = strchr(url, '/');
+
+    if (hp == NULL) {
+        strtok_r(url, "/", &save);
+        *host = malloc((strlen(url) + 1));
+        strcpy(*host, url);
+        *port = malloc(4);
+        strcpy(*port, "80");
+    } else {
+        strtok_r(url, ":", &save);
+        *host = malloc((strlen(url) + 1));
+        strcpy(*host, url);
+        url = strtok_r(NULL, "/", &save);
+        *port = malloc(sizeof(url));
+        strcpy(*port, url);
+    }
+    if (pu == NULL || (url = strtok_r(NULL, "", &save)) == NULL) {
+        *uri = malloc(2);
+        strcpy(*uri, "/");
+    } else {
+        *uri = malloc((strlen(url) + 2));
+        strcpy(*uri, "/");
+        strcat(*uri, url);
+    }
+}
@@ -0,0 +1,20 @@
+/*
+ * http.h - HTTP request line, URL, and response status parsing
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+/*
+ * helper functions
+ *
+ * check_request_line: parse request line and check validity
+ * parse_url: parse URL to get host, port, and URI (malloc'd, freed by the caller)
+ * response_status: status code of an HTTP response starting at buf, 0 if unknown
+ * response_framing: update the body length and keep-alive of a response from one line of its head
+ */
+int check_request_line(char *reqline, char **method, char **uri, char **version);
+void parse_url(char *url, char **host, char **port, char **uri);
+int response_status(char *buf, int n);
+void response_framing(const char *line, long *length, int *keepalive);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,205 @@
+/*
+ * metrics.c - lock-free counters and latency histograms for the proxy
+ */
+#include <string.h>
+#include "metrics.h"
+
+/*
+ * shards: per-thread counter blocks, handed out round-robin
+ * nextshard: index of the next shard to hand out
+ * gauges: global gauges, each with a single writer
+ */
+static metrics_shard shards[METRICS_SHARDS];
+static unsigned int nextshard = 0;
+static long gauges[G_NGAUGES];
+
+__thread metrics_shard *metrics_myshard = NULL;
+
+/* names and help strings for Prometheus exposition, indexed by enum */
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} counter_info[M_NCOUNTERS] = {
+    [M_REQUESTS] = {"proxy_requests_total", "counter", "Client connections handled."},
+    [M_BAD_REQUESTS] = {"proxy_bad_requests_total", "counter", "Requests rejected with 400."},
+    [M_CACHE_HITS] = {"proxy_cache_hits_total", "counter", "Requests served from the cache."},
+    [M_CACHE_MISSES] = {"proxy_cache_misses_total", "counter", "Requests forwarded to an upstream."},
+    [M_CACHE_INSERTS] = {"proxy_cache_inserts_total", "counter", "Objects inserted into the cache."},
+    [M_CACHE_EVICTIONS] = {"proxy_cache_evictions_total", "counter", "Objects evicted from the cache."},
+    [M_UPSTREAM_ERRORS] = {"proxy_upstream_errors_total", "counter", "Failed upstream connections."},
+    [M_BYTES_FROM_UPSTREAM] = {"proxy_upstream_bytes_total", "counter", "Bytes read from upstreams."},
+    [M_BYTES_TO_CLIENT] = {"proxy_client_bytes_total", "counter", "Bytes written to clients."},
+    [M_ACTIVE_CONNS] = {"proxy_active_connections", "gauge", "Client connections in progress."},
+    [M_ACCESSLOG_DROPS] = {"proxy_accesslog_dropped_total", "counter", "Access log records dropped on full rings."},
+    [M_REJECTED_CONNS] = {"proxy_rejected_connections_total", "counter", "Connections refused with 503 over max_connections."},
+    [M_CONFIG_RELOADS] = {"proxy_config_reloads_total", "counter", "Configuration files reloaded on SIGHUP."},
+    [M_CLIENT_RATE_LIMITED] = {"proxy_client_rate_limited_total", "counter", "Connections refused with 429 over client_rate."},
+    [M_ORIGIN_RATE_LIMITED] = {"proxy_origin_rate_limited_total", "counter", "Requests refused with 429 over origin_rate."},
+    [M_UPSTREAM_REUSED] = {"proxy_upstream_reused_total", "counter", "Upstream requests sent on a pooled connection."},
+    [M_UPSTREAM_EJECTIONS] = {"proxy_upstream_ejections_total", "counter", "Upstream servers ejected as unhealthy."},
+    [M_HEALTH_PROBE_FAILURES] = {"proxy_health_probe_failures_total", "counter", "Failed active health probes."},
+    [M_ORIGIN_OVERLOADED] = {"proxy_origin_overloaded_total", "counter", "Requests refused with 503 over an origin's concurrency limit."},
+    [M_BREAKER_REJECTED] = {"proxy_breaker_rejected_total", "counter", "Requests refused with 503 by an open circuit."},
+    [M_BREAKER_OPENS] = {"proxy_breaker_opens_total", "counter", "Origin circuits opened after repeated failures."},
+    [M_HEDGES] = {"proxy_hedges_total", "counter", "Hedged requests sent to a second upstream server."},
+    [M_HEDGE_WINS] = {"proxy_hedge_wins_total", "counter", "Hedged requests answered first by the second server."},
+    [M_MISS_QUEUE_FULL] = {"proxy_miss_queue_full_total", "counter", "Cache misses refused with 503 while the miss queue was full."},
+    [M_CONN_QUEUE_FULL] = {"proxy_conn_queue_full_total", "counter", "Connections refused with 503 while the front workers' queue was full."},
+    [M_H2_CONNECTIONS] = {"proxy_h2_connections_total", "counter", "Client connections speaking HTTP/2 (h2c)."},
+    [M_H2_STREAMS] = {"proxy_h2_streams_total", "counter", "HTTP/2 streams opened by clients."},
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} hist_info[H_NHISTS] = {
+    [H_PARSE] = {"proxy_parse_duration_seconds", "Time spent parsing the request line and URL."},
+    [H_CACHE_LOOKUP] = {"proxy_cache_lookup_duration_seconds", "Time spent looking up the cache."},
+    [H_UPSTREAM_CONNECT] = {"proxy_upstream_connect_duration_seconds", "Time spent in open_clientfd."},
+    [H_TTFB] = {"proxy_ttfb_duration_seconds", "Time from accept to the first upstream byte."},
+    [H_TOTAL] = {"proxy_request_duration_seconds", "Time from accept to connection close."},
+    [H_HEDGE_SAVED] = {"proxy_hedge_saved_seconds", "Estimated time to first byte saved by hedges that won."},
+    [H_MISS_WAIT] = {"proxy_miss_queue_wait_seconds", "Time cache misses waited for a miss worker."},
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} gauge_info[G_NGAUGES] = {
+    [G_CACHE_BYTES] = {"proxy_cache_bytes", "Bytes of object data held in the cache."},
+    [G_CACHE_OBJECTS] = {"proxy_cache_objects", "Objects held in the cache."},
+};
+
+/*
+ * metrics_shard_slow - bind the calling thread to a shard on first use
+ */
+metrics_shard *metrics_shard_slow(void) {
+    unsigned int i = __atomic_fetch_add(&nextshard, 1, __ATOMIC_RELAXED);
+
+    metrics_myshard = &shards[i % METRICS_SHARDS];
+    return metrics_myshard;
+}
+
+/*
+ * metrics_gauge_set - set a global gauge (single writer)
+ */
+void metrics_gauge_set(enum metrics_gauge g, long v) {
+    __atomic_store_n(&gauges[g], v, __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_counter_value - sum of counter c over all shards
+ */
+long metrics_counter_value(enum metrics_counter c) {
+    long v = 0;
+    int i;
+
+    for (i = 0; i < METRICS_SHARDS; i++) {
+        v += __atomic_load_n(&shards[i].counters[c], __ATOMIC_RELAXED);
+    }
+    return v;
+}
+
+/*
+ * metrics_hist_snapshot - sum of histogram h over all shards into buckets, return total count
+ */
+unsigned long metrics_hist_snapshot(enum metrics_hist h, unsigned long *buckets, unsigned long *sum) {
+    unsigned long count = 0;
+    int i, b;
+
+    memset(buckets, 0, sizeof(unsigned long) * HIST_BUCKETS);
+    if (sum != NULL) {
+        *sum = 0;
+    }
+    for (i = 0; i < METRICS_SHARDS; i++) {
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            buckets[b] += __atomic_load_n(&shards[i].hist[h][b], __ATOMIC_RELAXED);
+        }
+        if (sum != NULL) {
+            *sum += __atomic_load_n(&shards[i].hist_sum[h], __ATOMIC_RELAXED);
+        }
+    }
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        count += buckets[b];
+    }
+    return count;
+}
+
+/*
+ * metrics_bucket_upper - largest value (microseconds) that falls in bucket b
+ */
+unsigned long metrics_bucket_upper(int b) {
+    int group, sub;
+
+    if (b < HIST_SUB) {
+        return b;
+    }
+    group = b / HIST_SUB;
+    sub = b % HIST_SUB;
+    return ((unsigned long)(HIST_SUB + sub + 1) << (group - 1)) - 1;
+}
+
+/*
+ * metrics_quantile - q-quantile (0..1) of histogram h in microseconds, 0 if empty
+ */
+unsigned long metrics_quantile(enum metrics_hist h, double q) {
+    unsigned long buckets[HIST_BUCKETS], count, rank, seen = 0;
+    int b;
+
+    if ((count = metrics_hist_snapshot(h, buckets, NULL)) == 0) {
+        return 0;
+    }
+    rank = (unsigned long)(q * count);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) {
+            return metrics_bucket_upper(b);
+        }
+    }
+    return metrics_bucket_upper(HIST_BUCKETS - 1);
+}
+
+/*
+ * render_hist - write one histogram with power-of-two `le` boundaries
+ */
+static void render_hist(FILE *fp, enum metrics_hist h) {
+    unsigned long buckets[HIST_BUCKETS], count, sum, cum = 0;
+    int b = 0, exp;
+
+    count = metrics_hist_snapshot(h, buckets, &sum);
+    fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", hist_info[h].name, hist_info[h].help, hist_info[h].name);
+
+    // bucket b counts toward `le` 2^exp us once its upper bound is below 2^exp
+    for (exp = 0; exp <= HIST_MAX_EXP; exp++) {
+        while (b < HIST_BUCKETS && metrics_bucket_upper(b) < (1UL << exp)) {
+            cum += buckets[b++];
+        }
+        fprintf(fp, "%s_bucket{le=\"%g\"} %lu\n", hist_info[h].name, (double)(1UL << exp) / 1e6, cum);
+    }
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %lu\n", hist_info[h].name, count);
+    fprintf(fp, "%s_sum %g\n", hist_info[h].name, (double)sum / 1e6);
+    fprintf(fp, "%s_count %lu\n", hist_info[h].name, count);
+}
+
+/*
+ * metrics_render - write all metrics in Prometheus text exposition format
+ */
+void metrics_render(FILE *fp) {
+    int i;
+
+    for (i = 0; i < M_NCOUNTERS; i++) {
+        fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %ld\n", counter_info[i].name, counter_info[i].help,
+                counter_info[i].name, counter_info[i].type, counter_info[i].name, metrics_counter_value(i));
+    }
+    for (i = 0; i < G_NGAUGES; i++) {
+        fprintf(fp, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n", gauge_info[i].name, gauge_info[i].help,
+                gauge_info[i].name, gauge_info[i].name, __atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+    }
+    for (i = 0; i < H_NHISTS; i++) {
+        render_hist(fp, i);
+    }
+}
@@ -2,10 +2,12 @@
 
 # nop-server.py - This is a server that we use to create head-of-line
 #                 blocking for the concurrency test. It accepts a
-#                 connection, and then spins forever.
+#                 connection, and then blocks forever. bench/origin -m hang
+#                 is the native equivalent for benchmarks.
 #
 # usage: nop-server.py <port>                
 #
+import signal
 import socket
 import sys
 
@@ -17,4 +19,4 @@ serversocket.listen(5)
 while 1:
   channel, details = serversocket.accept()
   while 1:
-    continue
+    signal.pause()
@@ -0,0 +1,255 @@
+/*
+ * origin.c - per-origin circuit breaker and concurrency limit
+ *
+ * A slot taken over by a new origin keeps its inflight count: requests
+ * still holding the old entry decrement what they incremented, so the
+ * count stays balanced and only the limit and breaker state start over.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+#include "origin.h"
+
+#define ORIGIN_IDLE_NS (ORIGIN_IDLE_SECS * 1000000000L)
+#define EWMA_SHORT 3        // weight of a new latency sample: 1/8
+#define EWMA_LONG 6         // ... and 1/64
+
+/*
+ * origin entry
+ *
+ * inflight: requests admitted and not yet left
+ * limit, growth: adaptive limit, and good requests since it last grew
+ * short_ewma, long_ewma: time to first byte in microseconds
+ * failures: failed requests in a row
+ * state, open_until: circuit state, and when an open one lets a trial through
+ * last_used: metrics_now() of the last request, for reuse of idle slots
+ */
+struct origin {
+    unsigned long key;
+    int inflight;
+    int limit;
+    int growth;
+    int failures;
+    long short_ewma;
+    long long_ewma;
+    int state;
+    long open_until;
+    long last_used;
+} __attribute__((aligned(64)));
+
+struct origin_table {
+    origin_t shards[ORIGIN_SHARDS][ORIGIN_SLOTS];
+};
+
+/*
+ * helper functions
+ *
+ * find: entry of key within its shard, taking over an empty or idle one if absent
+ * ewma: move *avg towards sample by 1/2^shift, return the new average
+ * open_circuit: refuse requests to o for breaker_timeout seconds
+ */
+static origin_t *find(origin_table *t, unsigned long key, long now);
+static long ewma(long *avg, long sample, int shift);
+static void open_circuit(origin_t *o, const config_t *conf, long now);
+
+/*
+ * origin_create - allocate an empty table
+ */
+origin_table *origin_create(void) {
+    origin_table *t;
+
+    if (posix_memalign((void **)&t, 64, sizeof(origin_table)) != 0) {
+        return NULL;
+    }
+    memset(t, 0, sizeof(origin_table));
+    return t;
+}
+
+/*
+ * origin_key - key of the origin host:port (FNV-1a), never 0
+ */
+unsigned long origin_key(const char *host, const char *port) {
+    unsigned long h = 14695981039346656037UL;
+
+    while (*host) {
+        h = (h ^ (unsigned char)*host++) * 1099511628211UL;
+    }
+    h = (h ^ ':') * 1099511628211UL;
+    while (*port) {
+        h = (h ^ (unsigned char)*port++) * 1099511628211UL;
+    }
+    return h ? h : 1;
+}
+
+/*
+ * origin_enter - admit a request to origin key under the limits of conf
+ * return 0 if admitted, 1 if admitted as the trial of a half-open circuit, -1
+ * if refused by the breaker or the concurrency limit
+ */
+int origin_enter(origin_table *t, unsigned long key, const config_t *conf, origin_t **op) {
+    long now = metrics_now();
+    int state, trial = 0, limit;
+    origin_t *o;
+
+    *op = NULL;
+    if ((o = find(t, key, now)) == NULL) {
+        return 0;       // table full here: not tracked, not limited
+    }
+    __atomic_store_n(&o->last_used, now, __ATOMIC_RELAXED);
+
+    // an open circuit lets one request through once its time is up
+    state = __atomic_load_n(&o->state, __ATOMIC_RELAXED);
+    if (state == ORIGIN_OPEN && now >= __atomic_load_n(&o->open_until, __ATOMIC_RELAXED)) {
+        trial = __atomic_compare_exchange_n(&o->state, &state, ORIGIN_HALF_OPEN, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    if (state != ORIGIN_CLOSED && !trial) {
+        metrics_add(M_BREAKER_REJECTED, 1);
+        return -1;
+    }
+
+    limit = conf->origin_max_inflight;
+    if (conf->origin_adaptive) {
+        limit = __atomic_load_n(&o->limit, __ATOMIC_RELAXED);
+        limit = conf->origin_max_inflight > 0 && limit > conf->origin_max_inflight ? conf->origin_max_inflight : limit;
+    }
+    if (__atomic_fetch_add(&o->inflight, 1, __ATOMIC_RELAXED) >= limit && limit > 0) {
+        __atomic_fetch_sub(&o->inflight, 1, __ATOMIC_RELAXED);
+        if (trial) {
+            __atomic_store_n(&o->state, ORIGIN_OPEN, __ATOMIC_RELAXED);  // next request tries again
+        }
+        metrics_add(M_ORIGIN_OVERLOADED, 1);
+        return -1;
+    }
+    *op = o;
+    return trial;
+}
+
+/*
+ * origin_leave - end an admitted request with its outcome
+ * a connect failure, no response or a 5xx is a failure
+ */
+void origin_leave(origin_t *o, const config_t *conf, int status, long latency) {
+    int failed = status <= 0 || status >= 500, limit, cap;
+    long now = metrics_now(), s, l;
+
+    if (o == NULL) {
+        return;
+    }
+    __atomic_fetch_sub(&o->inflight, 1, __ATOMIC_RELAXED);
+
+    // circuit breaker
+    if (failed) {
+        if ((__atomic_add_fetch(&o->failures, 1, __ATOMIC_RELAXED) >= conf->breaker_failures &&
+             conf->breaker_failures > 0) || __atomic_load_n(&o->state, __ATOMIC_RELAXED) == ORIGIN_HALF_OPEN) {
+            open_circuit(o, conf, now);
+        }
+    } else {
+        __atomic_store_n(&o->failures, 0, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&o->state, __ATOMIC_RELAXED) == ORIGIN_HALF_OPEN) {
+            __atomic_store_n(&o->state, ORIGIN_CLOSED, __ATOMIC_RELAXED);
+        }
+    }
+
+    // AIMD: back off by a tenth on failures and rising latency, else creep up
+    if (!conf->origin_adaptive) {
+        return;
+    }
+    cap = conf->origin_max_inflight > 0 ? conf->origin_max_inflight : ORIGIN_MAX_LIMIT;
+    limit = __atomic_load_n(&o->limit, __ATOMIC_RELAXED);
+    if (status > 0) {
+        s = ewma(&o->short_ewma, latency / 1000, EWMA_SHORT);
+        l = ewma(&o->long_ewma, latency / 1000, EWMA_LONG);
+        failed |= s > 2 * l;
+    }
+    if (failed) {
+        limit -= limit / 10 > 0 ? limit / 10 : 1;
+        __atomic_store_n(&o->growth, 0, __ATOMIC_RELAXED);
+    } else if (__atomic_add_fetch(&o->growth, 1, __ATOMIC_RELAXED) >= limit) {
+        __atomic_store_n(&o->growth, 0, __ATOMIC_RELAXED);
+        limit++;
+    }
+    limit = limit < 1 ? 1 : limit > cap ? cap : limit;
+    __atomic_store_n(&o->limit, limit, __ATOMIC_RELAXED);
+}
+
+/*
+ * origin_cancel - end an admitted request abandoned before its outcome was known
+ * an abandoned trial leaves the circuit open, with the next request its trial
+ */
+void origin_cancel(origin_t *o, int trial) {
+    if (o == NULL) {
+        return;
+    }
+    __atomic_fetch_sub(&o->inflight, 1, __ATOMIC_RELAXED);
+    if (trial) {
+        __atomic_store_n(&o->open_until, metrics_now(), __ATOMIC_RELAXED);
+        __atomic_store_n(&o->state, ORIGIN_OPEN, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * find - entry of key within its shard, taking over an empty or idle one if absent
+ * return NULL if the probe window is full of live entries
+ */
+static origin_t *find(origin_table *t, unsigned long key, long now) {
+    unsigned long h = key * 0x9e3779b97f4a7c15UL, k, sparekey = 0;
+    origin_t *shard = t->shards[(h >> 60) & (ORIGIN_SHARDS - 1)], *o, *spare = NULL;
+    int i;
+
+    for (i = 0; i < ORIGIN_PROBE; i++) {
+        o = &shard[((h >> 32) + i) & (ORIGIN_SLOTS - 1)];
+        k = __atomic_load_n(&o->key, __ATOMIC_ACQUIRE);
+        if (k == key) {
+            return o;
+        }
+        if (spare == NULL && (k == 0 || (now - __atomic_load_n(&o->last_used, __ATOMIC_RELAXED) > ORIGIN_IDLE_NS &&
+                                         __atomic_load_n(&o->inflight, __ATOMIC_RELAXED) == 0))) {
+            spare = o;
+            sparekey = k;
+        }
+        if (k == 0) {
+            break;          // keys are never removed, so key is not further along
+        }
+    }
+    if (spare == NULL) {
+        return NULL;
+    }
+
+    // start the new origin closed, at the initial limit, before its key is visible
+    __atomic_store_n(&spare->limit, ORIGIN_INITIAL_LIMIT, __ATOMIC_RELAXED);
+    __atomic_store_n(&spare->growth, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&spare->failures, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&spare->short_ewma, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&spare->long_ewma, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&spare->state, ORIGIN_CLOSED, __ATOMIC_RELAXED);
+    __atomic_store_n(&spare->last_used, now, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&spare->key, &sparekey, key, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return sparekey == key ? spare : NULL;
+    }
+    return spare;
+}
+
+/*
+ * ewma - move *avg towards sample by 1/2^shift, return the new average
+ * the first sample is taken as it is
+ */
+static long ewma(long *avg, long sample, int shift) {
+    long v = __atomic_load_n(avg, __ATOMIC_RELAXED);
+
+    v = v == 0 ? sample : v + (sample - v) / (1 << shift);
+    __atomic_store_n(avg, v, __ATOMIC_RELAXED);
+    return v;
+}
+
+/*
+ * open_circuit - refuse requests to o for breaker_timeout seconds
+ */
+static void open_circuit(origin_t *o, const config_t *conf, long now) {
+    __atomic_store_n(&o->open_until, now + conf->breaker_timeout * 1000000000L, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&o->state, ORIGIN_OPEN, __ATOMIC_RELAXED) != ORIGIN_OPEN) {
+        metrics_add(M_BREAKER_OPENS, 1);
+    }
+    __atomic_store_n(&o->failures, 0, __ATOMIC_RELAXED);
+}
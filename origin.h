@@ -0,0 +1,60 @@
+/*
+ * origin.h - per-origin circuit breaker and concurrency limit
+ *
+ * Every origin server (host:port of the URL, or the server a group picked)
+ * has an entry counting its requests in flight. A request beyond the
+ * origin's limit is refused at once instead of tying up another thread on
+ * a slow origin. The limit is origin_max_inflight, or with
+ * origin_adaptive it adapts AIMD-style below that: it grows by one after a
+ * limit's worth of good requests and shrinks by a tenth on a failure or
+ * when the short-term latency EWMA passes twice the long-term one.
+ *
+ * breaker_failures failures in a row open the origin's circuit: requests
+ * are refused for breaker_timeout seconds, then one trial request is let
+ * through (half-open) and its outcome closes or reopens the circuit.
+ *
+ * Entries live in a sharded open-addressing table like ratelimit.h and are
+ * updated with relaxed atomics; one unused for ORIGIN_IDLE_SECS is reused.
+ */
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include "config.h"
+
+#define ORIGIN_SHARDS 16
+#define ORIGIN_SLOTS 1024
+#define ORIGIN_PROBE 8
+#define ORIGIN_IDLE_SECS 60
+#define ORIGIN_INITIAL_LIMIT 20     // adaptive limit of a new origin
+#define ORIGIN_MAX_LIMIT 1000       // adaptive ceiling without origin_max_inflight
+
+enum origin_state {
+    ORIGIN_CLOSED,
+    ORIGIN_OPEN,
+    ORIGIN_HALF_OPEN
+};
+
+typedef struct origin_table origin_table;
+typedef struct origin origin_t;
+
+/*
+ * helper functions
+ *
+ * origin_create: allocate an empty table
+ * origin_key: key of the origin host:port
+ * origin_enter: admit a request to origin key under the limits of conf
+ *               return 0 with *op set (NULL if the origin is not tracked) to
+ *               pass to origin_leave, 1 likewise if the request is the trial
+ *               of a half-open circuit, or -1 if the request is refused
+ * origin_leave: end an admitted request with its response status (0 if none,
+ *               -1 if the connect failed) and time to first byte in nanoseconds
+ * origin_cancel: end an admitted request abandoned before its outcome was known
+ *                trial: what origin_enter returned, since a trial must be retried
+ */
+origin_table *origin_create(void);
+unsigned long origin_key(const char *host, const char *port);
+int origin_enter(origin_table *t, unsigned long key, const config_t *conf, origin_t **op);
+void origin_leave(origin_t *o, const config_t *conf, int status, long latency);
+void origin_cancel(origin_t *o, int trial);
+
+#endif /* __ORIGIN_H__ */
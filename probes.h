@@ -0,0 +1,47 @@
+/*
+ * probes.h - USDT static probes (provider "proxy")
+ *
+ * With systemtap's <sys/sdt.h> available each probe compiles to a single
+ * nop plus an ELF note; bpftrace, perf or systemtap patch the nop only when
+ * a probe is attached. Without the header (or with -DPROXY_NO_SDT) the
+ * probes compile to nothing. sys/sdt.h is header-only: no runtime library.
+ *
+ * probes and arguments (strings are char *):
+ *
+ * cache__hit(host, port, uri, length)
+ * cache__miss(host, port, uri)
+ * cache__insert(host, port, uri, length, cachesize)
+ * cache__evict(host, port, uri, length, cachesize)
+ * connect__start(host, port)
+ * connect__end(host, port, fd)              fd < 0 on failure
+ * relay__chunk(connfd, clientfd, n, total)  total includes this chunk
+ */
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#if !defined(PROXY_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROXY_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef PROXY_HAVE_SDT
+#define PROBE_CACHE_HIT(host, port, uri, len) DTRACE_PROBE4(proxy, cache__hit, host, port, uri, len)
+#define PROBE_CACHE_MISS(host, port, uri) DTRACE_PROBE3(proxy, cache__miss, host, port, uri)
+#define PROBE_CACHE_INSERT(host, port, uri, len, size) DTRACE_PROBE5(proxy, cache__insert, host, port, uri, len, size)
+#define PROBE_CACHE_EVICT(host, port, uri, len, size) DTRACE_PROBE5(proxy, cache__evict, host, port, uri, len, size)
+#define PROBE_CONNECT_START(host, port) DTRACE_PROBE2(proxy, connect__start, host, port)
+#define PROBE_CONNECT_END(host, port, fd) DTRACE_PROBE3(proxy, connect__end, host, port, fd)
+#define PROBE_RELAY_CHUNK(connfd, clientfd, n, total) DTRACE_PROBE4(proxy, relay__chunk, connfd, clientfd, n, total)
+#else
+#define PROBE_CACHE_HIT(host, port, uri, len)
+#define PROBE_CACHE_MISS(host, port, uri)
+#define PROBE_CACHE_INSERT(host, port, uri, len, size)
+#define PROBE_CACHE_EVICT(host, port, uri, len, size)
+#define PROBE_CONNECT_START(host, port)
+#define PROBE_CONNECT_END(host, port, fd)
+#define PROBE_RELAY_CHUNK(connfd, clientfd, n, total)
+#endif
+
+#endif /* __PROBES_H__ */
@@ -1,322 +1,1334 @@
+#include <poll.h>
+#include <sys/resource.h>
 #include "csapp.h"
+#include "metrics.h"
+#include "admin.h"
+#include "accesslog.h"
+#include "trace.h"
+#include "probes.h"
+#include "cache.h"
+#include "http.h"
+#include "upgrade.h"
+#include "shmcache.h"
+#include "config.h"
+#include "ratelimit.h"
+#include "upstream.h"
+#include "origin.h"
+#include "workq.h"
+#include "h2.h"
 #define SA struct sockaddr
 
-/* recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-
-/* predetermined client response headers */
-static const char *client_res_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\nConnection: close\r\nProxy-Connection: close\r\n\r\n";
-
 /* client response for bad requests */
 static const char *bad_request = "HTTP/1.0 400 Bad Request\r\nContent-Type: plain/text\r\nContent-Length: 0\r\n\r\n";
 
+/* client response for connections over max_connections, requests an origin refuses, and misses
+ * the miss queue has no room for */
+static const char *unavailable = "HTTP/1.0 503 Service Unavailable\r\nContent-Type: plain/text\r\nContent-Length: 0\r\n\r\n";
+
+/* client response for clients and origins over their rate limit */
+static const char *too_many = "HTTP/1.0 429 Too Many Requests\r\nContent-Type: plain/text\r\nContent-Length: 0\r\n\r\n";
+
+/* token buckets per client address and per upstream host */
+static rl_table *clientlimits, *originlimits;
+
+/* circuit breakers and concurrency limits per origin server */
+static origin_table *origins;
+
+/* web object cache, or the cache shared with other proxies (-m) if not NULL */
+static cache_t cache;
+static shmcache_t *shm = NULL;
+
 /*
- * cache item structure (linked list)
- *
- * length: (head) length of list / (other) length of data
- * host: (head) NULL / (other) ptr to host of data
- * port: (head) NULL / (other) ptr to port of data
- * uri: (head) NULL / (other) ptr to uri of data
- * data: (head) NULL / (other) ptr to data
+ * listening descriptor, and set once SIGTERM (or a handoff to a new proxy)
+ * asks main to stop accepting, SIGUSR2 asks it to start a new proxy, or
+ * SIGHUP to reload the configuration file; all wake main through wakefd
+ */
+static int listenfd;
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t upgrading = 0;
+static volatile sig_atomic_t reloading = 0;
+static int wakefd[2];
+
+/* configuration file (-c), NULL for the defaults */
+static char *confpath = NULL;
+
+/*
+ * per-connection state handed from main to the proxy thread
  *
- * cachehead: head of cache list
- * cachesize: total size of all cache data
- */
-typedef struct cacheitem {
-    int length;
-    char *host;
-    char *port;
-    char *uri;
+ * fd: connected descriptor
+ * conf: configuration snapshot the connection is served with
+ * upfd: descriptor of the upstream server, -1 if not connected
+ * prev, next: links in the list of active connections
+ * addr: client address
+ * start: accept timestamp (metrics_now)
+ * log: access log record, filled in while the request is served
+ * trace: stage timestamps, if this request is sampled
+ * rio, line: client read buffer, and the request line (parsed in place)
+ * method, version: parts of the request line
+ * host, port, uri: object requested (malloc'd), set by handle_request for a miss
+ * queued: metrics_now() time a miss was queued for the miss workers
+ */
+typedef struct conn {
+    int fd;
+    config_t *conf;
+    int upfd;
+    struct conn *prev, *next;
+    struct sockaddr_in addr;
+    long start;
+    alog_rec log;
+    trace_rec trace;
+    rio_t rio;
+    char line[MAXLINE];
+    char *method, *version;
+    char *host, *port, *uri;
+    long queued;
+} conn_t;
+
+/* what handle_request leaves to do on a connection */
+enum request_next {
+    REQ_DONE,
+    REQ_MISS,       // forward_request serves the cache miss
+    REQ_H2          // h2_serve takes the connection, which opened with the HTTP/2 preface
+};
+
+/* upstream request, built whole so it goes out in one write and a hedge can send it again */
+typedef struct reqbuf {
     char *data;
-    struct cacheitem *next;
-} cacheitem;
+    int len;
+    int size;
+} reqbuf_t;
+
+/* active connections, so shutdown can wait for them (or cut them off) */
+static conn_t conns = {.prev = &conns, .next = &conns};
+static int nconns = 0;
+static pthread_mutex_t connlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conndone = PTHREAD_COND_INITIALIZER;
+
+/*
+ * with workers, connections main accepts queue for the front workers, and the
+ * cache misses they find queue for the miss workers; workers is 0 when each
+ * connection gets its own thread instead
+ */
+static int workers = 0;
+static workq_t connq, missq;
 
-static cacheitem *cachehead;
-static int cachesize = 0;
+/*
+ * with workers, main holds accepted connections until their request arrives,
+ * so idle clients never tie up a front worker; a client gets HEAD_TIMEOUT
+ * seconds (or client_timeout, if shorter) to send the request head
+ */
+#define MAX_PENDING 1024
+#define HEAD_TIMEOUT 10
+static conn_t *pending[MAX_PENDING];
+static int npending = 0;
 
 /*
  * helper functions
  *
  * proxy: thread routine, work with each client in each thread
- * check_request_line: parse request line and check validity
- * parse_url: parse URL to get host, port, and URI
- * get_cached_item: return cached data if same request exists in cache list
- *                  for LRU eviction policy, move recently used item at the first of cache list
- * delete_last_cache: delete last item in cache list
+ * front: thread routine, read requests and serve cache hits for the connections main queues
+ * miss: thread routine, serve the cache misses front workers queue
+ * start_workers: start the front and miss worker pools sized by conf
+ * dispatch: hand the held connections whose request arrived to the front workers,
+ *           and close those silent past their head timeout
+ * queue_conn: queue a connection for the front workers, or refuse it with 503 if the queue is full
+ * drop_conn: close a connection no thread has served, sending msg first if not NULL
+ * finish_pending: once main stops accepting, keep dispatching held connections for up to
+ *                 secs seconds (each within its head timeout), then close the rest
+ * head_timeout: seconds a client of conf has to send its request head when there are workers
+ * begin_conn: start serving a connection: count it, and stamp its log record
+ * finish_conn: log a served connection, close it, and free it
+ * handle_request: read a request on a connection and serve it from the cache if it can
+ *                 return what is left to do (enum request_next)
+ * forward_request: serve a cache miss from the server, caching the response if it can
+ * h2conn: thread routine, serve an HTTP/2 connection a front worker handed over
+ * serve_h2: serve the streams of an HTTP/2 connection, each as a connection of its own
+ * open_stream: h2_serve callback, serve one stream's request (written to fd) like a new connection
+ * unlink_conn: drop a connection from the list of active ones
+ * handle_sigterm: stop accepting so main returns and exits normally
+ * handle_sigusr2: have main start a new proxy that takes over through the upgrade socket
+ * handle_sighup: have main reload the configuration file
+ * reload: load the configuration file again and publish it, if it is valid
+ * handoff: stop accepting once a new proxy has taken the listening sockets
+ * reexec: start a new proxy from the binary at argv[0] with the same arguments
+ * set_timeout: time out blocking reads on fd after secs seconds (0: never)
+ * set_upstream: record (or with -1, forget) the upstream descriptor of a connection
+ * drain: wait up to secs seconds for active connections to finish
+ *        return the number still active
+ * cut_connections: shut down both sides of every active connection
+ * start_health: start a thread probing the upstream groups of conf, if any has health_check
+ * health: thread routine, probe the groups of a snapshot until it is replaced or the proxy stops
+ * req_append: append n bytes of s to an upstream request
+ * add_headers: add the configured upstream request headers, asking for keep-alive if pooled
+ * hedge: if the upstream has not answered within its group's p95 time to first byte,
+ *        send the request to a second server too and keep whichever answers first
+ * relay: send n bytes of upstream response to the client, keeping a copy for the cache while valid
  */
 void *proxy(void *vargp);
-int check_request_line(char *reqline, char **method, char **uri, char **version);
-void parse_url(char *url, char **host, char **port, char **uri);
-cacheitem *get_cached_item(char *host, char *port, char *uri);
-void delete_last_cache();
+void *front(void *vargp);
+void *miss(void *vargp);
+void start_workers(const config_t *conf);
+void dispatch(struct pollfd *pfd);
+void queue_conn(conn_t *c);
+void drop_conn(conn_t *c, const char *msg);
+void finish_pending(struct pollfd *pfd, int secs);
+int head_timeout(const config_t *conf);
+void begin_conn(conn_t *c);
+void finish_conn(conn_t *c);
+int handle_request(conn_t *c);
+void forward_request(conn_t *c);
+void *h2conn(void *vargp);
+void serve_h2(conn_t *c);
+int open_stream(int fd, void *arg);
+void unlink_conn(conn_t *c);
+void handle_sigterm(int sig);
+void handle_sigusr2(int sig);
+void handle_sighup(int sig);
+void reload(void);
+void handoff(void);
+void reexec(char *argv[]);
+void set_timeout(int fd, int secs);
+void set_upstream(conn_t *c, int fd);
+int drain(int secs);
+void cut_connections(void);
+void start_health(config_t *conf);
+void *health(void *vargp);
+void req_append(reqbuf_t *r, const char *s, int n);
+void add_headers(reqbuf_t *r, const config_t *conf, int keepalive);
+void hedge(conn_t *c, upstream_group *g, reqbuf_t *req, int *server, int *fd, origin_t **origin, int *trial, long *t);
+void relay(conn_t *c, int upfd, char *buf, int n, char *cachebuf, int *len, int *valid);
 
 /*
  * main - concurrent proxy server
  */
 int main(int argc, char *argv[]) {
-    int listenfd, *connfdp;
-    struct sockaddr_in clientaddr;
+    int opt, n, i, drainsecs = -1, fds[UPGRADE_NFDS];
+    long start;
+    char *adminport = NULL, *logpath = NULL, *snapshot = NULL, *upgradepath = NULL, *shmname = NULL, wake[64];
+    char err[MAXLINE];
+    struct pollfd pfd[2 + MAX_PENDING];
+    config_t *conf;
     socklen_t clientlen;
     pthread_t tid;
+    conn_t *c;
 
-    // get listening descriptor
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    // parse options & get listening descriptor
+    while ((opt = getopt(argc, argv, "a:c:d:l:m:s:t:u:")) != -1) {
+        switch (opt) {
+        case 'a':
+            adminport = optarg;
+            break;
+        case 'c':
+            confpath = optarg;
+            break;
+        case 'd':
+            drainsecs = atoi(optarg);
+            break;
+        case 'l':
+            logpath = optarg;
+            break;
+        case 'm':
+            shmname = optarg;
+            break;
+        case 's':
+            snapshot = optarg;
+            break;
+        case 't':
+            trace_init(atoi(optarg));
+            break;
+        case 'u':
+            upgradepath = optarg;
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    if (optind < argc - 1 || optind > argc || (optind == argc && confpath == NULL)) {
+        fprintf(stderr, "usage: %s [-a admin port] [-c config] [-d drain secs] [-l access log] [-m shared cache] [-s cache snapshot] [-t trace 1 in N] [-u upgrade socket] <port>\n", argv[0]);
         exit(0);
     }
-    listenfd = open_listenfd(argv[1]);
 
-    // init cache list
-    cachehead = malloc(sizeof(cacheitem));
-    cachehead->length = 0;
-    cachehead->host = NULL;
-    cachehead->port = NULL;
-    cachehead->uri = NULL;
-    cachehead->data = NULL;
-    cachehead->next = NULL;
+    // read the configuration file; the port on the command line wins
+    if ((conf = config_load(confpath, err, sizeof(err))) == NULL) {
+        fprintf(stderr, "%s\n", err);
+        exit(1);
+    }
+    if (optind == argc && conf->listen[0] == '\0') {
+        fprintf(stderr, "no port given, on the command line or as listen in %s\n", confpath);
+        exit(1);
+    }
+    config_publish(conf);
+    start_health(conf);
+    clientlimits = rl_create();
+    originlimits = rl_create();
+    origins = origin_create();
+    if (conf->workers > 0) {
+        workers = conf->workers;
+        start_workers(conf);
+    }
+
+    // init cache list, or map the cache shared with other proxies; take over
+    // the listening sockets and the cache from a running proxy, if there is
+    // one at the upgrade socket
+    cache_init(&cache, conf->cache_size);
+    if (shmname != NULL && (shm = shmcache_open(shmname, conf->cache_size)) == NULL) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "shared cache %s is in use with another cache size\n", shmname);
+        } else {
+            fprintf(stderr, "cannot open shared cache %s: %s\n", shmname, strerror(errno));
+        }
+        exit(1);
+    }
+    if (upgradepath == NULL || upgrade_receive(upgradepath, fds, &cache) < 0) {
+        fds[UPGRADE_PROXY] = fds[UPGRADE_ADMIN] = -1;
+        if (snapshot != NULL && (n = cache_load(&cache, snapshot)) >= 0) {
+            fprintf(stderr, "loaded %d cached objects from %s\n", n, snapshot);
+        }
+    }
+    listenfd = fds[UPGRADE_PROXY] >= 0 ? fds[UPGRADE_PROXY] : open_listenfd(optind < argc ? argv[optind] : conf->listen);
+
+    // serve metrics on the admin port, if any
+    if (adminport != NULL) {
+        admin_register("/metrics", "text/plain; version=0.0.4", metrics_render);
+        admin_register("/trace", "application/json", trace_render);
+        if (admin_start(adminport, fds[UPGRADE_ADMIN]) < 0) {
+            fprintf(stderr, "admin port unavailable\n");
+            exit(1);
+        }
+    } else if (fds[UPGRADE_ADMIN] >= 0) {
+        close(fds[UPGRADE_ADMIN]);
+    }
+    // write the access log, if any
+    if (logpath != NULL && alog_open(logpath) < 0) {
+        fprintf(stderr, "cannot open access log %s\n", logpath);
+        exit(1);
+    }
+
+    // the listening socket is nonblocking, since it may be shared with the
+    // next proxy: poll for connections or for a wakeup through wakefd
+    if (pipe(wakefd) < 0) {
+        unix_error("pipe error");
+    }
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    fcntl(wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakefd[1], F_SETFL, O_NONBLOCK);
+
+    // on SIGTERM, drain and exit through main, so exit handlers (e.g. profile
+    // dumps) run; writes to connections that were cut off must fail, not kill us
+    Signal(SIGTERM, handle_sigterm);
+    Signal(SIGHUP, handle_sighup);
+    Signal(SIGPIPE, SIG_IGN);
+
+    // hand the listening sockets and the cache to the next proxy when it asks
+    if (upgradepath != NULL) {
+        fds[UPGRADE_PROXY] = listenfd;
+        fds[UPGRADE_ADMIN] = admin_fd();
+        if (upgrade_listen(upgradepath, fds, &cache, handoff) < 0) {
+            fprintf(stderr, "cannot listen on upgrade socket %s\n", upgradepath);
+            exit(1);
+        }
+        Signal(SIGUSR2, handle_sigusr2);
+    }
 
     // accept connection from client
-    clientlen = sizeof(struct sockaddr_in);
-    while (1) {
-        connfdp = malloc(sizeof(int));
-        if ((*connfdp = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
-            fprintf(stderr, "client connection failed\n");
-            free(connfdp);
+    pfd[0].fd = listenfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = wakefd[0];
+    pfd[1].events = POLLIN;
+    while (!stopping) {
+        if (upgrading) {
+            upgrading = 0;
+            reexec(argv);
+        }
+        if (reloading) {
+            reloading = 0;
+            reload();
+        }
+        for (i = 0; i < npending; i++) {
+            pfd[2 + i].fd = pending[i]->fd;
+            pfd[2 + i].events = POLLIN;
+        }
+        if (poll(pfd, 2 + npending, npending > 0 ? 1000 : -1) < 0 || pfd[1].revents) {
+            while (read(wakefd[0], wake, sizeof(wake)) > 0) {
+            }
             continue;
         }
-        // create new thread for each new connection
-        pthread_create(&tid, NULL, proxy, connfdp);
+        if (npending > 0) {
+            dispatch(pfd + 2);
+        }
+        if (!pfd[0].revents) {
+            continue;
+        }
+        c = malloc(sizeof(conn_t));
+        clientlen = sizeof(struct sockaddr_in);
+        if ((c->fd = accept(listenfd, (SA *)&c->addr, &clientlen)) < 0) {
+            // EAGAIN: the other proxy took it during an upgrade
+            if (!stopping && errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr, "client connection failed\n");
+            }
+            free(c);
+            continue;
+        }
+        c->start = metrics_now();
+        c->upfd = -1;
+
+        // refuse clients over their rate and connections over the limit,
+        // before they cost a thread
+        conf = config_current();
+        if (conf->client_rate > 0 &&
+            !rl_allow(clientlimits, c->addr.sin_addr.s_addr, conf->client_rate, conf->client_burst, c->start)) {
+            metrics_add(M_CLIENT_RATE_LIMITED, 1);
+            rio_writen(c->fd, (void *)too_many, strlen(too_many));
+            close(c->fd);
+            free(c);
+            continue;
+        }
+        pthread_mutex_lock(&connlock);
+        if (conf->max_connections > 0 && nconns >= conf->max_connections) {
+            pthread_mutex_unlock(&connlock);
+            metrics_add(M_REJECTED_CONNS, 1);
+            rio_writen(c->fd, (void *)unavailable, strlen(unavailable));
+            close(c->fd);
+            free(c);
+            continue;
+        }
+        c->conf = config_hold(conf);
+        trace_begin(&c->trace);
+        c->prev = conns.prev;
+        c->next = &conns;
+        conns.prev->next = c;
+        conns.prev = c;
+        nconns++;
+        pthread_mutex_unlock(&connlock);
+
+        // hold the connection until its request arrives, or create new thread for it
+        if (workers > 0) {
+            if (npending < MAX_PENDING) {
+                pending[npending++] = c;
+            } else {
+                metrics_add(M_CONN_QUEUE_FULL, 1);
+                drop_conn(c, unavailable);
+            }
+        } else {
+            pthread_create(&tid, NULL, proxy, c);
+        }
     }
 
-    // close listening descriptor & free cache
+    // stop accepting, still serve held connections whose request arrives
+    // in time, then let active connections finish; past the deadline, cut
+    // them off and give their threads a moment to notice
     close(listenfd);
-    cacheitem *curr = cachehead->next;
-    cacheitem *next;
-    while (curr != NULL) {
-        next = curr->next;
-        free(curr->host);
-        free(curr->port);
-        free(curr->uri);
-        free(curr->data);
-        free(curr);
-        curr = next;
-    }
-    free(cachehead);
+    if (drainsecs < 0) {
+        drainsecs = config_current()->drain_timeout;
+    }
+    start = metrics_now();
+    finish_pending(pfd + 2, drainsecs);
+    n = drainsecs - (metrics_now() - start) / 1000000000L;
+    if ((n = drain(n > 0 ? n : 0)) > 0) {
+        fprintf(stderr, "cutting off %d connections still active after %d seconds\n", n, drainsecs);
+        cut_connections();
+        n = drain(1);
+    }
+    if (n > 0) {    // threads may still be serving from the cache
+        fprintf(stderr, "%d connections did not finish, exiting anyway\n", n);
+        return 1;
+    }
+
+    if (snapshot != NULL && shm == NULL && (n = cache_save(&cache, snapshot)) >= 0) {
+        fprintf(stderr, "saved %d cached objects to %s\n", n, snapshot);
+    }
+    cache_free(&cache);
+    if (shm != NULL) {
+        shmcache_close(shm);
+    }
+    alog_close();
+    if (upgradepath != NULL) {
+        upgrade_close(upgradepath);
+    }
 
     return 0;
 }
 
+/*
+ * handle_sigterm - stop accepting so main returns and exits normally
+ * the listening socket may be shared with another proxy, so main is woken
+ * through wakefd instead of by shutting it down
+ */
+void handle_sigterm(int sig) {
+    int olderrno = errno;
+
+    stopping = 1;
+    if (write(wakefd[1], "", 1) < 0) {
+        // pipe full: main is awake already
+    }
+    errno = olderrno;
+}
+
+/*
+ * handle_sigusr2 - have main start a new proxy that takes over through the upgrade socket
+ */
+void handle_sigusr2(int sig) {
+    int olderrno = errno;
+
+    upgrading = 1;
+    if (write(wakefd[1], "", 1) < 0) {
+        // pipe full: main is awake already
+    }
+    errno = olderrno;
+}
+
+/*
+ * handle_sighup - have main reload the configuration file
+ */
+void handle_sighup(int sig) {
+    int olderrno = errno;
+
+    reloading = 1;
+    if (write(wakefd[1], "", 1) < 0) {
+        // pipe full: main is awake already
+    }
+    errno = olderrno;
+}
+
+/*
+ * reload - load the configuration file again and publish it, if it is valid
+ * connections already accepted finish with the snapshot they started with
+ */
+void reload(void) {
+    config_t *conf, *old = config_current();
+    char err[MAXLINE];
+
+    if ((conf = config_load(confpath, err, sizeof(err))) == NULL) {
+        fprintf(stderr, "configuration not reloaded: %s\n", err);
+        return;
+    }
+    if (strcmp(conf->listen, old->listen)) {
+        fprintf(stderr, "listen takes effect on restart\n");
+    }
+    if (conf->workers != old->workers || conf->miss_workers != old->miss_workers ||
+        conf->miss_queue != old->miss_queue) {
+        fprintf(stderr, "workers, miss_workers and miss_queue take effect on restart\n");
+    }
+    if (shm == NULL) {
+        cache_resize(&cache, conf->cache_size);
+    } else if (conf->cache_size != old->cache_size) {
+        fprintf(stderr, "cache_size of a shared cache takes effect on restart\n");
+    }
+    config_publish(conf);
+    start_health(conf);
+    metrics_add(M_CONFIG_RELOADS, 1);
+    fprintf(stderr, "configuration reloaded\n");
+}
+
+/*
+ * handoff - stop accepting once a new proxy has taken the listening sockets
+ * called from the upgrade thread; main then drains and exits as on SIGTERM
+ */
+void handoff(void) {
+    stopping = 1;
+    if (write(wakefd[1], "", 1) < 0) {
+        // pipe full: main is awake already
+    }
+}
+
+/*
+ * reexec - start a new proxy from the binary at argv[0] with the same arguments
+ * the child keeps none of our descriptors: it gets the listening sockets
+ * through the upgrade socket, and must not hold client connections open
+ */
+void reexec(char *argv[]) {
+    struct rlimit rl;
+    pid_t pid;
+    int fd;
+
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if ((pid = fork()) == 0) {
+        for (fd = 3; fd < rl.rlim_cur && fd < 65536; fd++) {
+            close(fd);
+        }
+        execv(argv[0], argv);
+        _exit(1);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "cannot start new proxy: %s\n", strerror(errno));
+    } else {
+        fprintf(stderr, "started new proxy %d from %s\n", (int)pid, argv[0]);
+    }
+}
+
+/*
+ * set_timeout - time out blocking reads on fd after secs seconds (0: never)
+ */
+void set_timeout(int fd, int secs) {
+    struct timeval tv = {secs, 0};
+
+    if (secs > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+}
+
+/*
+ * set_upstream - record (or with -1, forget) the upstream descriptor of a connection
+ * under connlock, so cut_connections never shuts down a descriptor after it is closed
+ */
+void set_upstream(conn_t *c, int fd) {
+    pthread_mutex_lock(&connlock);
+    c->upfd = fd;
+    pthread_mutex_unlock(&connlock);
+}
+
+/*
+ * drain - wait up to secs seconds for active connections to finish
+ */
+int drain(int secs) {
+    struct timespec deadline;
+    int n;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += secs;
+    pthread_mutex_lock(&connlock);
+    if (nconns > 0) {
+        fprintf(stderr, "draining %d connections\n", nconns);
+    }
+    while (nconns > 0 && pthread_cond_timedwait(&conndone, &connlock, &deadline) == 0) {
+        ;
+    }
+    n = nconns;
+    pthread_mutex_unlock(&connlock);
+    return n;
+}
+
+/*
+ * cut_connections - shut down both sides of every active connection
+ * blocked reads and writes fail, and the threads finish their requests
+ */
+void cut_connections(void) {
+    conn_t *c;
+
+    pthread_mutex_lock(&connlock);
+    for (c = conns.next; c != &conns; c = c->next) {
+        shutdown(c->fd, SHUT_RDWR);
+        if (c->upfd >= 0) {
+            shutdown(c->upfd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&connlock);
+}
+
 /*
  * proxy - thread routine, work with each client in each thread
  */
 void *proxy(void *vargp) {
-    int connfd, clientfd, n, len, valid = 1;
-    char buf[MAXLINE], *method, *version, *url, *host, *port, *uri, *cachebuf;
-    rio_t rio;
-    cacheitem *item;
+    conn_t *c = vargp;
+
+    // detach itself for reaping
+    pthread_detach(pthread_self());
+    begin_conn(c);
+    switch (handle_request(c)) {
+    case REQ_MISS:
+        forward_request(c);
+        break;
+    case REQ_H2:
+        serve_h2(c);
+        break;
+    }
+    finish_conn(c);
+    return NULL;
+}
+
+/*
+ * front - thread routine, read requests and serve cache hits for the connections main queues
+ * misses go on to the miss workers, so hits never wait behind a slow origin; an
+ * HTTP/2 connection, which lasts, gets a thread of its own
+ */
+void *front(void *vargp) {
+    pthread_t tid;
+    conn_t *c;
+    int next;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        c = workq_get(&connq);
+        begin_conn(c);
+        if ((next = handle_request(c)) == REQ_DONE) {
+            finish_conn(c);
+            continue;
+        }
+        if (next == REQ_H2) {
+            pthread_create(&tid, NULL, h2conn, c);
+            continue;
+        }
+        c->queued = metrics_now();
+        if (workq_tryput(&missq, c) < 0) {
+            metrics_add(M_MISS_QUEUE_FULL, 1);
+            rio_writen(c->fd, (void *)unavailable, strlen(unavailable));
+            c->log.status = 503;
+            free(c->host);
+            free(c->port);
+            free(c->uri);
+            finish_conn(c);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * miss - thread routine, serve the cache misses front workers queue
+ */
+void *miss(void *vargp) {
+    conn_t *c;
 
-    // detach itself for reaping & save connfd
     pthread_detach(pthread_self());
-    connfd = *(int *)vargp;
-    free(vargp);
+    while (1) {
+        c = workq_get(&missq);
+        metrics_observe(H_MISS_WAIT, metrics_now() - c->queued);
+        forward_request(c);
+        finish_conn(c);
+    }
+    return NULL;
+}
+
+/*
+ * start_workers - start the front and miss worker pools sized by conf
+ * the front queue holds a connection per worker, and room for the streams an
+ * HTTP/2 client may open at once, which are refused rather than waited for
+ */
+void start_workers(const config_t *conf) {
+    pthread_t tid;
+    int i;
+
+    workq_init(&connq, conf->workers + H2_MAX_STREAMS);
+    workq_init(&missq, conf->miss_queue);
+    for (i = 0; i < conf->workers; i++) {
+        pthread_create(&tid, NULL, front, NULL);
+    }
+    for (i = 0; i < conf->miss_workers; i++) {
+        pthread_create(&tid, NULL, miss, NULL);
+    }
+}
+
+/*
+ * dispatch - hand the held connections whose request arrived to the front workers,
+ * and close those silent past their head timeout
+ * pfd[i] is the poll result for pending[i]
+ */
+void dispatch(struct pollfd *pfd) {
+    long now = metrics_now();
+    conn_t *c;
+    int i, n = npending;
+
+    npending = 0;
+    for (i = 0; i < n; i++) {
+        c = pending[i];
+        if (pfd[i].revents) {
+            queue_conn(c);
+        } else if (now - c->start > head_timeout(c->conf) * 1000000000L) {
+            drop_conn(c, NULL);
+        } else {
+            pending[npending++] = c;
+        }
+    }
+}
+
+/*
+ * queue_conn - queue a connection for the front workers, or refuse it with 503 if the queue is full
+ */
+void queue_conn(conn_t *c) {
+    if (workq_tryput(&connq, c) < 0) {
+        metrics_add(M_CONN_QUEUE_FULL, 1);
+        drop_conn(c, unavailable);
+    }
+}
+
+/*
+ * drop_conn - close a connection no thread has served, sending msg first if not NULL
+ */
+void drop_conn(conn_t *c, const char *msg) {
+    if (msg != NULL) {
+        rio_writen(c->fd, (void *)msg, strlen(msg));
+    }
+    unlink_conn(c);
+    close(c->fd);
+    config_put(c->conf);
+    free(c);
+}
+
+/*
+ * finish_pending - once main stops accepting, keep dispatching held connections for up to
+ * secs seconds (each within its head timeout), then close the rest
+ * their clients may have sent a request already, and get to hear an answer
+ */
+void finish_pending(struct pollfd *pfd, int secs) {
+    long deadline = metrics_now() + secs * 1000000000L;
+    int i;
+
+    while (npending > 0 && metrics_now() < deadline) {
+        for (i = 0; i < npending; i++) {
+            pfd[i].fd = pending[i]->fd;
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+        poll(pfd, npending, 100);
+        dispatch(pfd);
+    }
+    while (npending > 0) {
+        drop_conn(pending[--npending], NULL);
+    }
+}
+
+/*
+ * head_timeout - seconds a client of conf has to send its request head when there are workers
+ */
+int head_timeout(const config_t *conf) {
+    if (conf->client_timeout > 0 && conf->client_timeout < HEAD_TIMEOUT) {
+        return conf->client_timeout;
+    }
+    return HEAD_TIMEOUT;
+}
+
+/*
+ * begin_conn - start serving a connection: count it, and stamp its log record
+ */
+void begin_conn(conn_t *c) {
+    struct timespec now;
+
+    memset(&c->log, 0, sizeof(alog_rec));
+    if (alog_enabled()) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        c->log.time_us = now.tv_sec * 1000000L + now.tv_nsec / 1000;
+    }
+    metrics_add(M_REQUESTS, 1);
+    metrics_add(M_ACTIVE_CONNS, 1);
+}
+
+/*
+ * finish_conn - log a served connection, close it, and free it
+ * everything that may touch what main tears down after drain (the access
+ * log, traces, the snapshot) happens before unlink_conn, which may be what
+ * lets drain return; unlink_conn still comes before close for cut_connections
+ */
+void finish_conn(conn_t *c) {
+    trace_finish(&c->trace);
+    metrics_add(M_ACTIVE_CONNS, -1);
+    c->log.total_us = (metrics_now() - c->start) / 1000;
+    metrics_observe(H_TOTAL, c->log.total_us * 1000);
+
+    if (alog_enabled()) {
+        c->log.addr = c->addr.sin_addr;
+        c->log.port = c->addr.sin_port;
+        alog_submit(&c->log);
+    }
+    config_put(c->conf);
+    unlink_conn(c);
+    close(c->fd);
+    free(c);
+}
+
+/*
+ * handle_request - read a request on a connection and serve it from the cache if it can
+ * return what is left to do: REQ_MISS with c->host, c->port and c->uri set for
+ * forward_request, or REQ_H2 if the client speaks HTTP/2
+ * fills in c->log as it goes
+ */
+int handle_request(conn_t *c) {
+    const config_t *conf = c->conf;
+    int connfd = c->fd, len;
+    char *url, *host, *port, *uri, *data;
+    cacheitem *item = NULL;
+    long t;
 
-    // get HTTP request line from client
-    rio_readinitb(&rio, connfd);
-    if (rio_readlineb(&rio, buf, MAXLINE) == 0) {
+    // get HTTP request line from client; a front worker waits no longer
+    // than the head timeout for the rest of it
+    set_timeout(connfd, workers > 0 ? head_timeout(conf) : conf->client_timeout);
+    rio_readinitb(&c->rio, connfd);
+    if (rio_readlineb(&c->rio, c->line, MAXLINE) == 0) {
         fprintf(stderr, "empty request\n");
+        metrics_add(M_BAD_REQUESTS, 1);
         rio_writen(connfd, (void *)bad_request, strlen(bad_request));
-        close(connfd);
-        return NULL;
+        c->log.status = 400;
+        return REQ_DONE;
+    }
+    trace_mark(&c->trace, TS_REQLINE);
+    if (!strcmp(c->line, H2_PREFACE)) {
+        return REQ_H2;
     }
-    if (check_request_line(buf, &method, &url, &version) < 0) {
+    t = metrics_now();
+    if (check_request_line(c->line, &c->method, &url, &c->version) < 0) {
         fprintf(stderr, "invalid HTTP request line\n");
+        metrics_add(M_BAD_REQUESTS, 1);
         rio_writen(connfd, (void *)bad_request, strlen(bad_request));
-        close(connfd);
-        return NULL;
+        c->log.status = 400;
+        return REQ_DONE;
+    }
+    snprintf(c->log.method, ALOG_METHOD_LEN, "%s", c->method);
+    snprintf(c->log.url, ALOG_URL_LEN, "%s", url);
+    if (c->trace.sampled) {
+        snprintf(c->trace.url, TRACE_URL_LEN, "%s", url);
+    }
+
+    // parse URL to get host, port, and URI; a reverse proxy takes any URL
+    // (usually just a path) for its upstream group, whose name stands in for
+    // the host in the cache key
+    if (conf->reverse != NULL && url[0] == '/') {
+        host = port = NULL;
+        uri = strdup(url);
+    } else {
+        parse_url(url, &host, &port, &uri);
+    }
+    if (conf->reverse != NULL) {
+        free(host);
+        free(port);
+        host = strdup(conf->reverse->name);
+        port = strdup("80");
     }
-    // parse URL to get host, port, and URI
-    parse_url(url, &host, &port, &uri);
+    metrics_observe(H_PARSE, metrics_now() - t);
+    trace_mark(&c->trace, TS_PARSED);
 
     // if same request info is in cache list, send data directly to client and close connection
     // same request: host, port, and uri are all same
-    if ((item = get_cached_item(host, port, uri)) != NULL) {
-        rio_writen(connfd, item->data, item->length);
-        close(connfd);
-        return NULL;
+    t = metrics_now();
+    // a shared cache hands out a private copy of the data
+    if (shm != NULL) {
+        data = shmcache_get(shm, host, port, uri, &len);
+    } else if ((item = get_cached_item(&cache, host, port, uri)) != NULL) {
+        data = item->data;
+        len = item->length;
+    } else {
+        data = NULL;
+    }
+    metrics_observe(H_CACHE_LOOKUP, metrics_now() - t);
+    trace_mark(&c->trace, TS_LOOKUP);
+    if (data != NULL) {
+        metrics_add(M_CACHE_HITS, 1);
+        PROBE_CACHE_HIT(host, port, uri, len);
+        rio_writen(connfd, data, len);
+        metrics_add(M_BYTES_TO_CLIENT, len);
+        c->log.cache = ALOG_HIT;
+        c->log.status = response_status(data, len);
+        c->log.bytes = len;
+        if (item != NULL) {
+            put_cached_item(&cache, item);
+        } else {
+            free(data);
+        }
+        free(host);
+        free(port);
+        free(uri);
+        return REQ_DONE;
+    }
+    metrics_add(M_CACHE_MISSES, 1);
+    PROBE_CACHE_MISS(host, port, uri);
+    c->log.cache = ALOG_MISS;
+    c->host = host;
+    c->port = port;
+    c->uri = uri;
+    return REQ_MISS;
+
+}
+
+/*
+ * forward_request - serve a cache miss from the server, caching the response if it can
+ * takes over c->host, c->port and c->uri
+ */
+void forward_request(conn_t *c) {
+    const config_t *conf = c->conf;
+    int connfd = c->fd, clientfd, n, len, valid = 1, server = -1, reused = 0, pooled, keepalive = 0, nobody, hedgeable;
+    char buf[MAXLINE], *method = c->method, *version = c->version, *host = c->host, *port = c->port, *uri = c->uri;
+    char *cachebuf;
+    rio_t rio;
+    upstream_group *group;
+    origin_t *origin = NULL;
+    int trial = 0;
+    reqbuf_t req = {NULL, 0, 0};
+    long t, remaining = -1;
+
+    // misses reach the upstream, so they are what its rate limit counts
+    if (conf->origin_rate > 0 &&
+        !rl_allow(originlimits, rl_key(host), conf->origin_rate, conf->origin_burst, metrics_now())) {
+        metrics_add(M_ORIGIN_RATE_LIMITED, 1);
+        rio_writen(connfd, (void *)too_many, strlen(too_many));
+        c->log.status = 429;
+        free(host);
+        free(port);
+        free(uri);
+        return;
     }
 
-    // connect to server and forward request line from client
-    if ((clientfd = open_clientfd(host, port)) < 0) {
+    // connect to server (one of its group's, if the host names a group) and
+    // forward request line from client; the origin's breaker and concurrency
+    // limit may refuse the request first, before it ties up the thread
+    group = conf->reverse != NULL ? conf->reverse : upstream_find(conf->groups, conf->ngroups, host);
+    t = metrics_now();
+    PROBE_CONNECT_START(host, port);
+    if (group != NULL) {
+        // a server that refuses gets reported, and the request one more try elsewhere
+        for (n = 0; n < (group->nservers > 1 ? 2 : 1); n++) {
+            server = upstream_pick(group, host, port, uri);
+            if ((trial = origin_enter(origins, origin_key(group->servers[server].host, group->servers[server].port),
+                                      conf, &origin)) < 0) {
+                clientfd = -2;
+                break;
+            }
+            if ((clientfd = upstream_connect(group, server, &reused)) >= 0) {
+                break;
+            }
+            upstream_report(group, server, -1, 0);
+            origin_leave(origin, conf, -1, 0);
+        }
+    } else if ((trial = origin_enter(origins, origin_key(host, port), conf, &origin)) < 0) {
+        clientfd = -2;
+    } else if ((clientfd = open_clientfd(host, port)) < 0) {
+        origin_leave(origin, conf, -1, 0);
+    }
+    PROBE_CONNECT_END(host, port, clientfd);
+    set_upstream(c, clientfd);
+    metrics_observe(H_UPSTREAM_CONNECT, metrics_now() - t);
+    trace_mark(&c->trace, TS_CONNECTED);
+    if (clientfd == -2) {
+        rio_writen(connfd, (void *)unavailable, strlen(unavailable));
+        c->log.status = 503;
+        free(host);
+        free(port);
+        free(uri);
+        return;
+    }
+    if (clientfd < 0) {
         fprintf(stderr, "server connection failed\n");
+        metrics_add(M_UPSTREAM_ERRORS, 1);
         rio_writen(connfd, (void *)bad_request, strlen(bad_request));
+        c->log.status = 400;
         free(host);
         free(port);
         free(uri);
-        return NULL;
+        return;
+    }
+    set_timeout(clientfd, conf->upstream_timeout);
+    if (reused) {
+        metrics_add(M_UPSTREAM_REUSED, 1);
     }
-    // put URI instead of URL as 2nd argument
-    sprintf(buf, "%s %s %s\r\n", method, uri, version);
-    rio_writen(clientfd, buf, strlen(buf));
+
+    // put URI instead of URL as 2nd argument; a pooled connection asks for
+    // keep-alive over HTTP/1.0, whose responses are never chunked, so
+    // Content-Length tells where each one ends
+    pooled = group != NULL && group->keepalive > 0;
+    nobody = !strcmp(method, "HEAD");
+    hedgeable = group != NULL && group->hedge > 0 && group->nservers > 1 && (nobody || !strcmp(method, "GET"));
+    n = sprintf(buf, "%s %s %s\r\n", method, uri, pooled ? "HTTP/1.0" : version);
+    req_append(&req, buf, n);
 
     // forward request headers from client to server
-    while (rio_readlineb(&rio, buf, MAXLINE) != 0) {
+    while (rio_readlineb(&c->rio, buf, MAXLINE) != 0) {
         if (!strcmp(buf, "\r\n")) { break; }    // end of HTTP header
 
-        // ignore 3 headers from client (User-Agent, Connection, Proxy-Connection)
-        // replace them to predetermined values
-        if (strncmp(buf, "User-Agent", 10) && strncmp(buf, "Connection", 10) && strncmp(buf, "Proxy-Connection", 16)) {
-            rio_writen(clientfd, buf, strlen(buf));
+        // drop the headers the configuration strips (by default User-Agent,
+        // Connection, Proxy-Connection) and send its own in their place
+        if (!config_strips(conf, buf)) {
+            req_append(&req, buf, strlen(buf));
         }
     }
-    rio_writen(clientfd, (void *)client_res_hdr, strlen(client_res_hdr));
+    add_headers(&req, conf, pooled);
+    rio_writen(clientfd, req.data, req.len);
+    trace_mark(&c->trace, TS_HEADERS);
+    if (hedgeable) {
+        hedge(c, group, &req, &server, &clientfd, &origin, &trial, &t);
+    }
+    free(req.data);
 
     // init cache buffer for this connection
-    cachebuf = malloc(MAX_OBJECT_SIZE);
+    cachebuf = malloc(conf->max_object_size);
     len = 0;
 
-    // forward response from server to client
+    // forward response from server to client; from a pooled connection, read
+    // the head a line at a time to learn where the body ends
     rio_readinitb(&rio, clientfd);
-    while ((n = rio_readnb(&rio, buf, MAXLINE)) != 0) {
-        if (valid && (len + n < MAX_OBJECT_SIZE)) {  // valid (size not exceeded)
-            memcpy(cachebuf + len, buf, n);
-            len += n;
-        } else if (valid) {     // size too big -> don't save in cache list
-            valid = 0;
+    while (pooled && (n = rio_readlineb(&rio, buf, MAXLINE)) > 0) {
+        relay(c, clientfd, buf, n, cachebuf, &len, &valid);
+        response_framing(buf, &remaining, &keepalive);
+        if (!strcmp(buf, "\r\n")) {
+            if (nobody || c->log.status / 100 == 1 || c->log.status == 204 || c->log.status == 304) {
+                remaining = 0;
+            }
+            break;
         }
-        rio_writen(connfd, buf, n);
     }
-
-    // if valid, insert data at the first of cache list
-    if (valid) {
-        // if cache is full, delete last item
-        while (cachesize + len > MAX_CACHE_SIZE) {
-            delete_last_cache();
+    if (pooled && remaining < 0) {
+        keepalive = 0;      // the body runs to the end of the connection
+    }
+    while (remaining != 0 &&
+           (n = rio_readnb(&rio, buf, remaining > 0 && remaining < MAXLINE ? remaining : MAXLINE)) > 0) {
+        relay(c, clientfd, buf, n, cachebuf, &len, &valid);
+        if (remaining > 0) {
+            remaining -= n;
         }
+    }
+    set_upstream(c, -1);
+    t = c->log.bytes > 0 ? c->start + c->log.ttfb_us * 1000 - t : 0;     // upstream time to first byte
+    origin_leave(origin, conf, c->log.status, t);
+    if (group != NULL) {
+        upstream_report(group, server, c->log.status, t);
+        upstream_done(group, server, clientfd, pooled && keepalive && remaining == 0);
+    } else {
+        close(clientfd);
+    }
+    trace_mark(&c->trace, TS_RELAYED);
 
-        cacheitem *ci = malloc(sizeof(cacheitem));
-        ci->data = malloc(len);
-        memcpy(ci->data, cachebuf, len);
-        ci->length = len;
-        ci->host = host;
-        ci->port = port;
-        ci->uri = uri;
-
-        ci->next = cachehead->next;
-        cachehead->next = ci;
-        (cachehead->length)++;
-        cachesize += len;
-
+    // if valid, insert data at the first of cache list
+    if (valid && shm != NULL) {
+        shmcache_insert(shm, host, port, uri, cachebuf, len);
+        trace_mark(&c->trace, TS_INSERTED);
+        free(host);
+        free(port);
+        free(uri);
+    } else if (valid) {
+        insert_cache(&cache, host, port, uri, cachebuf, len);
+        trace_mark(&c->trace, TS_INSERTED);
     } else {
         free(host);
         free(port);
         free(uri);
     }
 
-    // close listening descriptor & free cache buffer
-    close(connfd);
+    // free cache buffer
     free(cachebuf);
+}
+
+/*
+ * h2conn - thread routine, serve an HTTP/2 connection a front worker handed over
+ */
+void *h2conn(void *vargp) {
+    conn_t *c = vargp;
+
+    pthread_detach(pthread_self());
+    serve_h2(c);
+    finish_conn(c);
     return NULL;
 }
 
 /*
- * check_request_line - parse request line and check validity
- * return 0 if valid, -1 if invalid
+ * serve_h2 - serve the streams of an HTTP/2 connection, each as a connection of its own
+ * the connection itself is logged as "PRI *", for as long as it was open
+ */
+void serve_h2(conn_t *c) {
+    snprintf(c->log.method, ALOG_METHOD_LEN, "PRI");
+    snprintf(c->log.url, ALOG_URL_LEN, "*");
+    h2_serve(c->fd, &c->rio, c->conf->client_timeout, &stopping, open_stream, c);
+}
+
+/*
+ * open_stream - h2_serve callback, serve one stream's request (written to fd) like a new connection
+ * the stream is checked, registered and dispatched as main does an accepted
+ * connection, with the client's address and configuration snapshot: it takes
+ * a token from the client's bucket and counts toward max_connections, and
+ * with workers it goes through the pools (a full queue refuses it rather than
+ * stall the other streams); without, it gets a thread like any connection
  */
-int check_request_line(char *reqline, char **method, char **url, char **version) {
-    if (strchr(reqline, ' ') == NULL) {     // only 1 arg
+int open_stream(int fd, void *arg) {
+    conn_t *parent = arg, *c;
+    config_t *conf = parent->conf;
+    pthread_t tid;
+
+    if (conf->client_rate > 0 &&
+        !rl_allow(clientlimits, parent->addr.sin_addr.s_addr, conf->client_rate, conf->client_burst, metrics_now())) {
+        metrics_add(M_CLIENT_RATE_LIMITED, 1);
         return -1;
     }
-    *method = strtok(reqline, " ");
-    *url = strtok(NULL, " ");
-    if ((*version = strtok(NULL, "\r\n")) == NULL) {    // only 2 args
+    pthread_mutex_lock(&connlock);
+    if (conf->max_connections > 0 && nconns >= conf->max_connections) {
+        pthread_mutex_unlock(&connlock);
+        metrics_add(M_REJECTED_CONNS, 1);
         return -1;
     }
-    if (strcmp(*version, "HTTP/1.1") && strcmp(*version, "HTTP/1.0")) { // unsupported HTTP version
+    c = malloc(sizeof(conn_t));
+    c->fd = fd;
+    c->addr = parent->addr;
+    c->start = metrics_now();
+    c->upfd = -1;
+    c->conf = config_hold(conf);
+    trace_begin(&c->trace);
+    c->prev = conns.prev;
+    c->next = &conns;
+    conns.prev->next = c;
+    conns.prev = c;
+    nconns++;
+    pthread_mutex_unlock(&connlock);
+
+    if (workers == 0) {
+        pthread_create(&tid, NULL, proxy, c);
+    } else if (workq_tryput(&connq, c) < 0) {
+        unlink_conn(c);
+        config_put(c->conf);
+        free(c);
         return -1;
     }
     return 0;
 }
 
 /*
- * parse_url - parse URL to get host, port, and URI
+ * unlink_conn - drop a connection from the list of active ones
  */
-void parse_url(char *url, char **host, char **port, char **uri) {
-    // url = http://<host>:<port><uri>
-    char *hp, *pu;
-
-    if (!strncmp(url, "http://", 7)) {
-        url += 7;
+void unlink_conn(conn_t *c) {
+    pthread_mutex_lock(&connlock);
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    if (--nconns == 0) {
+        pthread_cond_broadcast(&conndone);
     }
-    hp = strchr(url, ':');
-    pu = strchr(url, '/');
+    pthread_mutex_unlock(&connlock);
+}
 
-    if (hp == NULL) {
-        strtok(url, "/");
-        *host = malloc((strlen(url) + 1));
-        strcpy(*host, url);
-        *port = malloc(4);
-        strcpy(*port, "80");
-    } else {
-        strtok(url, ":");
-        *host = malloc((strlen(url) + 1));
-        strcpy(*host, url);
-        url = strtok(NULL, "/");
-        *port = malloc(sizeof(url));
-        strcpy(*port, url);
-    }
-    if (pu == NULL || (url = strtok(NULL, "")) == NULL) {
-        *uri = malloc(2);
-        strcpy(*uri, "/");
-    } else {
-        *uri = malloc((strlen(url) + 2));
-        strcpy(*uri, "/");
-        strcat(*uri, url);
+/*
+ * start_health - start a thread probing the upstream groups of conf, if any has health_check
+ */
+void start_health(config_t *conf) {
+    pthread_t tid;
+    int i;
+
+    for (i = 0; i < conf->ngroups; i++) {
+        if (conf->groups[i].check_path[0]) {
+            pthread_create(&tid, NULL, health, config_hold(conf));
+            return;
+        }
     }
 }
 
 /*
- * get_cached_item - return cached data if same request exists in cache list
- *                   for LRU eviction policy, move recently used item at the first of cache list
+ * health - thread routine, probe the groups of a snapshot until it is replaced or the proxy stops
+ * it holds a reference, so the snapshot outlives it; the next snapshot gets its own thread
  */
-cacheitem *get_cached_item(char *host, char *port, char *uri) {
-    cacheitem *prev, *curr;
+void *health(void *vargp) {
+    config_t *conf = vargp;
+    upstream_group *g;
+    long now, *due = calloc(conf->ngroups, sizeof(long));
+    int i;
 
-    prev = cachehead;
-    curr = cachehead->next;
-    while (curr != NULL) {
-        if (!strcmp(host, curr->host) && !strcmp(port, curr->port) && !strcmp(uri, curr->uri)) {
-            prev->next = curr->next;
-            curr->next = cachehead->next;
-            cachehead->next = curr;
-            return curr;
+    pthread_detach(pthread_self());
+    while (!stopping && config_current() == conf) {
+        now = metrics_now();
+        for (i = 0; i < conf->ngroups; i++) {
+            g = &conf->groups[i];
+            if (g->check_path[0] && now >= due[i]) {
+                upstream_probe(g, g->check_interval);
+                due[i] = now + g->check_interval * 1000000000L;
+            }
         }
-        prev = curr;
-        curr = curr->next;
+        sleep(1);
     }
+    free(due);
+    config_put(conf);
     return NULL;
 }
 
 /*
- * delete_last_cache - delete last item in cache list
+ * req_append - append n bytes of s to an upstream request
+ */
+void req_append(reqbuf_t *r, const char *s, int n) {
+    if (r->len + n > r->size) {
+        r->size = r->len + n > 2 * r->size ? r->len + n : 2 * r->size;
+        r->data = realloc(r->data, r->size);
+    }
+    memcpy(r->data + r->len, s, n);
+    r->len += n;
+}
+
+/*
+ * add_headers - add the configured upstream request headers, asking for keep-alive if pooled
+ * a pooled request drops the configured Connection and Proxy-Connection lines for its own
  */
-void delete_last_cache() {
-    cacheitem *prev, *last;
+void add_headers(reqbuf_t *r, const config_t *conf, int keepalive) {
+    char *line, *end;
 
-    prev = cachehead;
-    last = cachehead->next;
-    while (last->next != NULL) {
-        prev = last;
-        last = last->next;
+    if (!keepalive) {
+        req_append(r, conf->headers, conf->headers_len);
+        return;
     }
+    for (line = conf->headers; (end = strstr(line, "\r\n")) != NULL && end != line; line = end + 2) {
+        if (strncasecmp(line, "Connection:", 11) && strncasecmp(line, "Proxy-Connection:", 17)) {
+            req_append(r, line, end + 2 - line);
+        }
+    }
+    req_append(r, "Connection: keep-alive\r\n\r\n", 26);
+}
 
-    prev->next = NULL;
-    cachesize -= last->length;
+/*
+ * hedge - if the upstream has not answered within its group's p95 time to first byte,
+ * send the request to a second server too and keep whichever answers first
+ * the loser is cancelled; *server, *fd, *origin, *trial and *t (when the
+ * request went out) then describe the winner
+ */
+void hedge(conn_t *c, upstream_group *g, reqbuf_t *req, int *server, int *fd, origin_t **origin, int *trial, long *t) {
+    long after = __atomic_load_n(&g->hedge_after, __ATOMIC_RELAXED), start, waited, tail;
+    struct pollfd pfd[2] = {{*fd, POLLIN, 0}, {-1, POLLIN, 0}};
+    int other, ofd, reused, timeout = c->conf->upstream_timeout;
+    origin_t *o;
+    int otrial;
 
-    free(last->host);
-    free(last->port);
-    free(last->uri);
-    free(last->data);
-    free(last);
-    (cachehead->length)--;
+    // still silent after the p95 (rounded up to whole milliseconds)?
+    if (after == 0 || poll(pfd, 1, (after + 999999) / 1000000) != 0) {
+        return;
+    }
+    if ((other = upstream_pick_other(g, *server)) < 0 || !upstream_hedge(g)) {
+        return;
+    }
+    if ((otrial = origin_enter(origins, origin_key(g->servers[other].host, g->servers[other].port), c->conf, &o)) < 0) {
+        return;
+    }
+    start = metrics_now();
+    if ((ofd = upstream_connect(g, other, &reused)) < 0) {
+        upstream_report(g, other, -1, 0);
+        origin_leave(o, c->conf, -1, 0);
+        return;
+    }
+    set_timeout(ofd, timeout);
+    metrics_add(M_HEDGES, 1);
+    if (rio_writen(ofd, req->data, req->len) < 0) {
+        upstream_done(g, other, ofd, 0);
+        origin_cancel(o, otrial);
+        return;
+    }
+
+    // the original wins ties, and a hedge that is no faster is dropped
+    pfd[1].fd = ofd;
+    if (poll(pfd, 2, timeout > 0 ? timeout * 1000 : -1) <= 0 || pfd[0].revents || !pfd[1].revents) {
+        upstream_done(g, other, ofd, 0);
+        origin_cancel(o, otrial);
+        return;
+    }
+
+    // the original would have answered no sooner than now, and as a
+    // straggler probably around the group's p99: count the difference saved
+    metrics_add(M_HEDGE_WINS, 1);
+    waited = metrics_now() - *t;
+    tail = __atomic_load_n(&g->tail, __ATOMIC_RELAXED);
+    metrics_observe(H_HEDGE_SAVED, tail > waited ? tail - waited : 0);
+    upstream_done(g, *server, *fd, 0);
+    origin_cancel(*origin, *trial);
+    set_upstream(c, ofd);
+    *server = other;
+    *fd = ofd;
+    *origin = o;
+    *trial = otrial;
+    *t = start;
+}
+
+/*
+ * relay - send n bytes of upstream response to the client, keeping a copy for the cache while valid
+ */
+void relay(conn_t *c, int upfd, char *buf, int n, char *cachebuf, int *len, int *valid) {
+    if (c->log.bytes == 0) {
+        trace_mark(&c->trace, TS_FIRST_BYTE);
+        c->log.ttfb_us = (metrics_now() - c->start) / 1000;
+        c->log.status = response_status(buf, n);
+        metrics_observe(H_TTFB, c->log.ttfb_us * 1000);
+    }
+    if (*valid && (*len + n < c->conf->max_object_size)) {  // valid (size not exceeded)
+        memcpy(cachebuf + *len, buf, n);
+        *len += n;
+    } else if (*valid) {    // size too big -> don't save in cache list
+        *valid = 0;
+    }
+    rio_writen(c->fd, buf, n);
+    c->log.bytes += n;
+    PROBE_RELAY_CHUNK(c->fd, upfd, n, c->log.bytes);
+    metrics_add(M_BYTES_FROM_UPSTREAM, n);
+    metrics_add(M_BYTES_TO_CLIENT, n);
 }
@@ -0,0 +1,130 @@
+/*
+ * ratelimit.c - lock-free token buckets keyed by client address or origin
+ *
+ * A bucket allowing rate requests per second with a burst of b is the GCRA
+ * (generic cell rate algorithm): with T = 1/rate, the bucket stores the
+ * theoretical arrival time tat of the next conforming request. A request at
+ * time now conforms if tat - now <= (b - 1) * T, and then moves tat to
+ * max(tat, now) + T. That is exactly a token bucket of b tokens refilled
+ * every T, held in one word, so a request costs a probe of the shard and
+ * one compare-and-swap.
+ *
+ * Slots are never deleted: a bucket whose tat is more than RL_IDLE_SECS in
+ * the past is full and idle, and a new key may take its slot over. Two
+ * threads inserting the same key at once can end up with two buckets for
+ * it; each still limits the key, so it is let through a little more until
+ * one of them goes idle.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "ratelimit.h"
+
+#define RL_IDLE_NS (RL_IDLE_SECS * 1000000000L)
+
+typedef struct rl_slot {
+    unsigned long key;      // 0: never used
+    long tat;               // theoretical arrival time in ns (metrics_now)
+} rl_slot;
+
+struct rl_table {
+    rl_slot shards[RL_SHARDS][RL_SLOTS];
+};
+
+/*
+ * helper functions
+ *
+ * mix: spread the bits of a key over the whole word
+ * find: slot of key within its shard, taking over an empty or idle one if absent
+ */
+static unsigned long mix(unsigned long x);
+static rl_slot *find(rl_table *t, unsigned long key, long now);
+
+/*
+ * rl_create - allocate an empty table
+ */
+rl_table *rl_create(void) {
+    rl_table *t;
+
+    if (posix_memalign((void **)&t, 64, sizeof(rl_table)) != 0) {
+        return NULL;
+    }
+    memset(t, 0, sizeof(rl_table));
+    return t;
+}
+
+/*
+ * rl_key - key of a string (FNV-1a), never 0
+ */
+unsigned long rl_key(const char *s) {
+    unsigned long h = 14695981039346656037UL;
+
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 1099511628211UL;
+    }
+    return h ? h : 1;
+}
+
+/*
+ * rl_allow - take a token from the bucket for key
+ * return 1 if the request may proceed, 0 if it is over the limit
+ */
+int rl_allow(rl_table *t, unsigned long key, int rate, int burst, long now) {
+    long interval = 1000000000L / rate, tolerance, tat, next;
+    rl_slot *s;
+
+    if ((s = find(t, key ? key : 1, now)) == NULL) {
+        return 1;
+    }
+    tolerance = (burst > 1 ? burst - 1 : 0) * interval;
+    tat = __atomic_load_n(&s->tat, __ATOMIC_RELAXED);
+    do {
+        if (tat - now > tolerance) {
+            return 0;
+        }
+        next = (tat > now ? tat : now) + interval;
+    } while (!__atomic_compare_exchange_n(&s->tat, &tat, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ * mix - spread the bits of a key over the whole word (splitmix64 finalizer)
+ */
+static unsigned long mix(unsigned long x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * find - slot of key within its shard, taking over an empty or idle one if absent
+ * return NULL if the probe window is full of live buckets
+ */
+static rl_slot *find(rl_table *t, unsigned long key, long now) {
+    unsigned long h = mix(key), k, sparekey = 0;
+    rl_slot *shard = t->shards[h >> 60 & (RL_SHARDS - 1)], *s, *spare = NULL;
+    int i;
+
+    for (i = 0; i < RL_PROBE; i++) {
+        s = &shard[(h + i) & (RL_SLOTS - 1)];
+        k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+        if (k == key) {
+            return s;
+        }
+        if (spare == NULL && (k == 0 || now - __atomic_load_n(&s->tat, __ATOMIC_RELAXED) > RL_IDLE_NS)) {
+            spare = s;
+            sparekey = k;
+        }
+        if (k == 0) {
+            break;          // keys are never removed, so key is not further along
+        }
+    }
+    if (spare == NULL) {
+        return NULL;
+    }
+
+    // an idle tat is already in the past, so the new key starts with a full bucket
+    if (!__atomic_compare_exchange_n(&spare->key, &sparekey, key, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return sparekey == key ? spare : NULL;
+    }
+    return spare;
+}
@@ -0,0 +1,34 @@
+/*
+ * ratelimit.h - lock-free token buckets keyed by client address or origin
+ *
+ * Each bucket is one 64-bit word in a sharded open-addressing hash table.
+ * The token bucket is kept in its GCRA form: the word holds the theoretical
+ * arrival time of the next request, so taking a token is a single
+ * compare-and-swap. A bucket that has been full for RL_IDLE_SECS is idle,
+ * and its slot is reused by the next key that hashes near it.
+ */
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#define RL_SHARDS 16           // shards (power of 2), chosen by the key's high bits
+#define RL_SLOTS 4096          // slots per shard (power of 2)
+#define RL_PROBE 8             // slots searched for a key
+#define RL_IDLE_SECS 60        // how long a full bucket is kept
+
+typedef struct rl_table rl_table;
+
+/*
+ * helper functions
+ *
+ * rl_create: allocate an empty table
+ * rl_key: key of a string (e.g. an origin "host:port"), never 0
+ * rl_allow: take a token from the bucket for key, refilled at rate per second
+ *           up to burst tokens; now is metrics_now()
+ *           return 1 if the request may proceed, 0 if it is over the limit
+ *           (a request whose key finds no free slot is let through)
+ */
+rl_table *rl_create(void);
+unsigned long rl_key(const char *s);
+int rl_allow(rl_table *t, unsigned long key, int rate, int burst, long now);
+
+#endif /* __RATELIMIT_H__ */
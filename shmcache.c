@@ -0,0 +1,414 @@
+/*
+ * shmcache.c - web object cache shared by proxy processes on one machine
+ *
+ * Segment layout: the shmcache header, then nslots entries, then the
+ * next-block index of every block, then the blocks themselves. Entries
+ * and blocks that are not in use are kept on free lists; NIL ends a list.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metrics.h"
+#include "shmcache.h"
+
+#define SHMCACHE_MAGIC 0x50434831   // "PCH1", bumped when the layout changes
+#define NIL (-1)
+
+/*
+ * cache entry (one per object, or free)
+ *
+ * hnext: next entry in the hash chain, or in the free list
+ * prev, next: neighbours in the LRU list, most recently used first
+ * block: first block of the data
+ * length: length of the data
+ * hash: hash of key
+ * key: "host:port/uri"
+ */
+typedef struct shm_entry {
+    int hnext;
+    int prev, next;
+    int block;
+    int length;
+    unsigned hash;
+    char key[SHMCACHE_KEY];
+} shm_entry;
+
+/*
+ * segment header
+ *
+ * magic: SHMCACHE_MAGIC once the segment is initialized
+ * size: bytes in the segment
+ * nslots, nblocks: entries and blocks in the segment (nslots == nblocks)
+ * entoff, nextoff, dataoff: offsets of the entry, next-block and block arrays
+ * lock: robust process-shared mutex, protects everything below
+ * head, tail: LRU list
+ * freeentry, freeblock, nfree: free lists, and number of free blocks
+ * bytes, objects: cached data bytes and objects
+ * resets: times the cache was emptied after a process died holding lock
+ * buckets: heads of the hash chains
+ */
+struct shmcache {
+    unsigned magic;
+    long size;
+    int nslots, nblocks;
+    long entoff, nextoff, dataoff;
+    pthread_mutex_t lock;
+    int head, tail;
+    int freeentry, freeblock, nfree;
+    long bytes, objects;
+    long resets;
+    int buckets[SHMCACHE_BUCKETS];
+};
+
+#define ENTRIES(sc) ((shm_entry *)((char *)(sc) + (sc)->entoff))
+#define NEXTBLOCK(sc) ((int *)((char *)(sc) + (sc)->nextoff))
+#define BLOCK(sc, b) ((char *)(sc) + (sc)->dataoff + (long)(b) * SHMCACHE_BLOCK)
+
+/*
+ * helper functions
+ *
+ * segment_size: bytes needed for nblocks blocks
+ * segment_init: lay out and empty a new segment
+ * reset: empty the cache, putting every entry and block on the free lists
+ * lock: lock the segment, emptying it if the previous owner died holding it
+ * make_key: build the key of a request, -1 if it is too long
+ * hash: FNV-1a hash of a key
+ * find: entry for key, or NIL
+ * lru_unlink: take entry e out of the LRU list
+ * lru_push: put entry e at the front of the LRU list
+ * evict: remove the least recently used object
+ * publish: update the cache gauges from the segment
+ */
+static long segment_size(int nblocks);
+static void segment_init(shmcache_t *sc, int nblocks);
+static void reset(shmcache_t *sc);
+static void lock(shmcache_t *sc);
+static int make_key(char *key, char *host, char *port, char *uri);
+static unsigned hash(const char *key);
+static int find(shmcache_t *sc, const char *key, unsigned h);
+static void lru_unlink(shmcache_t *sc, int e);
+static void lru_push(shmcache_t *sc, int e);
+static void evict(shmcache_t *sc);
+static void publish(shmcache_t *sc);
+
+/*
+ * shmcache_open - map (creating it if needed) the segment called name
+ * openers serialize on flock, so exactly one of them initializes the segment,
+ * and a creator that dies before finishing leaves no magic behind; a segment
+ * with magic may be in use, so it is never resized or initialized again
+ */
+shmcache_t *shmcache_open(const char *name, int capacity) {
+    int fd, nblocks = capacity / SHMCACHE_BLOCK, live;
+    long size = segment_size(nblocks);
+    struct stat st;
+    shmcache_t *sc;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0) {
+        return NULL;
+    }
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size != size) {
+        // a live segment of another capacity belongs to other proxies
+        if (st.st_size >= (long)sizeof(shmcache_t) &&
+            (sc = mmap(NULL, sizeof(shmcache_t), PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+            live = sc->magic == SHMCACHE_MAGIC;
+            munmap(sc, sizeof(shmcache_t));
+            if (live) {
+                close(fd);
+                errno = EINVAL;
+                return NULL;
+            }
+        }
+        if (ftruncate(fd, size) < 0) {
+            close(fd);
+            return NULL;
+        }
+    }
+    if ((sc = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (sc->magic != SHMCACHE_MAGIC) {
+        segment_init(sc, nblocks);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    lock(sc);
+    publish(sc);
+    pthread_mutex_unlock(&sc->lock);
+    return sc;
+}
+
+/*
+ * shmcache_get - return a private copy of the data cached for host, port and uri
+ * the copy is made under the lock: no reference into the segment survives
+ * a crash, so a dead process can never pin an object
+ */
+char *shmcache_get(shmcache_t *sc, char *host, char *port, char *uri, int *len) {
+    char key[SHMCACHE_KEY], *data, *p;
+    int e, b, n;
+    shm_entry *ent;
+
+    if (make_key(key, host, port, uri) < 0) {
+        return NULL;
+    }
+    lock(sc);
+    if ((e = find(sc, key, hash(key))) == NIL) {
+        pthread_mutex_unlock(&sc->lock);
+        return NULL;
+    }
+    ent = &ENTRIES(sc)[e];
+    lru_unlink(sc, e);
+    lru_push(sc, e);
+    publish(sc);    // other processes may have changed the totals
+
+    *len = ent->length;
+    p = data = malloc(ent->length);
+    for (b = ent->block, n = ent->length; n > 0; b = NEXTBLOCK(sc)[b]) {
+        memcpy(p, BLOCK(sc, b), n < SHMCACHE_BLOCK ? n : SHMCACHE_BLOCK);
+        p += SHMCACHE_BLOCK;
+        n -= SHMCACHE_BLOCK;
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return data;
+}
+
+/*
+ * shmcache_insert - cache a copy of data, evicting least recently used objects as needed
+ */
+void shmcache_insert(shmcache_t *sc, char *host, char *port, char *uri, char *data, int len) {
+    int e, b, i, n, nb = (len + SHMCACHE_BLOCK - 1) / SHMCACHE_BLOCK;
+    char key[SHMCACHE_KEY];
+    unsigned h;
+    shm_entry *ent;
+
+    if (len <= 0 || nb > sc->nblocks || make_key(key, host, port, uri) < 0) {
+        return;
+    }
+    h = hash(key);
+    lock(sc);
+    if (find(sc, key, h) != NIL) {  // another process cached it meanwhile
+        pthread_mutex_unlock(&sc->lock);
+        return;
+    }
+    while (sc->nfree < nb || sc->freeentry == NIL) {
+        evict(sc);
+    }
+
+    e = sc->freeentry;
+    ent = &ENTRIES(sc)[e];
+    sc->freeentry = ent->hnext;
+    strcpy(ent->key, key);
+    ent->hash = h;
+    ent->length = len;
+
+    // take nb blocks off the free list, copying the data in
+    ent->block = b = sc->freeblock;
+    for (i = 0, n = len; i < nb; i++, n -= SHMCACHE_BLOCK) {
+        memcpy(BLOCK(sc, b), data + (long)i * SHMCACHE_BLOCK, n < SHMCACHE_BLOCK ? n : SHMCACHE_BLOCK);
+        if (i < nb - 1) {
+            b = NEXTBLOCK(sc)[b];
+        }
+    }
+    sc->freeblock = NEXTBLOCK(sc)[b];
+    NEXTBLOCK(sc)[b] = NIL;
+    sc->nfree -= nb;
+
+    ent->hnext = sc->buckets[h & (SHMCACHE_BUCKETS - 1)];
+    sc->buckets[h & (SHMCACHE_BUCKETS - 1)] = e;
+    lru_push(sc, e);
+    sc->bytes += len;
+    sc->objects++;
+    metrics_add(M_CACHE_INSERTS, 1);
+    publish(sc);
+    pthread_mutex_unlock(&sc->lock);
+}
+
+/*
+ * shmcache_close - unmap the segment (it stays for the other processes)
+ */
+void shmcache_close(shmcache_t *sc) {
+    munmap(sc, sc->size);
+}
+
+/*
+ * segment_size - bytes needed for nblocks blocks
+ */
+static long segment_size(int nblocks) {
+    return sizeof(shmcache_t) + (long)nblocks * (sizeof(shm_entry) + sizeof(int) + SHMCACHE_BLOCK);
+}
+
+/*
+ * segment_init - lay out and empty a new segment
+ */
+static void segment_init(shmcache_t *sc, int nblocks) {
+    pthread_mutexattr_t attr;
+
+    sc->magic = 0;
+    sc->size = segment_size(nblocks);
+    sc->nslots = sc->nblocks = nblocks;
+    sc->entoff = sizeof(shmcache_t);
+    sc->nextoff = sc->entoff + (long)nblocks * sizeof(shm_entry);
+    sc->dataoff = sc->nextoff + (long)nblocks * sizeof(int);
+    sc->resets = 0;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sc->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    reset(sc);
+    __atomic_store_n(&sc->magic, SHMCACHE_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ * reset - empty the cache, putting every entry and block on the free lists
+ */
+static void reset(shmcache_t *sc) {
+    int i;
+
+    for (i = 0; i < sc->nslots; i++) {
+        ENTRIES(sc)[i].hnext = i + 1 < sc->nslots ? i + 1 : NIL;
+    }
+    for (i = 0; i < sc->nblocks; i++) {
+        NEXTBLOCK(sc)[i] = i + 1 < sc->nblocks ? i + 1 : NIL;
+    }
+    for (i = 0; i < SHMCACHE_BUCKETS; i++) {
+        sc->buckets[i] = NIL;
+    }
+    sc->freeentry = sc->nslots > 0 ? 0 : NIL;
+    sc->freeblock = sc->nblocks > 0 ? 0 : NIL;
+    sc->nfree = sc->nblocks;
+    sc->head = sc->tail = NIL;
+    sc->bytes = sc->objects = 0;
+}
+
+/*
+ * lock - lock the segment, emptying it if the previous owner died holding it
+ */
+static void lock(shmcache_t *sc) {
+    if (pthread_mutex_lock(&sc->lock) == EOWNERDEAD) {
+        reset(sc);
+        sc->resets++;
+        pthread_mutex_consistent(&sc->lock);
+        fprintf(stderr, "shared cache: a proxy died holding the lock, cache emptied\n");
+    }
+}
+
+/*
+ * make_key - build the key of a request, -1 if it is too long
+ */
+static int make_key(char *key, char *host, char *port, char *uri) {
+    int n = snprintf(key, SHMCACHE_KEY, "%s:%s%s", host, port, uri);
+
+    return n < SHMCACHE_KEY ? 0 : -1;
+}
+
+/*
+ * hash - FNV-1a hash of a key
+ */
+static unsigned hash(const char *key) {
+    unsigned h = 2166136261u;
+
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * find - entry for key, or NIL (lock held)
+ */
+static int find(shmcache_t *sc, const char *key, unsigned h) {
+    int e;
+
+    for (e = sc->buckets[h & (SHMCACHE_BUCKETS - 1)]; e != NIL; e = ENTRIES(sc)[e].hnext) {
+        if (ENTRIES(sc)[e].hash == h && !strcmp(ENTRIES(sc)[e].key, key)) {
+            return e;
+        }
+    }
+    return NIL;
+}
+
+/*
+ * lru_unlink - take entry e out of the LRU list (lock held)
+ */
+static void lru_unlink(shmcache_t *sc, int e) {
+    shm_entry *ent = &ENTRIES(sc)[e];
+
+    if (ent->prev != NIL) {
+        ENTRIES(sc)[ent->prev].next = ent->next;
+    } else {
+        sc->head = ent->next;
+    }
+    if (ent->next != NIL) {
+        ENTRIES(sc)[ent->next].prev = ent->prev;
+    } else {
+        sc->tail = ent->prev;
+    }
+}
+
+/*
+ * lru_push - put entry e at the front of the LRU list (lock held)
+ */
+static void lru_push(shmcache_t *sc, int e) {
+    shm_entry *ent = &ENTRIES(sc)[e];
+
+    ent->prev = NIL;
+    ent->next = sc->head;
+    if (sc->head != NIL) {
+        ENTRIES(sc)[sc->head].prev = e;
+    } else {
+        sc->tail = e;
+    }
+    sc->head = e;
+}
+
+/*
+ * evict - remove the least recently used object (lock held)
+ */
+static void evict(shmcache_t *sc) {
+    int e = sc->tail, *pp, b, last;
+    shm_entry *ent = &ENTRIES(sc)[e];
+
+    // unlink from the hash chain and the LRU list
+    for (pp = &sc->buckets[ent->hash & (SHMCACHE_BUCKETS - 1)]; *pp != e; pp = &ENTRIES(sc)[*pp].hnext) {
+    }
+    *pp = ent->hnext;
+    lru_unlink(sc, e);
+
+    // give its blocks and the entry back
+    for (b = ent->block, last = b; b != NIL; b = NEXTBLOCK(sc)[b]) {
+        last = b;
+        sc->nfree++;
+    }
+    NEXTBLOCK(sc)[last] = sc->freeblock;
+    sc->freeblock = ent->block;
+    ent->hnext = sc->freeentry;
+    sc->freeentry = e;
+
+    sc->bytes -= ent->length;
+    sc->objects--;
+    metrics_add(M_CACHE_EVICTIONS, 1);
+}
+
+/*
+ * publish - update the cache gauges from the segment (lock held)
+ */
+static void publish(shmcache_t *sc) {
+    metrics_gauge_set(G_CACHE_BYTES, sc->bytes);
+    metrics_gauge_set(G_CACHE_OBJECTS, sc->objects);
+}
@@ -0,0 +1,39 @@
+/*
+ * shmcache.h - web object cache shared by proxy processes on one machine
+ *
+ * The cache lives in a POSIX shared-memory segment that every proxy
+ * started with the same name maps, wherever it lands in its address space:
+ * all links are indices into arrays inside the segment, never pointers.
+ * Objects are stored in chains of fixed-size blocks and evicted in LRU
+ * order. One robust, process-shared mutex protects the segment; if a
+ * process dies holding it, the next one to lock it empties the cache, since
+ * the dead process may have left it half updated.
+ */
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#define SHMCACHE_BLOCK 2048      // bytes of object data per block
+#define SHMCACHE_KEY 512         // longest "host:port/uri" key, longer ones are not cached
+#define SHMCACHE_BUCKETS 1024    // hash buckets (power of 2)
+
+typedef struct shmcache shmcache_t;
+
+/*
+ * helper functions
+ *
+ * shmcache_open: map (creating it if needed) the segment called name with room for
+ *                capacity bytes of data; every process must use the same capacity
+ *                return NULL if shared memory is unavailable, or with errno EINVAL
+ *                if the segment is in use with another capacity
+ * shmcache_get: return a private copy of the data cached for host, port and uri
+ *               and its length in *len, or NULL on a miss; the caller frees it
+ * shmcache_insert: cache a copy of data, evicting least recently used objects
+ *                  as needed (objects larger than the cache are not cached)
+ * shmcache_close: unmap the segment (it stays for the other processes)
+ */
+shmcache_t *shmcache_open(const char *name, int capacity);
+char *shmcache_get(shmcache_t *sc, char *host, char *port, char *uri, int *len);
+void shmcache_insert(shmcache_t *sc, char *host, char *port, char *uri, char *data, int len);
+void shmcache_close(shmcache_t *sc);
+
+#endif /* __SHMCACHE_H__ */
@@ -1,38 +1,109 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Run by tiny -w as a persistent worker (TINY_CGI_WORKER set), it
+ * answers requests on fd 0 with the protocol described in cgipool.h.
  */
 /* $begin adder */
+#include <stdint.h>
 #include "csapp.h"
+#include "cgipool.h"
+
+static int respond(char *query, char *out, int size);
+static int readall(int fd, void *buf, size_t n);
+static int writeall(int fd, void *buf, size_t n);
 
 int main(void) {
-    char *buf, *p;
-    char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
+    char query[MAXLINE], out[2 * MAXLINE];
+    uint32_t len;
+    int n;
+
+    if (getenv("TINY_CGI_WORKER") == NULL) {
+	/* Plain CGI: one request from the environment, response on stdout */
+	n = respond(getenv("QUERY_STRING"), out, sizeof(out));
+	fwrite(out, 1, n, stdout);
+	fflush(stdout);
+	exit(0);
+    }
+
+    /* Persistent worker: handshake, then one request per message on fd 0 */
+    if (writeall(0, CGI_MAGIC, strlen(CGI_MAGIC)) < 0)
+	exit(1);
+    while (readall(0, &len, sizeof(len)) == 0 && len < sizeof(query) &&
+	   readall(0, query, len) == 0) {
+	query[len] = '\0';
+	n = respond(query, out, sizeof(out));
+	len = n;
+	if (writeall(0, &len, sizeof(len)) < 0 || writeall(0, out, n) < 0)
+	    break;
+    }
+    exit(0);
+}
+
+/*
+ * respond - build the CGI output (headers and body) for a query string
+ */
+static int respond(char *query, char *out, int size)
+{
+    char content[MAXLINE], *p;
     int n1=0, n2=0;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
-	*p = '\0';
-	strcpy(arg1, buf);
-	strcpy(arg2, p+1);
-	n1 = atoi(arg1);
-	n2 = atoi(arg2);
+    if (query != NULL && (p = strchr(query, '&')) != NULL) {
+	n1 = atoi(query);
+	n2 = atoi(p+1);
     }
 
     /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
-  
+    snprintf(content, sizeof(content), "Welcome to add.com: "
+	     "THE Internet addition portal.\r\n<p>"
+	     "The answer is: %d + %d = %d\r\n<p>"
+	     "Thanks for visiting!\r\n", n1, n2, n1 + n2);
+
     /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
-    fflush(stdout);
+    return snprintf(out, size, "Connection: close\r\n"
+		    "Content-length: %d\r\n"
+		    "Content-type: text/html\r\n\r\n"
+		    "%s", (int)strlen(content), content);
+}
 
-    exit(0);
+/*
+ * readall - read exactly n bytes, -1 on EOF or error
+ */
+static int readall(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    ssize_t rc;
+
+    while (n > 0) {
+	if ((rc = read(fd, p, n)) <= 0) {
+	    if (rc < 0 && errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p += rc;
+	n -= rc;
+    }
+    return 0;
+}
+
+/*
+ * writeall - write exactly n bytes, -1 on error
+ */
+static int writeall(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    ssize_t rc;
+
+    while (n > 0) {
+	if ((rc = write(fd, p, n)) <= 0) {
+	    if (rc < 0 && errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p += rc;
+	n -= rc;
+    }
+    return 0;
 }
 /* $end adder */
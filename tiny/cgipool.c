@@ -0,0 +1,228 @@
+/*
+ * cgipool.c - pools of persistent CGI workers
+ *
+ * The first request for a CGI program starts nworkers copies of it, each
+ * connected to tiny by a Unix socket. A request then costs a round trip
+ * on an idle worker's socket instead of a fork and exec. A worker that
+ * dies or hangs is restarted; a program that doesn't speak the worker
+ * protocol (see cgipool.h) keeps being run with fork and exec, and so do
+ * requests that check out a worker that could not be restarted.
+ */
+/* $begin cgipoolc */
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include "csapp.h"
+#include "cgipool.h"
+
+#define CGI_MAXRESPONSE (16 << 20)  /* Largest response accepted from a worker */
+
+typedef struct {
+    char path[MAXLINE];          /* CGI program */
+    int supported;               /* Its workers speak the protocol */
+    int fd[CGI_MAXWORKERS];      /* Socket to each worker, -1 once it is dead */
+    pid_t pid[CGI_MAXWORKERS];
+    int idle[CGI_MAXWORKERS];    /* Stack of idle worker indices */
+    int nidle;
+    sem_t nfree;                 /* Counts idle workers */
+    pthread_mutex_t lock;        /* Protects idle and nidle */
+} pool_t;
+
+static pool_t pools[CGI_MAXPROGS];
+static int npools;
+static pthread_mutex_t poolslock = PTHREAD_MUTEX_INITIALIZER; /* Protects npools */
+static int nworkers;             /* Workers per program, 0 to always fork */
+
+static pool_t *find_pool(char *filename);
+static int spawn(pool_t *pool, int i);
+static void reap(pool_t *pool, int i);
+static int worker_read(int fd, void *buf, size_t n);
+
+/*
+ * cgipool_init - run every CGI program as a pool of n workers (0: fork per request)
+ */
+void cgipool_init(int n)
+{
+    nworkers = n < CGI_MAXWORKERS ? n : CGI_MAXWORKERS;
+}
+
+/*
+ * cgipool_serve - serve a CGI request on a pooled worker
+ *     return 0 if done, -1 if the caller must fork and exec the program
+ */
+int cgipool_serve(int fd, char *filename, char *cgiargs)
+{
+    static const char *hdr = "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n";
+    uint32_t len = strlen(cgiargs), rlen;
+    struct iovec iov[2];
+    pool_t *pool;
+    char *resp;
+    int i, wfd, rc = 0;
+
+    if (nworkers == 0 || (pool = find_pool(filename)) == NULL || !pool->supported)
+	return -1;
+
+    /* Check out an idle worker */
+    P(&pool->nfree);
+    pthread_mutex_lock(&pool->lock);
+    i = pool->idle[--pool->nidle];
+    pthread_mutex_unlock(&pool->lock);
+    if ((wfd = pool->fd[i]) < 0) {
+	rc = -1;                 /* Dead for good: fork instead */
+	goto done;
+    }
+
+    /* One request, one response */
+    iov[0].iov_base = &len;
+    iov[0].iov_len = sizeof(len);
+    iov[1].iov_base = cgiargs;
+    iov[1].iov_len = len;
+    resp = NULL;
+    if (writev(wfd, iov, 2) != sizeof(len) + len ||
+	worker_read(wfd, &rlen, sizeof(rlen)) < 0 || rlen > CGI_MAXRESPONSE ||
+	worker_read(wfd, (resp = Malloc(rlen + 1)), rlen) < 0) {
+	/* The worker died, hung or broke the protocol: replace it, fall back to fork */
+	free(resp);
+	reap(pool, i);
+	if (spawn(pool, i) < 0)
+	    pool->supported = 0;
+	rc = -1;
+    }
+    else {
+	rio_writen(fd, (void *)hdr, strlen(hdr));
+	rio_writen(fd, resp, rlen);
+	free(resp);
+    }
+
+ done:
+    pthread_mutex_lock(&pool->lock);
+    pool->idle[pool->nidle++] = i;
+    pthread_mutex_unlock(&pool->lock);
+    V(&pool->nfree);
+    return rc;
+}
+
+/*
+ * find_pool - return the pool of a program, starting it on first use
+ *     NULL if there are already CGI_MAXPROGS pools
+ */
+static pool_t *find_pool(char *filename)
+{
+    pool_t *pool = NULL;
+    int i;
+
+    pthread_mutex_lock(&poolslock);
+    for (i = 0; i < npools; i++) {
+	if (!strcmp(pools[i].path, filename)) {
+	    pool = &pools[i];
+	    break;
+	}
+    }
+    if (pool == NULL && npools < CGI_MAXPROGS) {
+	pool = &pools[npools++];
+	strncpy(pool->path, filename, MAXLINE - 1);
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->nidle = 0;
+	/* A program whose first worker fails the handshake is not pooled */
+	for (i = 0; i < nworkers && spawn(pool, i) == 0; i++)
+	    pool->idle[pool->nidle++] = i;
+	pool->supported = pool->nidle > 0;
+	Sem_init(&pool->nfree, 0, pool->nidle);
+	printf("CGI pool for %s: %d workers\n", filename, pool->nidle);
+    }
+    pthread_mutex_unlock(&poolslock);
+    return pool;
+}
+
+/*
+ * spawn - start worker i of a pool and wait for its handshake, -1 on failure
+ */
+static int spawn(pool_t *pool, int i)
+{
+    char *argv[] = { pool->path, NULL }, magic[sizeof(CGI_MAGIC) - 1], **envp;
+    struct pollfd pfd;
+    struct rlimit rl;
+    int sv[2], fd, n;
+    pid_t pid;
+
+    /* Build everything the child needs first: other threads may hold locks */
+    for (n = 0; environ[n] != NULL; n++)
+	;
+    envp = Malloc((n + 2) * sizeof(char *));
+    memcpy(envp, environ, n * sizeof(char *));
+    envp[n] = "TINY_CGI_WORKER=1";
+    envp[n + 1] = NULL;
+    getrlimit(RLIMIT_NOFILE, &rl);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+	free(envp);
+	return -1;
+    }
+    if ((pid = fork()) == 0) { /* Child: socket on stdin, no other tiny descriptors */
+	dup2(sv[1], STDIN_FILENO);
+	if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+	    dup2(fd, STDOUT_FILENO);
+	for (fd = 3; fd < rl.rlim_cur && fd < 65536; fd++)
+	    close(fd);
+	execve(pool->path, argv, envp);
+	_exit(1);
+    }
+    free(envp);
+    close(sv[1]);
+    if (pid < 0) {
+	close(sv[0]);
+	return -1;
+    }
+    pool->fd[i] = sv[0];
+    pool->pid[i] = pid;
+
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, CGI_HANDSHAKE_MS) != 1 ||
+	rio_readn(sv[0], magic, sizeof(magic)) != sizeof(magic) ||
+	memcmp(magic, CGI_MAGIC, sizeof(magic))) {
+	reap(pool, i);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * reap - stop worker i of a pool and release its socket
+ */
+static void reap(pool_t *pool, int i)
+{
+    kill(pool->pid[i], SIGKILL);
+    waitpid(pool->pid[i], NULL, 0);
+    close(pool->fd[i]);
+    pool->fd[i] = -1;            /* The number may soon be another client's */
+}
+
+/*
+ * worker_read - read n bytes from a worker socket
+ *     return 0, or -1 on error, EOF, or CGI_TIMEOUT_MS without data
+ */
+static int worker_read(int fd, void *buf, size_t n)
+{
+    struct pollfd pfd;
+    char *bufp = buf;
+    ssize_t nread;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (n > 0) {
+	if ((rc = poll(&pfd, 1, CGI_TIMEOUT_MS)) < 0 && errno == EINTR)
+	    continue;
+	if (rc != 1)
+	    return -1;
+	if ((nread = read(fd, bufp, n)) < 0 && errno == EINTR)
+	    continue;
+	if (nread <= 0)
+	    return -1;
+	bufp += nread;
+	n -= nread;
+    }
+    return 0;
+}
+/* $end cgipoolc */
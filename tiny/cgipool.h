@@ -0,0 +1,25 @@
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+
+#define CGI_MAXPROGS 16          /* Most CGI programs with a worker pool */
+#define CGI_MAXWORKERS 64        /* Most workers per program */
+#define CGI_MAGIC "TCG1"         /* Handshake a worker sends when it starts */
+#define CGI_HANDSHAKE_MS 1000    /* How long a new worker has to send it */
+#define CGI_TIMEOUT_MS 30000     /* How long a worker may go silent on a request */
+
+/*
+ * Protocol on the Unix socket (fd 0 of the worker, which is started with
+ * TINY_CGI_WORKER=1 in its environment):
+ *
+ *   worker -> tiny: CGI_MAGIC once, when it is ready
+ *   tiny -> worker: uint32 length, then QUERY_STRING
+ *   worker -> tiny: uint32 length, then what a CGI program prints to stdout
+ *
+ * Programs that don't send the handshake are run with fork and exec.
+ */
+void cgipool_init(int nworkers);
+int cgipool_serve(int fd, char *filename, char *cgiargs);
+
+#endif /* __CGIPOOL_H__ */
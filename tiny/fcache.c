@@ -0,0 +1,258 @@
+/*
+ * fcache.c - cache of open file descriptors and their stat results
+ *
+ * fcache_get returns an open descriptor and stat for a path without
+ * resolving the path again while the file is unchanged. A thread reads
+ * inotify events for the directories of cached files and drops every
+ * entry whose file is modified, replaced, moved or deleted. Small files
+ * are read into memory, and a fill hook can attach data built once per
+ * opened file (tiny's response headers). Entries are
+ * reference counted, so a descriptor is closed only after the last
+ * response using it is sent.
+ */
+/* $begin fcachec */
+#include <libgen.h>
+#include <sys/inotify.h>
+#include "csapp.h"
+#include "fcache.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static fentry_t *table[FCACHE_BUCKETS];
+static int nentries;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* Protects all of the above */
+
+static int ifd = -1;                      /* inotify descriptor, -1 if unavailable */
+static struct {
+    int wd;
+    char dir[MAXLINE];
+} watches[FCACHE_WATCHES];                /* Watched directories */
+static int nwatches;
+static unsigned long gen;                 /* Bumped by every invalidation */
+static fcache_fill_t *fillfn;             /* Called on every newly opened entry */
+
+static unsigned hash(char *s);
+static void release(fentry_t *fe);
+static int watch_dir(char *filename);
+static void invalidate(char *filename);
+static void *watcher(void *vargp);
+
+/*
+ * fcache_init - start the inotify watcher (without one, nothing is cached)
+ *     fill, if not NULL, completes every newly opened entry
+ */
+void fcache_init(fcache_fill_t *fill)
+{
+    pthread_t tid;
+
+    fillfn = fill;
+    if ((ifd = inotify_init()) < 0) {
+	fprintf(stderr, "inotify unavailable, file cache disabled: %s\n", strerror(errno));
+	return;
+    }
+    Pthread_create(&tid, NULL, watcher, NULL);
+}
+
+/*
+ * fcache_get - return the cached entry for filename, opening it on a miss
+ *     NULL (with errno set) if the file can't be opened
+ */
+fentry_t *fcache_get(char *filename)
+{
+    unsigned h = hash(filename);
+    unsigned long g;
+    fentry_t *fe;
+    int fd, cacheable;
+
+    pthread_mutex_lock(&lock);
+    for (fe = table[h]; fe != NULL; fe = fe->next) {
+	if (!strcmp(fe->name, filename)) {
+	    fe->refcnt++;
+	    pthread_mutex_unlock(&lock);
+	    return fe;
+	}
+    }
+    pthread_mutex_unlock(&lock);
+
+    /* Only cache paths that inotify events name the same way */
+    cacheable = ifd >= 0 && !strstr(filename, "//") && !strstr(filename, "/./") &&
+	!strstr(filename, "/..");
+    /* Watch the directory before opening, so no later change is missed */
+    if (cacheable && watch_dir(filename) < 0)
+	cacheable = 0;
+    pthread_mutex_lock(&lock);
+    g = gen;
+    pthread_mutex_unlock(&lock);
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+	return NULL;
+    fe = Malloc(sizeof(fentry_t));
+    fe->name = strdup(filename);
+    fe->fd = fd;
+    fstat(fd, &fe->sbuf);
+    fe->hdr[0] = fe->hdr[1] = NULL;
+    fe->hdrlen[0] = fe->hdrlen[1] = 0;
+    fe->body = NULL;
+    if (S_ISREG(fe->sbuf.st_mode) && fe->sbuf.st_size <= FCACHE_SMALL) {
+	fe->body = Malloc(fe->sbuf.st_size + 1);
+	if (pread(fd, fe->body, fe->sbuf.st_size, 0) != fe->sbuf.st_size) {
+	    free(fe->body);   /* Changing under us: leave it to sendfile */
+	    fe->body = NULL;
+	}
+    }
+    if (fillfn != NULL)
+	fillfn(fe);
+    fe->refcnt = 1;
+    fe->cached = 0;
+    if (!cacheable)
+	return fe;
+
+    pthread_mutex_lock(&lock);
+    /* Cache it unless something changed since we looked, or it raced in */
+    if (g == gen && nentries < FCACHE_MAX) {
+	for (fe->next = table[h]; fe->next != NULL; fe->next = fe->next->next)
+	    if (!strcmp(fe->next->name, filename))
+		break;
+	if (fe->next == NULL) {
+	    fe->next = table[h];
+	    table[h] = fe;
+	    fe->cached = 1;
+	    fe->refcnt++;
+	    nentries++;
+	}
+    }
+    pthread_mutex_unlock(&lock);
+    return fe;
+}
+
+/*
+ * fcache_put - release an entry returned by fcache_get
+ */
+void fcache_put(fentry_t *fe)
+{
+    pthread_mutex_lock(&lock);
+    release(fe);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * release - drop one reference, freeing the entry on the last (lock held)
+ */
+static void release(fentry_t *fe)
+{
+    if (--fe->refcnt == 0) {
+	close(fe->fd);
+	free(fe->name);
+	free(fe->hdr[0]);
+	free(fe->hdr[1]);
+	free(fe->body);
+	free(fe);
+    }
+}
+
+/*
+ * hash - FNV-1a hash of a path, reduced to a bucket
+ */
+static unsigned hash(char *s)
+{
+    unsigned h = 2166136261u;
+
+    for (; *s; s++)
+	h = (h ^ (unsigned char)*s) * 16777619u;
+    return h & (FCACHE_BUCKETS - 1);
+}
+
+/*
+ * watch_dir - make sure the directory of filename is watched, -1 on failure
+ */
+static int watch_dir(char *filename)
+{
+    char path[MAXLINE], *dir;
+    int i, wd;
+
+    strncpy(path, filename, MAXLINE - 1);
+    path[MAXLINE - 1] = '\0';
+    dir = dirname(path);
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < nwatches; i++) {
+	if (!strcmp(watches[i].dir, dir)) {
+	    pthread_mutex_unlock(&lock);
+	    return 0;
+	}
+    }
+    if (nwatches == FCACHE_WATCHES || (wd = inotify_add_watch(ifd, dir, WATCH_MASK)) < 0) {
+	pthread_mutex_unlock(&lock);
+	return -1;
+    }
+    watches[nwatches].wd = wd;
+    strcpy(watches[nwatches].dir, dir);
+    nwatches++;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+ * invalidate - drop the entry for filename, or every entry if NULL (lock held)
+ */
+static void invalidate(char *filename)
+{
+    fentry_t **pp, *fe;
+    int b;
+
+    gen++;
+    for (b = 0; b < FCACHE_BUCKETS; b++) {
+	if (filename != NULL && b != hash(filename))
+	    continue;
+	for (pp = &table[b]; (fe = *pp) != NULL; ) {
+	    if (filename == NULL || !strcmp(fe->name, filename)) {
+		*pp = fe->next;
+		fe->cached = 0;
+		nentries--;
+		release(fe);
+	    }
+	    else
+		pp = &fe->next;
+	}
+    }
+}
+
+/*
+ * watcher - thread routine, drop entries for files that change
+ */
+static void *watcher(void *vargp)
+{
+    char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+	__attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[2 * MAXLINE];
+    struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+    int i;
+
+    Pthread_detach(pthread_self());
+    while ((n = read(ifd, buf, sizeof(buf))) > 0 || errno == EINTR) {
+	pthread_mutex_lock(&lock);
+	for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+	    ev = (struct inotify_event *)p;
+	    if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		/* Lost events or the directory itself went away */
+		invalidate(NULL);
+		if (ev->mask & IN_IGNORED)
+		    for (i = 0; i < nwatches; i++)
+			if (watches[i].wd == ev->wd)
+			    watches[i] = watches[--nwatches];
+		continue;
+	    }
+	    for (i = 0; i < nwatches; i++) {
+		if (watches[i].wd == ev->wd && ev->len > 0) {
+		    snprintf(path, sizeof(path), "%s/%s", watches[i].dir, ev->name);
+		    invalidate(path);
+		}
+	    }
+	}
+	pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+/* $end fcachec */
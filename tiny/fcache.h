@@ -0,0 +1,31 @@
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include "csapp.h"
+
+#define FCACHE_BUCKETS 1024   /* Hash buckets (power of two) */
+#define FCACHE_MAX     1024   /* Most open files kept at once */
+#define FCACHE_WATCHES 256    /* Most watched directories */
+#define FCACHE_SMALL   32768  /* Regular files up to this size are kept in memory */
+
+/* $begin fentry */
+typedef struct fentry {
+    char *name;               /* Path as built by parse_uri, e.g. ./home.html */
+    int fd;                   /* Open read-only descriptor */
+    struct stat sbuf;         /* fstat of fd when it was opened */
+    char *hdr[2];             /* Response headers built by the fill hook, or NULL: */
+    int hdrlen[2];            /*   [0] Connection: close, [1] keep-alive */
+    char *body;               /* Contents of a small regular file, else NULL */
+    int refcnt;               /* 1 while in the cache, plus 1 per user */
+    int cached;               /* In the hash table (else freed on last put) */
+    struct fentry *next;      /* Hash chain */
+} fentry_t;
+/* $end fentry */
+
+typedef void fcache_fill_t(fentry_t *fe);
+
+void fcache_init(fcache_fill_t *fill);
+fentry_t *fcache_get(char *filename);
+void fcache_put(fentry_t *fe);
+
+#endif /* __FCACHE_H__ */
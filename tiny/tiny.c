@@ -1,112 +1,190 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple, prethreaded HTTP/1.0 Web server that uses the 
+ *     GET method to serve static and dynamic content. Static
+ *     responses keep the connection alive for HTTP/1.1 clients and
+ *     for HTTP/1.0 clients that ask for it.
  */
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include "csapp.h"
+#include "sbuf.h"
+#include "fcache.h"
+#include "cgipool.h"
+#define NTHREADS  32
+#define SBUFSIZE  64
+#define KEEPALIVE_SECS 5  /* Idle keep-alive connections are closed after this */
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+void *thread(void *vargp);
+void serve_conn(int fd);
+int doit(int fd, rio_t *rp);
+int read_requesthdrs(rio_t *rp, int *keepalive);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void prepare_static(fentry_t *fe);
+int serve_static(int fd, fentry_t *fe, int keepalive);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
 
+sbuf_t sbuf; /* Shared buffer of connected descriptors */
+
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd;
+    int i, c, listenfd, connfd, ncgi = 0;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((c = getopt(argc, argv, "w:")) != -1) {
+	if (c == 'w')
+	    ncgi = atoi(optarg);  /* Persistent workers per CGI program */
+	else
+	    argc = 0;
+    }
+    if (argc - optind != 1) {
+	fprintf(stderr, "usage: %s [-w cgi workers] <port>\n", argv[0]);
 	exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd(argv[optind]);
+    Signal(SIGPIPE, SIG_IGN);         /* Clients that go away must not kill us */
+    sbuf_init(&sbuf, SBUFSIZE);
+    fcache_init(prepare_static);      /* Open-file cache and its inotify watcher */
+    cgipool_init(ncgi);               /* CGI worker pools, started on first use */
+    for (i = 0; i < NTHREADS; i++)    /* Create worker threads */
+	Pthread_create(&tid, NULL, thread, NULL);
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
+	/* Numeric host and port: no reverse DNS lookup per connection */
         Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
+                    port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);
         printf("Accepted connection from (%s, %s)\n", hostname, port);
-	doit(connfd);                                             //line:netp:tiny:doit
+	sbuf_insert(&sbuf, connfd);       /* Insert connfd in buffer */
+    }
+}
+
+void *thread(void *vargp) 
+{  
+    Pthread_detach(pthread_self()); 
+    while (1) { 
+	int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
+	serve_conn(connfd);                                       //line:netp:tiny:doit
 	Close(connfd);                                            //line:netp:tiny:close
     }
 }
 /* $end tinymain */
 
+/*
+ * serve_conn - serve requests on a connection until the client closes
+ *     it, a response closes it, or it idles for KEEPALIVE_SECS
+ */
+void serve_conn(int fd) 
+{
+    rio_t rio;
+    struct timeval timeout = { KEEPALIVE_SECS, 0 };
+    int one = 1;
+
+    Setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    /* Don't let Nagle hold a response back behind an unacknowledged one */
+    Setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    Rio_readinitb(&rio, fd);
+    while (doit(fd, &rio))
+	;
+}
+
 /*
  * doit - handle one HTTP request/response transaction
+ *     return 1 if the connection can carry another request
  */
 /* $begin doit */
-void doit(int fd) 
+int doit(int fd, rio_t *rp) 
 {
-    int is_static;
-    struct stat sbuf;
+    int is_static, keepalive;
+    fentry_t *fe;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
 
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
-        return;
+    /* Read request line and headers (EOF, error or idle timeout ends the connection) */
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)  //line:netp:doit:readrequest
+        return 0;
     printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3) //line:netp:doit:parserequest
+        return 0;
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented",
                     "Tiny does not implement this method");
-        return;
+        return 0;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    keepalive = !strcmp(version, "HTTP/1.1");            /* HTTP/1.1 defaults to persistent */
+    if (read_requesthdrs(rp, &keepalive) < 0)            //line:netp:doit:readrequesthdrs
+        return 0;
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
-    if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
-	clienterror(fd, filename, "404", "Not found",
-		    "Tiny couldn't find this file");
-	return;
+    if ((fe = fcache_get(filename)) == NULL) {           //line:netp:doit:beginnotfound
+	if (errno == EACCES)
+	    clienterror(fd, filename, "403", "Forbidden",
+			"Tiny couldn't read the file");
+	else
+	    clienterror(fd, filename, "404", "Not found",
+			"Tiny couldn't find this file");
+	return 0;
     }                                                    //line:netp:doit:endnotfound
 
     if (is_static) { /* Serve static content */          
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
+	if (!(S_ISREG(fe->sbuf.st_mode)) || !(S_IRUSR & fe->sbuf.st_mode)) { //line:netp:doit:readable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't read the file");
-	    return;
+	    fcache_put(fe);
+	    return 0;
 	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+	if (serve_static(fd, fe, keepalive) < 0)         //line:netp:doit:servestatic
+	    keepalive = 0;  /* The client still expects the rest of the body */
+	fcache_put(fe);
+	return keepalive;
     }
     else { /* Serve dynamic content */
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
+	if (!(S_ISREG(fe->sbuf.st_mode)) || !(S_IXUSR & fe->sbuf.st_mode)) { //line:netp:doit:executable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't run the CGI program");
-	    return;
+	    fcache_put(fe);
+	    return 0;
 	}
+	fcache_put(fe);
 	serve_dynamic(fd, filename, cgiargs);            //line:netp:doit:servedynamic
+	return 0;  /* The CGI program sends Connection: close */
     }
 }
 /* $end doit */
 
 /*
  * read_requesthdrs - read HTTP request headers
+ *     a Connection header overrides *keepalive; return -1 on EOF or error
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+int read_requesthdrs(rio_t *rp, int *keepalive) 
 {
-    char buf[MAXLINE];
+    char buf[MAXLINE], *p;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
+    do {
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	    return -1;
 	printf("%s", buf);
-    }
-    return;
+	if (!strncasecmp(buf, "Connection:", 11)) {
+	    for (p = buf + 11; *p == ' '; p++)
+		;
+	    if (!strncasecmp(p, "close", 5))
+		*keepalive = 0;
+	    else if (!strncasecmp(p, "keep-alive", 10))
+		*keepalive = 1;
+	}
+    } while(strcmp(buf, "\r\n"));          //line:netp:readhdrs:checkterm
+    return 0;
 }
 /* $end read_requesthdrs */
 
@@ -143,48 +221,104 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * prepare_static - build both header blocks of a regular file once,
+ *     when the open-file cache opens it
+ */
+void prepare_static(fentry_t *fe) 
+{
+    char filetype[MAXLINE];
+    int i;
+
+    if (!S_ISREG(fe->sbuf.st_mode))
+	return;
+    get_filetype(fe->name, filetype);       //line:netp:servestatic:getfiletype
+    for (i = 0; i < 2; i++) {               //line:netp:servestatic:beginserve
+	fe->hdr[i] = Malloc(MAXLINE);
+	fe->hdrlen[i] = snprintf(fe->hdr[i], MAXLINE,
+				 "HTTP/1.0 200 OK\r\n"
+				 "Server: Tiny Web Server\r\n"
+				 "Connection: %s\r\n"
+				 "Content-length: %lld\r\n"
+				 "Content-type: %s\r\n\r\n",
+				 i ? "keep-alive" : "close", (long long)fe->sbuf.st_size, filetype);
+    }                                       //line:netp:servestatic:endserve
+}
+
+/*
+ * serve_static - copy a file back to the client: small files from
+ *     memory with one writev, others with sendfile straight from the
+ *     descriptor in the open-file cache
+ *     return -1 if the response was cut short (a write failed, or the
+ *     file shrank since it was cached), 0 otherwise
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+int serve_static(int fd, fentry_t *fe, int keepalive) 
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
- 
-    /* Send response headers to client */
-    get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
+    int filesize = fe->sbuf.st_size;
+    struct iovec iov[2];
+    off_t offset = 0;
+    ssize_t rc;
+    int i, on = 1, off = 0;
+
     printf("Response headers:\n");
-    printf("%s", buf);
+    printf("%s", fe->hdr[keepalive]);
+
+    iov[0].iov_base = fe->hdr[keepalive];
+    iov[0].iov_len = fe->hdrlen[keepalive];
+    iov[1].iov_base = fe->body;
+    iov[1].iov_len = fe->body != NULL ? filesize : 0;
+    /* Headers and a small body go out in one writev; before a sendfile,
+       cork the socket so the headers share a packet with the body */
+    if (fe->body == NULL)
+	Setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    for (i = 0; i < 2; ) {
+	if ((rc = writev(fd, &iov[i], 2 - i)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	for (; i < 2 && rc >= iov[i].iov_len; i++)
+	    rc -= iov[i].iov_len;
+	if (i < 2) {
+	    iov[i].iov_base = (char *)iov[i].iov_base + rc;
+	    iov[i].iov_len -= rc;
+	}
+    }
+    if (fe->body != NULL)
+	return 0;
 
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
-    Close(srcfd);                           //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);         //line:netp:servestatic:write
-    Munmap(srcp, filesize);                 //line:netp:servestatic:munmap
+    /* Send response body to client (the file offset is left untouched) */
+    while (offset < filesize) {             //line:netp:servestatic:write
+	/* 0: the file shrank since it was cached */
+	if ((rc = sendfile(fd, fe->fd, &offset, filesize - offset)) == 0 ||
+	    (rc < 0 && errno != EINTR))
+	    break;
+    }
+    Setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    return offset < filesize ? -1 : 0;
 }
 
 /*
- * get_filetype - derive file type from file name
+ * get_filetype - derive file type from the file name's extension
  */
 void get_filetype(char *filename, char *filetype) 
 {
-    if (strstr(filename, ".html"))
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".png"))
-	strcpy(filetype, "image/png");
-    else if (strstr(filename, ".jpg"))
-	strcpy(filetype, "image/jpeg");
-    else
-	strcpy(filetype, "text/plain");
+    static const char *types[][2] = {
+	{ ".html", "text/html" },
+	{ ".gif", "image/gif" },
+	{ ".png", "image/png" },
+	{ ".jpg", "image/jpeg" },
+    };
+    char *ext = strrchr(filename, '.');
+    int i;
+
+    for (i = 0; ext != NULL && i < sizeof(types) / sizeof(types[0]); i++) {
+	if (!strcmp(ext, types[i][0])) {
+	    strcpy(filetype, types[i][1]);
+	    return;
+	}
+    }
+    strcpy(filetype, "text/plain");
 }  
 /* $end serve_static */
 
@@ -194,21 +328,40 @@ void get_filetype(char *filename, char *filetype)
 /* $begin serve_dynamic */
 void serve_dynamic(int fd, char *filename, char *cgiargs) 
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    char buf[MAXLINE], *emptylist[] = { NULL }, **envp, *query;
+    pid_t pid;
+    int i, n;
+
+    if (cgipool_serve(fd, filename, cgiargs) == 0)
+	return;                       /* Served by a persistent worker */
 
     /* Return first part of HTTP response */
     sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
+
+    /* Real server would set all CGI vars here. Build the environment
+       before forking: other threads may hold the malloc or env locks */
+    query = Malloc(strlen("QUERY_STRING=") + strlen(cgiargs) + 1);
+    sprintf(query, "QUERY_STRING=%s", cgiargs); //line:netp:servedynamic:setenv
+    for (n = 0; environ[n] != NULL; n++)
+	;
+    envp = Malloc((n + 2) * sizeof(char *));
+    for (i = n = 0; environ[i] != NULL; i++)
+	if (strncmp(environ[i], "QUERY_STRING=", 13))
+	    envp[n++] = environ[i];
+    envp[n++] = query;
+    envp[n] = NULL;
   
-    if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
-	/* Real server would set all CGI vars here */
-	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
-	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
-	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
+    if ((pid = Fork()) == 0) { /* Child: async-signal-safe calls only */ //line:netp:servedynamic:fork
+	dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
+	execve(filename, emptylist, envp); /* Run CGI program */ //line:netp:servedynamic:execve
+	_exit(1);
     }
-    Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    free(envp);
+    free(query);
+    Waitpid(pid, NULL, 0); /* Parent waits for and reaps its own child */ //line:netp:servedynamic:wait
 }
 /* $end serve_dynamic */
 
@@ -222,19 +375,20 @@ void clienterror(int fd, char *cause, char *errnum,
     char buf[MAXLINE], body[MAXBUF];
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+    snprintf(body, MAXBUF, "<html><title>Tiny Error</title>"
+	     "<body bgcolor=""ffffff"">\r\n"
+	     "%s: %s\r\n"
+	     "<p>%s: %.1024s\r\n"
+	     "<hr><em>The Tiny Web server</em>\r\n",
+	     errnum, shortmsg, longmsg, cause);
 
     /* Print the HTTP response */
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, buf, strlen(buf));
     sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    rio_writen(fd, buf, strlen(buf));
+    rio_writen(fd, body, strlen(body));
 }
 /* $end clienterror */
@@ -0,0 +1,171 @@
+/*
+ * trace.c - sampled per-request stage tracing
+ */
+#include <string.h>
+#include "trace.h"
+
+/*
+ * kept trace slot
+ *
+ * seq: odd while the slot is being written, bumped twice per write
+ * rec: finished trace
+ */
+typedef struct trace_slot {
+    unsigned long seq;
+    trace_rec rec;
+} trace_slot;
+
+/*
+ * every: sample one in every `every` requests, 0 if disabled
+ * nextid: sequence number of the next request
+ * nextslot: next slot to overwrite
+ * ticks_per_us: tick rate measured by trace_init
+ * base: tick count at trace_init, origin of exported timestamps
+ */
+static unsigned int every = 0;
+static unsigned long nextid = 0;
+static unsigned long nextslot = 0;
+static double ticks_per_us = 1000.0;
+static unsigned long base;
+static trace_slot slots[TRACE_KEEP];
+
+/* name of the span that ends at each stage */
+static const char *stage_names[TS_NSTAGES] = {
+    [TS_REQLINE] = "read request line",
+    [TS_PARSED] = "parse",
+    [TS_LOOKUP] = "cache lookup",
+    [TS_CONNECTED] = "open_clientfd",
+    [TS_HEADERS] = "forward headers",
+    [TS_FIRST_BYTE] = "wait first byte",
+    [TS_RELAYED] = "relay body",
+    [TS_INSERTED] = "cache insert",
+    [TS_DONE] = "close",
+};
+
+/*
+ * helper functions
+ *
+ * calibrate: measure trace_ticks per microsecond against CLOCK_MONOTONIC_RAW
+ */
+static void calibrate(void);
+
+/*
+ * trace_init - trace one in every `n` requests (0 disables tracing)
+ */
+void trace_init(unsigned int n) {
+    every = n;
+    if (every > 0) {
+        calibrate();
+    }
+}
+
+/*
+ * trace_begin - decide whether to sample a new request and mark TS_ACCEPT
+ */
+void trace_begin(trace_rec *t) {
+    unsigned long id;
+
+    t->sampled = 0;
+    if (every == 0) {
+        return;
+    }
+    id = __atomic_fetch_add(&nextid, 1, __ATOMIC_RELAXED);
+    if (id % every != 0) {
+        return;
+    }
+    memset(t, 0, sizeof(trace_rec));
+    t->sampled = 1;
+    t->id = id;
+    t->ts[TS_ACCEPT] = trace_ticks();
+}
+
+/*
+ * trace_finish - mark TS_DONE and keep a sampled trace for export
+ */
+void trace_finish(trace_rec *t) {
+    trace_slot *slot;
+    unsigned long seq;
+
+    if (!t->sampled) {
+        return;
+    }
+    t->ts[TS_DONE] = trace_ticks();
+
+    // seqlock write: readers retry or skip a slot whose seq is odd or changed
+    slot = &slots[__atomic_fetch_add(&nextslot, 1, __ATOMIC_RELAXED) & (TRACE_KEEP - 1)];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;     // another writer lapped the ring onto this slot -> drop
+    }
+    memcpy(&slot->rec, t, sizeof(trace_rec));
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * trace_render - write kept traces as Chrome trace-event JSON
+ * every request is one timeline row (tid) with one complete event per stage
+ */
+void trace_render(FILE *fp) {
+    trace_rec rec;
+    unsigned long seq;
+    int i, s, prev, first = 1;
+    char *q;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (i = 0; i < TRACE_KEEP; i++) {
+        seq = __atomic_load_n(&slots[i].seq, __ATOMIC_ACQUIRE);
+        if (seq == 0 || (seq & 1)) {
+            continue;
+        }
+        memcpy(&rec, &slots[i].rec, sizeof(trace_rec));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slots[i].seq, __ATOMIC_RELAXED) != seq) {
+            continue;   // overwritten while copying
+        }
+
+        // URLs are used as JSON strings: cut at the first character needing escapes
+        rec.url[TRACE_URL_LEN - 1] = '\0';
+        for (q = rec.url; *q; q++) {
+            if (*q == '"' || *q == '\\' || (unsigned char)*q < 0x20) {
+                *q = '\0';
+                break;
+            }
+        }
+
+        fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                first ? "" : ",", rec.url[0] ? rec.url : "request", rec.id,
+                (rec.ts[TS_ACCEPT] - base) / ticks_per_us,
+                (rec.ts[TS_DONE] - rec.ts[TS_ACCEPT]) / ticks_per_us);
+        first = 0;
+        for (prev = TS_ACCEPT, s = TS_ACCEPT + 1; s < TS_NSTAGES; s++) {
+            if (rec.ts[s] == 0) {
+                continue;
+            }
+            fprintf(fp, ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                    stage_names[s], rec.id, (rec.ts[prev] - base) / ticks_per_us,
+                    (rec.ts[s] - rec.ts[prev]) / ticks_per_us);
+            prev = s;
+        }
+    }
+    fprintf(fp, "]}\n");
+}
+
+/*
+ * calibrate - measure trace_ticks per microsecond against CLOCK_MONOTONIC_RAW
+ */
+static void calibrate(void) {
+    struct timespec t0, t1, pause = {0, 10 * 1000 * 1000};
+    unsigned long c0, c1;
+    double us;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+    c0 = trace_ticks();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+    c1 = trace_ticks();
+
+    us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+    ticks_per_us = (c1 - c0) / us;
+    base = c0;
+}
@@ -0,0 +1,86 @@
+/*
+ * trace.h - sampled per-request stage tracing
+ *
+ * A sampled request records a timestamp at each stage of proxy(). Finished
+ * traces are kept in a small ring and exported as Chrome trace-event JSON
+ * (load it in chrome://tracing or Perfetto). Unsampled requests pay one
+ * branch per stage.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <time.h>
+
+#define TRACE_KEEP 256          // finished traces kept for export (power of 2)
+#define TRACE_URL_LEN 128
+
+/* request stages, in the order proxy() reaches them */
+enum trace_stage {
+    TS_ACCEPT,          // connection accepted
+    TS_REQLINE,         // request line read
+    TS_PARSED,          // request line and URL parsed
+    TS_LOOKUP,          // cache looked up
+    TS_CONNECTED,       // open_clientfd returned
+    TS_HEADERS,         // request headers forwarded
+    TS_FIRST_BYTE,      // first upstream byte read
+    TS_RELAYED,         // response relayed
+    TS_INSERTED,        // response inserted into the cache
+    TS_DONE,            // connection closed
+    TS_NSTAGES
+};
+
+/*
+ * trace record of one request
+ *
+ * sampled: nonzero if this request is traced
+ * id: request sequence number
+ * ts: tick count at each stage, 0 if the stage was not reached
+ * url: request URL, truncated to fit
+ */
+typedef struct trace_rec {
+    int sampled;
+    unsigned long id;
+    unsigned long ts[TS_NSTAGES];
+    char url[TRACE_URL_LEN];
+} trace_rec;
+
+/*
+ * trace_ticks - cheap monotonic timestamp
+ * the TSC on x86-64, CLOCK_MONOTONIC_RAW nanoseconds elsewhere
+ */
+static inline unsigned long trace_ticks(void) {
+#if defined(__x86_64__)
+    unsigned int lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * trace_mark - record the current time for stage s of a sampled request
+ */
+static inline void trace_mark(trace_rec *t, enum trace_stage s) {
+    if (t->sampled) {
+        t->ts[s] = trace_ticks();
+    }
+}
+
+/*
+ * helper functions
+ *
+ * trace_init: trace one in every `every` requests (0 disables tracing)
+ * trace_begin: decide whether to sample a new request and mark TS_ACCEPT
+ * trace_finish: mark TS_DONE and keep a sampled trace for export
+ * trace_render: write kept traces as Chrome trace-event JSON
+ */
+void trace_init(unsigned int every);
+void trace_begin(trace_rec *t);
+void trace_finish(trace_rec *t);
+void trace_render(FILE *fp);
+
+#endif /* __TRACE_H__ */
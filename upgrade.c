@@ -0,0 +1,194 @@
+/*
+ * upgrade.c - zero-downtime upgrade by handing listening sockets to a new proxy
+ *
+ * The handoff is one connection on the Unix socket: the old proxy sends a
+ * flag per descriptor slot (upgrade_fd) with the descriptors that exist as
+ * SCM_RIGHTS ancillary data, then writes a cache snapshot (cache_write) and
+ * closes the connection.
+ */
+#include <sys/un.h>
+#include "csapp.h"
+#include "upgrade.h"
+
+/*
+ * sockfd: Unix socket the successor connects to, -1 if not listening
+ * handed: set once a successor has taken over (it owns path from then on)
+ * myfds, mycache, handofffn: what to hand over, and whom to tell
+ */
+static int sockfd = -1;
+static volatile int handed = 0;
+static int myfds[UPGRADE_NFDS];
+static cache_t *mycache;
+static upgrade_handoff_t *handofffn;
+
+/*
+ * helper functions
+ *
+ * unix_addr: fill in the address of a Unix socket at path, -1 if too long
+ * upgrade_thread: wait for a successor and hand everything over
+ */
+static int unix_addr(const char *path, struct sockaddr_un *addr);
+static void *upgrade_thread(void *vargp);
+
+/*
+ * upgrade_receive - take over from the proxy listening at path, if any
+ */
+int upgrade_receive(const char *path, int fds[UPGRADE_NFDS], cache_t *cache) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * UPGRADE_NFDS)];
+    } ctl;
+    int s, i, n, nfds, have[UPGRADE_NFDS], passed[UPGRADE_NFDS];
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    FILE *fp;
+
+    for (i = 0; i < UPGRADE_NFDS; i++) {
+        fds[i] = -1;
+    }
+    if (unix_addr(path, &addr) < 0 || (s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {  // nobody running
+        close(s);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = have;
+    iov.iov_len = sizeof(have);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    if (recvmsg(s, &msg, MSG_WAITALL) != sizeof(have) || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        close(s);
+        return -1;
+    }
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(passed, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    for (i = 0, n = 0; i < UPGRADE_NFDS; i++) {
+        if (have[i] && n < nfds) {
+            fds[i] = passed[n++];
+        }
+    }
+
+    // the cache follows, up to the end of the connection
+    if ((fp = fdopen(s, "r")) == NULL) {
+        close(s);
+        return 0;
+    }
+    if ((n = cache_read(cache, fp)) >= 0) {
+        fprintf(stderr, "took over from the running proxy with %d cached objects\n", n);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * upgrade_listen - listen at path and hand fds and cache to the first successor
+ *                  from a background thread, then call handoff
+ */
+int upgrade_listen(const char *path, const int fds[UPGRADE_NFDS], cache_t *cache,
+                   upgrade_handoff_t *handoff) {
+    struct sockaddr_un addr;
+    pthread_t tid;
+
+    if (unix_addr(path, &addr) < 0 || (sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    unlink(path);   // left by a predecessor, or by a proxy that crashed
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sockfd, 1) < 0) {
+        close(sockfd);
+        sockfd = -1;
+        return -1;
+    }
+    memcpy(myfds, fds, sizeof(myfds));
+    mycache = cache;
+    handofffn = handoff;
+    pthread_create(&tid, NULL, upgrade_thread, NULL);
+    return 0;
+}
+
+/*
+ * upgrade_close - remove path, unless a successor has taken it over
+ */
+void upgrade_close(const char *path) {
+    if (sockfd >= 0 && !handed) {
+        unlink(path);
+    }
+}
+
+/*
+ * unix_addr - fill in the address of a Unix socket at path, -1 if too long
+ */
+static int unix_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * upgrade_thread - wait for a successor and hand everything over
+ */
+static void *upgrade_thread(void *vargp) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * UPGRADE_NFDS)];
+    } ctl;
+    int connfd, i, n, have[UPGRADE_NFDS], passed[UPGRADE_NFDS];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    FILE *fp;
+
+    pthread_detach(pthread_self());
+    for (i = 0, n = 0; i < UPGRADE_NFDS; i++) {
+        if ((have[i] = myfds[i] >= 0)) {
+            passed[n++] = myfds[i];
+        }
+    }
+
+    while (1) {
+        if ((connfd = accept(sockfd, NULL, NULL)) < 0) {
+            continue;
+        }
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = have;
+        iov.iov_len = sizeof(have);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cmsg), passed, sizeof(int) * n);
+        if (sendmsg(connfd, &msg, 0) != sizeof(have)) {
+            close(connfd);
+            continue;
+        }
+
+        // the successor owns the listening sockets now: send the cache and step aside
+        handed = 1;
+        if ((fp = fdopen(connfd, "w")) != NULL) {
+            n = cache_write(mycache, fp);
+            fclose(fp);
+        } else {
+            close(connfd);
+            n = 0;
+        }
+        fprintf(stderr, "handed over to the new proxy with %d cached objects\n", n);
+        close(sockfd);
+        handofffn();
+        return NULL;
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * upgrade.h - zero-downtime upgrade by handing listening sockets to a new proxy
+ *
+ * A proxy started with -u <path> listens for its successor on a Unix socket
+ * at path. A new proxy started with the same -u connects there first and
+ * receives the listening descriptors with SCM_RIGHTS, then a snapshot of the
+ * cache, so it accepts connections with a warm cache while the old proxy
+ * stops accepting and drains. The new proxy then takes over path itself.
+ */
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include "cache.h"
+
+/* listening descriptors handed over, -1 where there is none */
+enum upgrade_fd {
+    UPGRADE_PROXY,      // proxy port
+    UPGRADE_ADMIN,      // admin port
+    UPGRADE_NFDS
+};
+
+/*
+ * upgrade_handoff_t: called once the descriptors and cache were handed over
+ */
+typedef void upgrade_handoff_t(void);
+
+/*
+ * helper functions
+ *
+ * upgrade_receive: take over from the proxy listening at path, if any
+ *                  fills fds and inserts the old proxy's cache into cache
+ *                  return 0 after a takeover, -1 if no proxy answered
+ * upgrade_listen: listen at path and hand fds and cache to the first successor
+ *                 from a background thread, then call handoff
+ *                 return 0 on success, -1 if path cannot be bound
+ * upgrade_close: remove path, unless a successor has taken it over
+ */
+int upgrade_receive(const char *path, int fds[UPGRADE_NFDS], cache_t *cache);
+int upgrade_listen(const char *path, const int fds[UPGRADE_NFDS], cache_t *cache,
+                   upgrade_handoff_t *handoff);
+void upgrade_close(const char *path);
+
+#endif /* __UPGRADE_H__ */
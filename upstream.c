@@ -0,0 +1,534 @@
+/*
+ * upstream.c - upstream server groups for reverse proxying
+ */
+#include <poll.h>
+#include "csapp.h"
+#include "metrics.h"
+#include "http.h"
+#include "upstream.h"
+
+/*
+ * helper functions
+ *
+ * hash: FNV-1a of n bytes of s, continuing from h
+ * cmp_point: order ring points by hash
+ * idle_usable: nonzero if a pooled connection has not been closed or written to by the server
+ * available: nonzero if server s is neither ejected nor down
+ * slow: nonzero if the latency EWMA of server s is an outlier in its group
+ * eject: take server s out of selection, unless half the group is out already
+ * probe: nonzero if sv answers a GET of path with 2xx or 3xx
+ * quantile: q-quantile of both ttfb generations of g in nanoseconds
+ * attach: shared state of the server host:port, created if new, with a reference taken
+ * detach: drop a reference to st, freeing it and its pool with the last one
+ */
+static unsigned int hash(unsigned int h, const char *s, int n);
+static int cmp_point(const void *a, const void *b);
+static int idle_usable(int fd);
+static int available(upstream_group *g, int s, long now);
+static int slow(upstream_group *g, int s);
+static void eject(upstream_group *g, int s, long now);
+static int probe(upstream_server *sv, const char *path, int timeout);
+static long quantile(upstream_group *g, double q);
+static upstream_state *attach(const char *host, const char *port);
+static void detach(upstream_state *st);
+
+#define FNV_BASIS 2166136261U
+
+/* shared server states, outside any snapshot; the lock is only taken at load and free */
+static upstream_state *states;
+static pthread_mutex_t stateslock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * upstream_add_server - add the server "host:port" to g
+ * return 0 on success, -1 if it is malformed or g is full
+ */
+int upstream_add_server(upstream_group *g, const char *hostport) {
+    const char *colon = strrchr(hostport, ':');
+    upstream_server *s;
+
+    if (g->nservers == UPSTREAM_MAX_SERVERS || colon == NULL || colon == hostport ||
+        colon - hostport >= UPSTREAM_NAME_LEN || colon[1] == '\0' || strlen(colon + 1) >= UPSTREAM_PORT_LEN) {
+        return -1;
+    }
+    s = &g->servers[g->nservers++];
+    memcpy(s->host, hostport, colon - hostport);
+    s->host[colon - hostport] = '\0';
+    strcpy(s->port, colon + 1);
+    return 0;
+}
+
+/*
+ * upstream_policy_parse - policy named s, -1 if none
+ */
+int upstream_policy_parse(const char *s) {
+    if (!strcmp(s, "roundrobin")) {
+        return UPSTREAM_ROUND_ROBIN;
+    } else if (!strcmp(s, "leastconn")) {
+        return UPSTREAM_LEAST_CONN;
+    } else if (!strcmp(s, "hash")) {
+        return UPSTREAM_HASH;
+    }
+    return -1;
+}
+
+/*
+ * upstream_prepare - attach the servers of g to their shared state and build the hash ring
+ * called once g is fully configured
+ */
+void upstream_prepare(upstream_group *g) {
+    char point[UPSTREAM_NAME_LEN + UPSTREAM_PORT_LEN + 16];
+    int i, v, n;
+
+    for (i = 0; i < g->nservers; i++) {
+        g->servers[i].state = attach(g->servers[i].host, g->servers[i].port);
+    }
+    if (g->policy != UPSTREAM_HASH) {
+        return;
+    }
+    g->ring = malloc(g->nservers * UPSTREAM_VNODES * sizeof(upstream_point));
+    for (i = 0; i < g->nservers; i++) {
+        for (v = 0; v < UPSTREAM_VNODES; v++) {
+            n = sprintf(point, "%s:%s#%d", g->servers[i].host, g->servers[i].port, v);
+            g->ring[g->nring].hash = hash(FNV_BASIS, point, n);
+            g->ring[g->nring++].server = i;
+        }
+    }
+    qsort(g->ring, g->nring, sizeof(upstream_point), cmp_point);
+}
+
+/*
+ * upstream_release_all - detach g from the shared state and free what upstream_prepare set up
+ * called when the snapshot holding g is freed, so nothing else uses it
+ */
+void upstream_release_all(upstream_group *g) {
+    int i;
+
+    for (i = 0; i < g->nservers; i++) {
+        detach(g->servers[i].state);
+    }
+    free(g->ring);
+}
+
+/*
+ * upstream_find - group called name among groups, NULL if there is none
+ */
+upstream_group *upstream_find(upstream_group *groups, int ngroups, const char *name) {
+    int i;
+
+    for (i = 0; i < ngroups; i++) {
+        if (!strcmp(groups[i].name, name)) {
+            return &groups[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * upstream_pick - server of g for the object host:port/uri
+ * ejected and down servers are skipped, unless all of them are
+ */
+int upstream_pick(upstream_group *g, const char *host, const char *port, const char *uri) {
+    unsigned int h, start = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED);
+    int i, s, best = -1, lo, hi, mid;
+    long now = metrics_now();
+
+    switch (g->policy) {
+    case UPSTREAM_LEAST_CONN:
+        // scan from the round-robin position so ties spread over the servers
+        for (i = 0; i < g->nservers; i++) {
+            s = (start + i) % g->nservers;
+            if (available(g, s, now) && (best < 0 ||
+                __atomic_load_n(&g->servers[s].state->active, __ATOMIC_RELAXED) <
+                __atomic_load_n(&g->servers[best].state->active, __ATOMIC_RELAXED))) {
+                best = s;
+            }
+        }
+        return best >= 0 ? best : start % g->nservers;
+    case UPSTREAM_HASH:
+        // first point at or after the key's hash, wrapping around the ring;
+        // the objects of an unavailable server move to the next one along
+        h = hash(hash(hash(FNV_BASIS, host, strlen(host)), port, strlen(port)), uri, strlen(uri));
+        lo = 0;
+        hi = g->nring;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (g->ring[mid].hash < h) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (i = 0; i < g->nring; i++) {
+            s = g->ring[(lo + i) % g->nring].server;
+            if (available(g, s, now)) {
+                return s;
+            }
+        }
+        return g->ring[lo % g->nring].server;
+    default:
+        for (i = 0; i < g->nservers; i++) {
+            s = (start + i) % g->nservers;
+            if (available(g, s, now)) {
+                return s;
+            }
+        }
+        return start % g->nservers;
+    }
+}
+
+/*
+ * upstream_connect - connection to server s of g, pooled if one is idle
+ * return -1 if the server is unreachable
+ */
+int upstream_connect(upstream_group *g, int s, int *reused) {
+    upstream_state *sv = g->servers[s].state;
+    int fd = -1;
+
+    __atomic_fetch_add(&sv->active, 1, __ATOMIC_RELAXED);
+    *reused = 0;
+    pthread_mutex_lock(&sv->lock);
+    while (fd < 0 && sv->nidle > 0) {
+        fd = sv->idle[--sv->nidle];
+        if (!idle_usable(fd)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&sv->lock);
+
+    if (fd >= 0) {
+        *reused = 1;
+    } else if ((fd = open_clientfd(sv->host, sv->port)) < 0) {
+        __atomic_fetch_sub(&sv->active, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * upstream_done - end a request to server s, pooling or closing fd
+ */
+void upstream_done(upstream_group *g, int s, int fd, int reusable) {
+    upstream_state *sv = g->servers[s].state;
+
+    __atomic_fetch_sub(&sv->active, 1, __ATOMIC_RELAXED);
+    if (fd < 0) {
+        return;
+    }
+    if (reusable) {
+        pthread_mutex_lock(&sv->lock);
+        if (sv->nidle < g->keepalive) {
+            sv->idle[sv->nidle++] = fd;
+            fd = -1;
+        }
+        pthread_mutex_unlock(&sv->lock);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/*
+ * upstream_report - record how a request to server s went
+ * status is the response status, 0 if there was none, -1 if the connect failed
+ */
+void upstream_report(upstream_group *g, int s, int status, long latency) {
+    upstream_state *sv = g->servers[s].state;
+    int failed = status <= 0 || status >= 500, fails = 0, n, gen, b;
+    long now = metrics_now(), v, us = latency / 1000;
+
+    n = __atomic_add_fetch(&sv->samples, 1, __ATOMIC_RELAXED);
+    v = __atomic_load_n(&sv->error_ewma, __ATOMIC_RELAXED);
+    v += ((failed ? UPSTREAM_ERROR_SCALE : 0) - v) / (1 << UPSTREAM_EWMA_SHIFT);
+    __atomic_store_n(&sv->error_ewma, v, __ATOMIC_RELAXED);
+    if (status > 0) {
+        // a sample counts for at most an outlier's worth, so one straggler
+        // cannot eject a server but a run of slow responses still does
+        v = __atomic_load_n(&sv->latency_ewma, __ATOMIC_RELAXED);
+        if (v == 0) {
+            v = us;
+        } else {
+            v += ((us < UPSTREAM_SLOW_FACTOR * v ? us : UPSTREAM_SLOW_FACTOR * v) - v) / (1 << UPSTREAM_EWMA_SHIFT);
+        }
+        __atomic_store_n(&sv->latency_ewma, v, __ATOMIC_RELAXED);
+
+        // the hedge delay follows the group's recent p95, recomputed every 64
+        // responses; the response starting a window clears the generation
+        // holding the window before last (samples racing with it are lost)
+        v = __atomic_add_fetch(&g->nttfb, 1, __ATOMIC_RELAXED);
+        gen = (v / UPSTREAM_HEDGE_WINDOW) & 1;
+        if (v % UPSTREAM_HEDGE_WINDOW == 0) {
+            for (b = 0; b < HIST_BUCKETS; b++) {
+                __atomic_store_n(&g->ttfb[gen][b], 0, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_fetch_add(&g->ttfb[gen][metrics_bucket(us)], 1, __ATOMIC_RELAXED);
+        if (g->hedge > 0 && v >= UPSTREAM_HEDGE_SAMPLES && v % 64 == 0) {
+            __atomic_store_n(&g->hedge_after, quantile(g, 0.95), __ATOMIC_RELAXED);
+            __atomic_store_n(&g->tail, quantile(g, 0.99), __ATOMIC_RELAXED);
+        }
+    }
+    if (g->hedge > 0) {
+        v = __atomic_load_n(&g->hedge_tokens, __ATOMIC_RELAXED);
+        do {
+            if (v >= UPSTREAM_HEDGE_BURST * 100) {
+                break;
+            }
+        } while (!__atomic_compare_exchange_n(&g->hedge_tokens, &v, v + g->hedge, 1,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    if (failed) {
+        fails = __atomic_add_fetch(&sv->fails, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&sv->fails, 0, __ATOMIC_RELAXED);
+    }
+
+    if (g->max_fails == 0 || __atomic_load_n(&sv->ejected_until, __ATOMIC_RELAXED) > now) {
+        return;
+    }
+    if (fails >= g->max_fails || (n >= UPSTREAM_MIN_SAMPLES &&
+        (__atomic_load_n(&sv->error_ewma, __ATOMIC_RELAXED) > UPSTREAM_ERROR_SCALE / 2 || slow(g, s)))) {
+        eject(g, s, now);
+    } else if (!failed) {
+        __atomic_store_n(&sv->ejections, 0, __ATOMIC_RELAXED);   // healthy again: reset the backoff
+    }
+}
+
+/*
+ * upstream_probe - probe every server of g once, waiting up to timeout seconds for each
+ * max_fails failed probes in a row mark a server down, and one success brings it back
+ */
+void upstream_probe(upstream_group *g, int timeout) {
+    upstream_state *sv;
+    int i, limit = g->max_fails > 0 ? g->max_fails : 1;
+
+    for (i = 0; i < g->nservers; i++) {
+        sv = g->servers[i].state;
+        if (probe(&g->servers[i], g->check_path, timeout)) {
+            __atomic_store_n(&sv->probe_fails, 0, __ATOMIC_RELAXED);
+            if (__atomic_exchange_n(&sv->down, 0, __ATOMIC_RELAXED)) {
+                fprintf(stderr, "upstream %s:%s of %s is up\n", sv->host, sv->port, g->name);
+            }
+            continue;
+        }
+        metrics_add(M_HEALTH_PROBE_FAILURES, 1);
+        if (__atomic_add_fetch(&sv->probe_fails, 1, __ATOMIC_RELAXED) >= limit &&
+            !__atomic_exchange_n(&sv->down, 1, __ATOMIC_RELAXED)) {
+            fprintf(stderr, "upstream %s:%s of %s is down\n", sv->host, sv->port, g->name);
+        }
+    }
+}
+
+/*
+ * upstream_pick_other - available server of g other than s, -1 if there is none
+ */
+int upstream_pick_other(upstream_group *g, int s) {
+    long now = metrics_now();
+    int i, o;
+
+    for (i = 1; i < g->nservers; i++) {
+        o = (s + i) % g->nservers;
+        if (available(g, o, now)) {
+            return o;
+        }
+    }
+    return -1;
+}
+
+/*
+ * upstream_hedge - take a hedge from the budget of g, 0 if it is spent
+ */
+int upstream_hedge(upstream_group *g) {
+    long v = __atomic_load_n(&g->hedge_tokens, __ATOMIC_RELAXED);
+
+    do {
+        if (v < 100) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&g->hedge_tokens, &v, v - 100, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ * hash - FNV-1a of n bytes of s, continuing from h
+ */
+static unsigned int hash(unsigned int h, const char *s, int n) {
+    while (n-- > 0) {
+        h = (h ^ (unsigned char)*s++) * 16777619U;
+    }
+    return h;
+}
+
+/*
+ * cmp_point - order ring points by hash
+ */
+static int cmp_point(const void *a, const void *b) {
+    unsigned int x = ((const upstream_point *)a)->hash, y = ((const upstream_point *)b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * idle_usable - nonzero if a pooled connection has not been closed or written to by the server
+ * anything readable on an idle connection (EOF, an error, stray bytes) makes it unusable
+ */
+static int idle_usable(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/*
+ * available - nonzero if server s is neither ejected nor down
+ */
+static int available(upstream_group *g, int s, long now) {
+    upstream_state *sv = g->servers[s].state;
+
+    return !__atomic_load_n(&sv->down, __ATOMIC_RELAXED) &&
+           __atomic_load_n(&sv->ejected_until, __ATOMIC_RELAXED) <= now;
+}
+
+/*
+ * slow - nonzero if the latency EWMA of server s is an outlier in its group
+ * compared with the mean of the other servers that have enough samples
+ */
+static int slow(upstream_group *g, int s) {
+    long mine = __atomic_load_n(&g->servers[s].state->latency_ewma, __ATOMIC_RELAXED), sum = 0;
+    int i, n = 0;
+
+    if (mine < UPSTREAM_SLOW_FLOOR) {
+        return 0;
+    }
+    for (i = 0; i < g->nservers; i++) {
+        if (i != s && __atomic_load_n(&g->servers[i].state->samples, __ATOMIC_RELAXED) >= UPSTREAM_MIN_SAMPLES) {
+            sum += __atomic_load_n(&g->servers[i].state->latency_ewma, __ATOMIC_RELAXED);
+            n++;
+        }
+    }
+    return n > 0 && mine > UPSTREAM_SLOW_FACTOR * (sum / n);
+}
+
+/*
+ * eject - take server s out of selection for fail_timeout seconds, doubled per ejection in a row
+ * its EWMAs start over, so once back it needs fresh samples to be ejected by them again
+ */
+static void eject(upstream_group *g, int s, long now) {
+    upstream_state *sv = g->servers[s].state;
+    int i, out = 0, e;
+    long secs;
+
+    for (i = 0; i < g->nservers; i++) {
+        out += i != s && !available(g, i, now);
+    }
+    if ((out + 1) * 2 > g->nservers) {
+        return;
+    }
+    e = __atomic_fetch_add(&sv->ejections, 1, __ATOMIC_RELAXED);
+    secs = (long)g->fail_timeout << (e < UPSTREAM_MAX_BACKOFF ? e : UPSTREAM_MAX_BACKOFF);
+    __atomic_store_n(&sv->ejected_until, now + secs * 1000000000L, __ATOMIC_RELAXED);
+    __atomic_store_n(&sv->fails, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&sv->samples, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&sv->error_ewma, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&sv->latency_ewma, 0, __ATOMIC_RELAXED);
+    metrics_add(M_UPSTREAM_EJECTIONS, 1);
+    fprintf(stderr, "ejecting upstream %s:%s of %s for %ld seconds\n", sv->host, sv->port, g->name, secs);
+}
+
+/*
+ * probe - nonzero if sv answers a GET of path with 2xx or 3xx within timeout seconds
+ */
+static int probe(upstream_server *sv, const char *path, int timeout) {
+    struct timeval tv = {timeout, 0};
+    char buf[MAXLINE];
+    rio_t rio;
+    int fd, n;
+
+    if ((fd = open_clientfd(sv->host, sv->port)) < 0) {
+        return 0;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\nHost: %s:%s\r\nConnection: close\r\n\r\n",
+                 path, sv->host, sv->port);
+    if (rio_writen(fd, buf, n) < 0) {
+        close(fd);
+        return 0;
+    }
+    rio_readinitb(&rio, fd);
+    n = rio_readlineb(&rio, buf, sizeof(buf));
+    close(fd);
+    n = n > 0 ? response_status(buf, n) : 0;
+    return n >= 200 && n < 400;
+}
+
+/*
+ * quantile - q-quantile of both ttfb generations of g in nanoseconds
+ */
+static long quantile(upstream_group *g, double q) {
+    unsigned long count[HIST_BUCKETS], total = 0, rank, seen = 0;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        count[b] = __atomic_load_n(&g->ttfb[0][b], __ATOMIC_RELAXED) +
+                   __atomic_load_n(&g->ttfb[1][b], __ATOMIC_RELAXED);
+        total += count[b];
+    }
+    rank = (unsigned long)(q * total);
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += count[b];
+        if (seen > rank) {
+            break;
+        }
+    }
+    return metrics_bucket_upper(b < HIST_BUCKETS ? b : HIST_BUCKETS - 1) * 1000L;
+}
+
+/*
+ * attach - shared state of the server host:port, created if new, with a reference taken
+ */
+static upstream_state *attach(const char *host, const char *port) {
+    upstream_state *st;
+
+    pthread_mutex_lock(&stateslock);
+    for (st = states; st != NULL; st = st->next) {
+        if (!strcmp(st->host, host) && !strcmp(st->port, port)) {
+            break;
+        }
+    }
+    if (st == NULL) {
+        st = calloc(1, sizeof(upstream_state));
+        strcpy(st->host, host);
+        strcpy(st->port, port);
+        pthread_mutex_init(&st->lock, NULL);
+        st->next = states;
+        states = st;
+    }
+    st->refcnt++;
+    pthread_mutex_unlock(&stateslock);
+    return st;
+}
+
+/*
+ * detach - drop a reference to st, freeing it and its pool with the last one
+ * a new snapshot attaches before the old one detaches, so servers it keeps
+ * never reach zero
+ */
+static void detach(upstream_state *st) {
+    upstream_state **pp;
+
+    pthread_mutex_lock(&stateslock);
+    if (--st->refcnt > 0) {
+        pthread_mutex_unlock(&stateslock);
+        return;
+    }
+    for (pp = &states; *pp != st; pp = &(*pp)->next)
+        ;
+    *pp = st->next;
+    pthread_mutex_unlock(&stateslock);
+
+    while (st->nidle > 0) {
+        close(st->idle[--st->nidle]);
+    }
+    pthread_mutex_destroy(&st->lock);
+    free(st);
+}
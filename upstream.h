@@ -0,0 +1,185 @@
+/*
+ * upstream.h - upstream server groups for reverse proxying
+ *
+ * A group is a named set of origin servers. Requests for a group (every
+ * request in reverse-proxy mode, or forward requests whose host is the
+ * group name) go to one of its servers, picked round-robin, by fewest
+ * requests in flight, or by consistent hashing of the cache key so a given
+ * object always goes to the same origin and its page cache stays warm.
+ * Servers keep up to keepalive idle connections for reuse.
+ *
+ * Every request reports how its server did. max_fails consecutive failures
+ * (connect errors, 5xx, no response) eject the server for fail_timeout
+ * seconds, doubling on each ejection in a row; so does an error-rate EWMA
+ * over one half, or a latency EWMA UPSTREAM_SLOW_FACTOR times the mean of
+ * the rest of the group (each sample capped at that factor times the EWMA,
+ * so it takes a run of slow responses). No more than half the group is
+ * ejected at once.
+ * A group with health_check is also probed in the background, and servers
+ * failing max_fails probes in a row are down until a probe succeeds.
+ * Selection skips ejected and down servers unless none is left.
+ *
+ * With hedge, a GET or HEAD whose server has not answered within the
+ * group's p95 time to first byte over its last UPSTREAM_HEDGE_WINDOW to twice
+ * that many responses is sent to a second server as well, and the first to
+ * answer wins. Each request earns hedge/100 of a hedge, so at
+ * most hedge percent of requests (in bursts of UPSTREAM_HEDGE_BURST) are sent
+ * twice.
+ *
+ * Groups belong to a configuration snapshot (config.h) and are set up once
+ * it is loaded; their round-robin position and hedge statistics go away
+ * with it. The health and pooled connections of a server live outside the
+ * snapshots, in a table keyed by host:port, so a reload keeps ejections,
+ * probe results, EWMAs and idle connections of the servers it still names;
+ * an entry goes away with the last snapshot naming its server.
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <pthread.h>
+#include "metrics.h"
+
+#define UPSTREAM_MAX_GROUPS 16
+#define UPSTREAM_MAX_SERVERS 32
+#define UPSTREAM_MAX_IDLE 64       // largest keepalive
+#define UPSTREAM_NAME_LEN 64
+#define UPSTREAM_PORT_LEN 16
+#define UPSTREAM_VNODES 64          // points per server on the hash ring
+#define UPSTREAM_PATH_LEN 256
+#define UPSTREAM_MAX_FAILS 3        // default max_fails
+#define UPSTREAM_FAIL_TIMEOUT 10    // default fail_timeout (seconds)
+#define UPSTREAM_CHECK_INTERVAL 5   // default health_check interval (seconds)
+#define UPSTREAM_MAX_BACKOFF 6      // ejection time stops doubling after this many
+#define UPSTREAM_EWMA_SHIFT 3       // EWMA weight of a new sample: 1/8
+#define UPSTREAM_ERROR_SCALE 1024   // error-rate EWMA of 1.0
+#define UPSTREAM_MIN_SAMPLES 8      // requests before the EWMAs can eject a server
+#define UPSTREAM_SLOW_FACTOR 4      // latency outlier: this many times the group mean
+#define UPSTREAM_SLOW_FLOOR 10000   // ... and at least this many microseconds
+#define UPSTREAM_HEDGE_SAMPLES 100  // responses before a group hedges
+#define UPSTREAM_HEDGE_BURST 10     // hedges that can be saved up
+#define UPSTREAM_HEDGE_WINDOW 1024  // responses per generation of the ttfb histogram
+
+enum upstream_policy {
+    UPSTREAM_ROUND_ROBIN,
+    UPSTREAM_LEAST_CONN,
+    UPSTREAM_HASH
+};
+
+/*
+ * health and pool of an origin server, shared by every snapshot naming it
+ *
+ * refcnt: servers of prepared groups pointing here, under the table lock
+ * active: requests in flight (atomic)
+ * fails: consecutive failed requests
+ * ejections: ejections in a row, each twice as long as the last
+ * ejected_until: metrics_now() time the current ejection ends
+ * samples, error_ewma, latency_ewma: requests seen, error rate (of
+ *     UPSTREAM_ERROR_SCALE), and time to first byte in microseconds
+ * probe_fails, down: consecutive failed health probes, and whether they reached max_fails
+ * idle, nidle: pooled connections, under lock
+ *
+ * health fields are updated with relaxed atomics and no lock; concurrent
+ * reports may lose an EWMA sample, which only blurs the averages
+ */
+typedef struct upstream_state {
+    char host[UPSTREAM_NAME_LEN];
+    char port[UPSTREAM_PORT_LEN];
+    int refcnt;
+    struct upstream_state *next;
+    int active;
+    int fails;
+    int ejections;
+    long ejected_until;
+    int samples;
+    long error_ewma;
+    long latency_ewma;
+    int probe_fails;
+    int down;
+    pthread_mutex_t lock;
+    int idle[UPSTREAM_MAX_IDLE];
+    int nidle;
+} upstream_state;
+
+/* origin server of a group; state is set by upstream_prepare */
+typedef struct upstream_server {
+    char host[UPSTREAM_NAME_LEN];
+    char port[UPSTREAM_PORT_LEN];
+    upstream_state *state;
+} upstream_server;
+
+/* point on the consistent-hash ring */
+typedef struct upstream_point {
+    unsigned int hash;
+    int server;
+} upstream_point;
+
+/*
+ * group of servers
+ *
+ * keepalive: idle connections pooled per server (0: close after each request)
+ * max_fails, fail_timeout: failures that eject a server (0: never), and for how many seconds
+ * check_path, check_interval: path probed on every server, and how often (empty: no probes)
+ * hedge, hedge_tokens: percent of requests that may be hedged (0: none), and hedges
+ *     earned in hundredths (atomic)
+ * ttfb, nttfb: time to first byte histograms (as in metrics.h) of the current and the
+ *     previous UPSTREAM_HEDGE_WINDOW responses, alternating, and the response count (atomic)
+ * hedge_after, tail: p95 and p99 of both ttfb generations in nanoseconds, 0 until
+ *     UPSTREAM_HEDGE_SAMPLES
+ * next: round-robin position (atomic)
+ * ring, nring: hash ring sorted by hash, built by upstream_prepare
+ */
+typedef struct upstream_group {
+    char name[UPSTREAM_NAME_LEN];
+    enum upstream_policy policy;
+    int keepalive;
+    int max_fails;
+    int fail_timeout;
+    char check_path[UPSTREAM_PATH_LEN];
+    int check_interval;
+    int hedge;
+    long hedge_tokens;
+    unsigned long ttfb[2][HIST_BUCKETS];
+    unsigned long nttfb;
+    long hedge_after;
+    long tail;
+    upstream_server servers[UPSTREAM_MAX_SERVERS];
+    int nservers;
+    unsigned int next;
+    upstream_point *ring;
+    int nring;
+} upstream_group;
+
+/*
+ * helper functions
+ *
+ * upstream_add_server: add the server "host:port" to g, -1 if it is malformed or g is full
+ * upstream_policy_parse: policy named s ("roundrobin", "leastconn", "hash"), -1 if none
+ * upstream_prepare: attach the servers of g to their shared state and build the hash ring
+ *                   once g is fully configured
+ * upstream_release_all: detach g from the shared state and free what upstream_prepare set up
+ * upstream_find: group called name among groups, NULL if there is none
+ * upstream_pick: server of g for the object host:port/uri
+ * upstream_connect: connection to server s of g, pooled if one is idle, counted as in flight
+ *                   *reused is set if it was pooled; return -1 if the server is unreachable
+ * upstream_done: end a request to server s; fd (unless -1) goes back to the pool if
+ *                reusable and there is room, and is closed otherwise
+ * upstream_report: record how a request to server s went: its response status (0 if
+ *                  none, -1 if the connect failed) and time to first byte in nanoseconds
+ * upstream_probe: probe every server of g once, waiting up to timeout seconds for each
+ * upstream_pick_other: available server of g other than s, -1 if there is none
+ * upstream_hedge: take a hedge from the budget of g, 0 if it is spent
+ */
+int upstream_add_server(upstream_group *g, const char *hostport);
+int upstream_policy_parse(const char *s);
+void upstream_prepare(upstream_group *g);
+void upstream_release_all(upstream_group *g);
+upstream_group *upstream_find(upstream_group *groups, int ngroups, const char *name);
+int upstream_pick(upstream_group *g, const char *host, const char *port, const char *uri);
+int upstream_connect(upstream_group *g, int s, int *reused);
+void upstream_done(upstream_group *g, int s, int fd, int reusable);
+void upstream_report(upstream_group *g, int s, int status, long latency);
+void upstream_probe(upstream_group *g, int timeout);
+int upstream_pick_other(upstream_group *g, int s);
+int upstream_hedge(upstream_group *g);
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,83 @@
+/*
+ * workq.c - bounded queue of connections handed between threads
+ */
+#include "csapp.h"
+#include "workq.h"
+
+/*
+ * helper functions
+ *
+ * take: P on sem, resumed after signals (which the proxy takes for SIGHUP and SIGTERM)
+ * push: add item at the rear of q, once a free slot has been taken
+ */
+static void take(sem_t *sem);
+static void push(workq_t *q, void *item);
+
+/*
+ * workq_init - make q an empty queue of n slots
+ */
+void workq_init(workq_t *q, int n) {
+    q->buf = Calloc(n, sizeof(void *));
+    q->n = n;
+    q->front = q->rear = 0;     // empty iff front == rear
+    Sem_init(&q->mutex, 0, 1);
+    Sem_init(&q->slots, 0, n);
+    Sem_init(&q->items, 0, 0);
+}
+
+/*
+ * workq_put - add item at the rear of q, waiting for a free slot
+ */
+void workq_put(workq_t *q, void *item) {
+    take(&q->slots);
+    push(q, item);
+}
+
+/*
+ * workq_tryput - add item at the rear of q, -1 if q is full
+ */
+int workq_tryput(workq_t *q, void *item) {
+    while (sem_trywait(&q->slots) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    push(q, item);
+    return 0;
+}
+
+/*
+ * workq_get - remove the first item of q, waiting for one
+ */
+void *workq_get(workq_t *q) {
+    void *item;
+
+    take(&q->items);
+    take(&q->mutex);
+    item = q->buf[(++q->front) % q->n];
+    V(&q->mutex);
+    V(&q->slots);
+    return item;
+}
+
+/*
+ * take - P on sem, resumed after signals (which the proxy takes for SIGHUP and SIGTERM)
+ * sem_wait fails with EINTR whatever SA_RESTART says, and P treats that as fatal
+ */
+static void take(sem_t *sem) {
+    while (sem_wait(sem) < 0) {
+        if (errno != EINTR) {
+            unix_error("sem_wait error");
+        }
+    }
+}
+
+/*
+ * push - add item at the rear of q, once a free slot has been taken
+ */
+static void push(workq_t *q, void *item) {
+    take(&q->mutex);
+    q->buf[(++q->rear) % q->n] = item;
+    V(&q->mutex);
+    V(&q->items);
+}
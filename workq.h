@@ -0,0 +1,44 @@
+/*
+ * workq.h - bounded queue of connections handed between threads
+ *
+ * The CS:APP shared buffer (tiny/sbuf.c) holding pointers: a mutex and
+ * counting semaphores for free slots and queued items. workq_tryput fails
+ * instead of waiting, for producers that would rather refuse work than
+ * stall behind a full queue.
+ */
+#ifndef __WORKQ_H__
+#define __WORKQ_H__
+
+#include <semaphore.h>
+
+/*
+ * queue
+ *
+ * buf, n: ring of n slots
+ * front, rear: buf[(front+1)%n] is the first item, buf[rear%n] the last
+ * mutex, slots, items: protects buf, counts free slots, counts items
+ */
+typedef struct workq {
+    void **buf;
+    int n;
+    int front;
+    int rear;
+    sem_t mutex;
+    sem_t slots;
+    sem_t items;
+} workq_t;
+
+/*
+ * helper functions
+ *
+ * workq_init: make q an empty queue of n slots
+ * workq_put: add item at the rear of q, waiting for a free slot
+ * workq_tryput: add item at the rear of q, -1 if q is full
+ * workq_get: remove the first item of q, waiting for one
+ */
+void workq_init(workq_t *q, int n);
+void workq_put(workq_t *q, void *item);
+int workq_tryput(workq_t *q, void *item);
+void *workq_get(workq_t *q);
+
+#endif /* __WORKQ_H__ */